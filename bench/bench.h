@@ -0,0 +1,47 @@
+#ifndef BENCH_BENCH_H_
+#define BENCH_BENCH_H_
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "cpyp/random.h"
+
+// helpers shared by the benchmarks: synthetic Zipfian data and timing
+
+namespace cpyp {
+
+// unnormalized cumulative Zipfian (exponent 1) weights of types 0..types-1
+inline std::vector<double> zipf_cdf(unsigned types) {
+  std::vector<double> cdf(types);
+  double z = 0;
+  for (unsigned i = 0; i < types; ++i)
+    cdf[i] = (z += 1.0 / (i + 1));
+  return cdf;
+}
+
+// probability of type w under the distribution whose cdf is given
+inline double zipf_prob(unsigned w, const std::vector<double>& cdf) {
+  return 1.0 / ((w + 1) * cdf.back());
+}
+
+template <typename Engine>
+std::vector<unsigned> zipf_draws(unsigned n, const std::vector<double>& cdf, Engine& eng) {
+  const double z = cdf.back();
+  std::vector<unsigned> draws(n);
+  for (auto& d : draws)
+    d = std::lower_bound(cdf.begin(), cdf.end(), sample_uniform01<double>(eng) * z) - cdf.begin();
+  return draws;
+}
+
+// runs f() once and returns its wall-clock time divided by ops
+template <class F>
+double ns_per_op(unsigned ops, F f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+}
+
+}
+
+#endif
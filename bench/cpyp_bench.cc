@@ -0,0 +1,266 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "cpyp/random.h"
+#include "cpyp/crp.h"
+#include "cpyp/mf_crp.h"
+#include "cpyp/msparse_vector.h"
+#include "cpyp/slice_sampler.h"
+#include "cpyp/binary_archive.h"
+#include "hpyplm/hpyplm.h"
+#include "bench/bench.h"
+
+using namespace std;
+using namespace cpyp;
+
+struct result {
+  string name;
+  unsigned ops;
+  double ns;  // per op
+};
+
+// sentences of 1 to 40 Zipfian words (ids 1..types, 0 is reserved for <s>
+// and types + 1 for </s>) until the corpus holds `tokens` words
+template <typename Engine>
+vector<vector<unsigned> > zipf_corpus(unsigned tokens, const vector<double>& cdf, Engine& eng) {
+  const vector<unsigned> draws = zipf_draws(tokens, cdf, eng);
+  vector<vector<unsigned> > corpus;
+  for (unsigned i = 0; i < tokens; ) {
+    const unsigned len = min<unsigned>(1 + sample_uniform01<double>(eng) * 40, tokens - i);
+    corpus.push_back(vector<unsigned>());
+    for (unsigned j = 0; j < len; ++j) corpus.back().push_back(draws[i++] + 1);
+  }
+  return corpus;
+}
+
+template <typename Engine>
+void bench_crp(const vector<unsigned>& draws, const vector<double>& cdf, Engine& eng, vector<result>* res) {
+  const unsigned n = draws.size();
+  crp<unsigned> r(0.5, 1.0);
+  res->push_back({"crp_increment", n, ns_per_op(n, [&]() {
+    for (unsigned w : draws) r.increment(w, zipf_prob(w, cdf), eng);
+  })});
+  double sum = 0;
+  res->push_back({"crp_prob", n, ns_per_op(n, [&]() {
+    for (unsigned w : draws) sum += r.prob(w, zipf_prob(w, cdf));
+  })});
+  const unsigned llh_calls = 1000;
+  res->push_back({"crp_log_likelihood", llh_calls, ns_per_op(llh_calls, [&]() {
+    for (unsigned i = 0; i < llh_calls; ++i)
+      sum += r.log_likelihood(0.1 + 0.8 * i / llh_calls, 1.0 + i % 10);
+  })});
+  res->push_back({"crp_decrement", n, ns_per_op(n, [&]() {
+    for (unsigned w : draws) r.decrement(w, eng);
+  })});
+  if (sum == 0) cerr << "unexpected sum\n";
+}
+
+template <typename Engine>
+void bench_mf_crp(const vector<unsigned>& draws, const vector<double>& cdf, Engine& eng, vector<result>* res) {
+  const unsigned n = draws.size();
+  mf_crp<2, unsigned> r(0.5, 1.0);
+  const double lambdas[2] = {0.5, 0.5};
+  res->push_back({"mf_crp_increment", n, ns_per_op(n, [&]() {
+    for (unsigned w : draws) {
+      const double p0s[2] = {zipf_prob(w, cdf), 1.0 / cdf.size()};
+      r.increment(w, p0s, lambdas, eng);
+    }
+  })});
+  res->push_back({"mf_crp_decrement", n, ns_per_op(n, [&]() {
+    for (unsigned w : draws) r.decrement(w, eng);
+  })});
+}
+
+// ops are uniform draws, or CRP increments with the engine of the name
+template <typename Engine>
+void bench_engine(const string& name, const vector<unsigned>& draws, const vector<double>& cdf,
+                  Engine& eng, vector<result>* res) {
+  const unsigned n = draws.size();
+  double sum = 0;
+  res->push_back({"uniform01_" + name, n, ns_per_op(n, [&]() {
+    for (unsigned i = 0; i < n; ++i) sum += sample_uniform01<double>(eng);
+  })});
+  crp<unsigned> r(0.5, 1.0);
+  res->push_back({"crp_increment_" + name, n, ns_per_op(n, [&]() {
+    for (unsigned w : draws) r.increment(w, zipf_prob(w, cdf), eng);
+  })});
+  if (sum == 0) cerr << "unexpected sum\n";
+}
+
+// a buffer is set up by every sweep of a sampler, and its first draw fills
+// the whole block
+void bench_buffer_setup(Xoshiro256& eng, vector<result>* res) {
+  const unsigned n = 100000;
+  double sum = 0;
+  res->push_back({"uniform_buffer_setup_xoshiro256", n, ns_per_op(n, [&]() {
+    for (unsigned i = 0; i < n; ++i) {
+      uniform_buffer<Xoshiro256> buf(eng);
+      sum += sample_uniform01<double>(buf);
+    }
+  })});
+  if (sum == 0) cerr << "unexpected sum\n";
+}
+
+template <typename Engine>
+void bench_slice_sampler(Engine& eng, vector<result>* res) {
+  const unsigned n = 100000;
+  double x = 0.5, sum = 0;
+  res->push_back({"slice_sampler1d", n, ns_per_op(n, [&]() {
+    for (unsigned i = 0; i < n; ++i) {
+      x = slice_sampler1d([](double y) { return -y * y / 2; }, x, eng);
+      sum += x;
+    }
+  })});
+  if (sum == 0) cerr << "unexpected sum\n";
+}
+
+// SparseVector<unsigned> is the per-dish table-size histogram of the CRPs, so
+// the keys are the (Zipfian) sizes of a few dozen tables
+template <typename Engine>
+void bench_sparse_vector(unsigned n, Engine& eng, vector<result>* res) {
+  const vector<unsigned> keys = zipf_draws(n, zipf_cdf(32), eng);
+  SparseVector<unsigned> v;
+  res->push_back({"sparse_vector_add_value", n, ns_per_op(n, [&]() {
+    for (unsigned k : keys) v.add_value(k, 1);
+  })});
+  unsigned sum = 0;
+  res->push_back({"sparse_vector_value", n, ns_per_op(n, [&]() {
+    for (unsigned k : keys) sum += v.value(k);
+  })});
+  res->push_back({"sparse_vector_erase", n, ns_per_op(n, [&]() {
+    for (unsigned k : keys) {
+      auto& c = v[k];
+      if (--c == 0) v.erase(k);
+    }
+  })});
+  if (sum == 0 || !v.empty()) cerr << "unexpected sparse vector state\n";
+}
+
+// ops are tokens (including </s>), so 1e9 / ns_per_op is tokens/sec
+template <typename Engine>
+void bench_pyplm(const vector<vector<unsigned> >& corpus, unsigned types, Engine& eng, vector<result>* res) {
+  const unsigned kSOS = 0, kEOS = types + 1;
+  unsigned tokens = 0;
+  for (auto& s : corpus) tokens += s.size() + 1;
+  PYPLM<3> lm(types + 2, 1, 1, 1, 1);
+  auto sweep = [&](bool first) {
+    vector<unsigned> ctx;
+    for (auto& s : corpus) {
+      ctx.assign(2, kSOS);
+      for (unsigned i = 0; i <= s.size(); ++i) {
+        const unsigned w = (i < s.size() ? s[i] : kEOS);
+        if (!first) lm.decrement(w, ctx, eng);
+        lm.increment(w, ctx, eng);
+        ctx.push_back(w);
+      }
+    }
+  };
+  res->push_back({"pyplm3_train_first_sweep", tokens, ns_per_op(tokens, [&]() { sweep(true); })});
+  res->push_back({"pyplm3_train_resample_sweep", tokens, ns_per_op(tokens, [&]() { sweep(false); })});
+  // one call, timed per token so that it compares with a sweep
+  res->push_back({"pyplm3_resample_hyperparameters", tokens, ns_per_op(tokens, [&]() {
+    lm.resample_hyperparameters(eng);
+  })});
+  double sum = 0;
+  res->push_back({"pyplm3_query_prob", tokens, ns_per_op(tokens, [&]() {
+    vector<unsigned> ctx;
+    for (auto& s : corpus) {
+      ctx.assign(2, kSOS);
+      for (unsigned i = 0; i <= s.size(); ++i) {
+        const unsigned w = (i < s.size() ? s[i] : kEOS);
+        sum += log(lm.prob(w, ctx));
+        ctx.push_back(w);
+      }
+    }
+  })});
+  vector<double> probs;
+  res->push_back({"pyplm3_query_prob_sentence", tokens, ns_per_op(tokens, [&]() {
+    for (auto& s : corpus) {
+      prob_sentence(lm, s, kSOS, kEOS, &probs);
+      sum += log(probs.back());
+    }
+  })});
+  // serialization into and out of memory (as for model files and checkpoints)
+  binary_oarchive oa;
+  res->push_back({"pyplm3_save", tokens, ns_per_op(tokens, [&]() { oa & lm; })});
+  PYPLM<3> loaded;
+  res->push_back({"pyplm3_load", tokens, ns_per_op(tokens, [&]() {
+    binary_iarchive ia(oa.data().data(), oa.data().data() + oa.size());
+    ia & loaded;
+    if (!ia.good()) cerr << "failed to load the model\n";
+  })});
+  lm.freeze();
+  res->push_back({"pyplm3_query_prob_sentence_frozen", tokens, ns_per_op(tokens, [&]() {
+    for (auto& s : corpus) {
+      prob_sentence(lm, s, kSOS, kEOS, &probs);
+      sum += log(probs.back());
+    }
+  })});
+  if (!(sum < 0)) cerr << "unexpected log probability sum\n";
+}
+
+int main(int argc, char** argv) {
+  const char* prog = argv[0];
+  unsigned tokens = 1000000;
+  unsigned types = 20000;
+  unsigned seed = 1;
+  bool json = false;
+  while (argc > 1 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-n") && argc > 2) {
+      tokens = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else if (!strcmp(argv[1], "-v") && argc > 2) {
+      types = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else if (!strcmp(argv[1], "-s") && argc > 2) {
+      seed = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else if (!strcmp(argv[1], "-json")) {
+      json = true;
+      argv += 1; argc -= 1;
+    } else {
+      cerr << "Unknown option: " << argv[1] << endl;
+      argc = -1;
+      break;
+    }
+  }
+  if (argc != 1 || tokens == 0 || types == 0) {
+    cerr << prog << " [-n tokens] [-v types] [-s seed] [-json]\n\nTime the CRP and HPYPLM hot paths on synthetic Zipfian data (default: "
+         << tokens << " tokens over " << types << " types)\nand write one ns/op result per line as TSV, or a JSON object with -json\n";
+    return 1;
+  }
+  MT19937 eng(seed);
+  const vector<double> cdf = zipf_cdf(types);
+  const vector<unsigned> draws = zipf_draws(tokens, cdf, eng);
+  const vector<vector<unsigned> > corpus = zipf_corpus(tokens, cdf, eng);
+
+  vector<result> res;
+  bench_crp(draws, cdf, eng, &res);
+  bench_mf_crp(draws, cdf, eng, &res);
+  MT19937 mt(seed);
+  Xoshiro256 xo(seed);
+  bench_engine("mt19937", draws, cdf, mt, &res);
+  bench_engine("xoshiro256", draws, cdf, xo, &res);
+  uniform_buffer<Xoshiro256> xo_buf(xo);
+  bench_engine("xoshiro256_buffered", draws, cdf, xo_buf, &res);
+  bench_buffer_setup(xo, &res);
+  bench_slice_sampler(eng, &res);
+  bench_sparse_vector(tokens, eng, &res);
+  bench_pyplm(corpus, types, eng, &res);
+
+  if (json) {
+    cout << "{\"tokens\": " << tokens << ", \"types\": " << types << ", \"seed\": " << seed << ", \"results\": [";
+    for (unsigned i = 0; i < res.size(); ++i)
+      cout << (i ? ",\n  " : "\n  ") << "{\"benchmark\": \"" << res[i].name << "\", \"ops\": " << res[i].ops
+           << ", \"ns_per_op\": " << res[i].ns << ", \"ops_per_sec\": " << 1e9 / res[i].ns << '}';
+    cout << "\n]}\n";
+  } else {
+    cout << "benchmark\tops\tns_per_op\tops_per_sec\n";
+    for (auto& r : res)
+      cout << r.name << '\t' << r.ops << '\t' << r.ns << '\t' << 1e9 / r.ns << '\n';
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include "cpyp/random.h"
+#include "cpyp/crp.h"
+#include "bench/bench.h"
+
+using namespace std;
+using namespace cpyp;
+
+// seats Zipfian customers in a single restaurant whose base distribution is
+// the same Zipfian (as when a higher-order HPYPLM context backs off to a
+// well-estimated lower order) and then resamples their seating. frequent
+// dishes end up with thousands of tables of hundreds of different sizes,
+// which is what share_table and remove_customer have to search
+int main(int argc, char** argv) {
+  const unsigned customers = argc > 1 ? atoi(argv[1]) : 2000000;
+  const unsigned types = argc > 2 ? atoi(argv[2]) : 50000;
+  const double discount = argc > 3 ? atof(argv[3]) : 0.8;
+  MT19937 eng(1);
+  const vector<double> cdf = zipf_cdf(types);
+  const vector<unsigned> draws = zipf_draws(customers, cdf, eng);
+  crp<unsigned> r(discount, 1.0);
+
+  const double seat = ns_per_op(customers, [&]() {
+    for (unsigned w : draws) r.increment(w, zipf_prob(w, cdf), eng);
+  });
+  const double resample = ns_per_op(customers, [&]() {
+    for (unsigned w : draws) {
+      r.decrement(w, eng);
+      r.increment(w, zipf_prob(w, cdf), eng);
+    }
+  });
+  unsigned most = 0, bins = 0;
+  for (auto& dish : r) {
+    most = max(most, dish.second.num_tables());
+    unsigned b = 0;
+    for (auto it = dish.second.h[0].begin(); it != dish.second.h[0].end(); ++it) ++b;
+    bins = max(bins, b);
+  }
+
+  cout << "benchmark\tcustomers\ttypes\tdiscount\tns_per_op\n";
+  cout << "crp_seat\t" << customers << '\t' << types << '\t' << discount << '\t' << seat << '\n';
+  cout << "crp_resample\t" << customers << '\t' << types << '\t' << discount << '\t' << resample << '\n';
+  cerr << r.num_tables() << " tables, at most " << most << " for one dish, with at most " << bins << " different sizes\n";
+  return 0;
+}
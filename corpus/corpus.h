@@ -1,94 +1,649 @@
 #ifndef CPYPDICT_H_
 #define CPYPDICT_H_
 
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
 #include <fstream>
+#include <memory>
 #include <vector>
 #include <set>
+#include <thread>
 #include <unordered_map>
 #include <functional>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace cpyp {
 
+// maps words to ids 1, 2, ... in the order they are added (0 is <bad0>).
+// each word is stored once, in an array of entries (length, id, the
+// NUL-terminated word) that the hash tables point to, so that a lookup reads
+// the table and one entry. the table is an open addressing one while words
+// are added. freeze() replaces it by a minimal perfect hash function of the
+// current words (about 5 bytes per word, and a single probe), for a
+// dictionary that is (mostly) only read. words added after freeze() go to an
+// open addressing table of their own
 class Dict {
- typedef std::unordered_map<std::string, unsigned, std::hash<std::string> > Map;
  public:
-  Dict() : b0_("<bad0>") {
-    words_.reserve(1000);
+  Dict() : index_mask_(), num_indexed_(), num_frozen_() {
+    Add("<bad0>", 6);
   }
 
-  inline unsigned max() const { return words_.size(); }
+  inline unsigned max() const { return entries_.size() - 1; }
 
   static bool is_ws(char x) {
     return (x == ' ' || x == '\t');
   }
 
   inline void ConvertWhitespaceDelimitedLine(const std::string& line, std::vector<unsigned>* out) {
-    size_t cur = 0;
-    size_t last = 0;
-    int state = 0;
     out->clear();
-    while(cur < line.size()) {
-      if (is_ws(line[cur++])) {
-        if (state == 0) continue;
-        out->push_back(Convert(line.substr(last, cur - last - 1)));
-        state = 0;
-      } else {
-        if (state == 1) continue;
-        last = cur - 1;
-        state = 1;
-      }
+    ConvertWhitespaceDelimited(line.data(), line.data() + line.size(), out);
+  }
+
+  // appends the ids of the words in [begin, end) to out (which can be any
+  // container with push_back(unsigned)), without copying the words
+  template <class Out>
+  void ConvertWhitespaceDelimited(const char* begin, const char* end, Out* out) {
+    const char* cur = begin;
+    while (true) {
+      while (cur != end && is_ws(*cur)) ++cur;
+      if (cur == end) break;
+      const char* word = cur;
+      while (cur != end && !is_ws(*cur)) ++cur;
+      out->push_back(ConvertRange(word, cur));
     }
-    if (state == 1)
-      out->push_back(Convert(line.substr(last, cur - last)));
   }
 
-  inline unsigned Convert(const std::string& word, bool frozen = false) {
-    Map::iterator i = d_.find(word);
-    if (i == d_.end()) {
-      if (frozen)
-        return 0;
-      words_.push_back(word);
-      d_[word] = words_.size();
-      return words_.size();
+  // Convert for the word [begin, end)
+  inline unsigned ConvertRange(const char* begin, const char* end, bool frozen = false) {
+    const size_t len = end - begin;
+    const uint64_t h = hash(begin, len);
+    if (num_frozen_) {
+      const uint32_t pilot = mph_pilots_[Bucket(h)];
+      const uint32_t e = mph_slots_[pilot & kDIRECT ? pilot & ~kDIRECT : Position(h, pilot, num_frozen_)];
+      if (Equals(e, begin, len)) return arena_[e + 1];
+    }
+    size_t slot = h & index_mask_;
+    if (!index_.empty()) {
+      for (uint32_t e; (e = index_[slot]); slot = (slot + 1) & index_mask_)
+        if (Equals(e, begin, len)) return arena_[e + 1];
+    }
+    if (frozen)
+      return 0;
+    const unsigned id = Add(begin, len);
+    if (2 * (num_indexed_ + 1) > index_.size()) {
+      Reindex(std::max<size_t>(16, 2 * index_.size()));
     } else {
-      return i->second;
+      index_[slot] = entries_.back();
     }
+    ++num_indexed_;
+    return id;
   }
 
-  inline const std::string& Convert(const unsigned id) const {
-    if (id == 0) return b0_;
-    return words_[id-1];
+  inline unsigned Convert(const std::string& word, bool frozen = false) {
+    return ConvertRange(word.data(), word.data() + word.size(), frozen);
+  }
+
+  inline std::string Convert(const unsigned id) const {
+    return std::string(word(id), word_length(id));
+  }
+
+  // the word with id (<= max()), NUL-terminated. the pointer is invalidated
+  // when words are added
+  const char* word(unsigned id) const { return chars(entries_[id]); }
+  size_t word_length(unsigned id) const { return arena_[entries_[id]]; }
+
+  // builds a minimal perfect hash function of the current words (see above)
+  void freeze() {
+    const unsigned n = max();
+    num_frozen_ = n;
+    // the words are split into buckets of about 4; the buckets are placed
+    // largest first, each with the first "pilot" (a seed for the position
+    // function) that puts its words on free slots. single-word buckets go
+    // straight to the remaining slots (their pilot is kDIRECT | slot)
+    mph_pilots_.assign(n / 4 + 1, 0);
+    mph_slots_.assign(n, 0);
+    std::vector<uint64_t> hashes(n + 1);
+    std::vector<unsigned> bucket_start(mph_pilots_.size() + 1, 0);
+    for (unsigned id = 1; id <= n; ++id) {
+      hashes[id] = hash(word(id), word_length(id));
+      ++bucket_start[Bucket(hashes[id]) + 1];
+    }
+    for (size_t b = 1; b < bucket_start.size(); ++b) bucket_start[b] += bucket_start[b - 1];
+    std::vector<unsigned> bucket_ids(n);
+    {
+      std::vector<unsigned> fill(bucket_start.begin(), bucket_start.end() - 1);
+      for (unsigned id = 1; id <= n; ++id) bucket_ids[fill[Bucket(hashes[id])]++] = id;
+    }
+    std::vector<unsigned> order(mph_pilots_.size());
+    for (unsigned b = 0; b < order.size(); ++b) order[b] = b;
+    auto bucket_size = [&](unsigned b) { return bucket_start[b + 1] - bucket_start[b]; };
+    std::stable_sort(order.begin(), order.end(),
+                     [&](unsigned a, unsigned b) { return bucket_size(a) > bucket_size(b); });
+    std::vector<bool> taken(n);
+    std::vector<unsigned> pos;
+    unsigned next_free = 0;
+    for (unsigned b : order) {
+      const unsigned size = bucket_size(b);
+      if (size == 0) break;
+      const unsigned* ids = &bucket_ids[bucket_start[b]];
+      if (size == 1) {
+        while (taken[next_free]) ++next_free;
+        taken[next_free] = true;
+        mph_slots_[next_free] = entries_[ids[0]];
+        mph_pilots_[b] = kDIRECT | next_free;
+        continue;
+      }
+      for (uint32_t pilot = 0; ; ++pilot) {
+        assert(pilot < kDIRECT);
+        pos.clear();
+        for (unsigned i = 0; i < size; ++i) {
+          const unsigned p = Position(hashes[ids[i]], pilot, n);
+          if (taken[p] || std::find(pos.begin(), pos.end(), p) != pos.end()) break;
+          pos.push_back(p);
+        }
+        if (pos.size() < size) continue;
+        for (unsigned i = 0; i < size; ++i) {
+          taken[pos[i]] = true;
+          mph_slots_[pos[i]] = entries_[ids[i]];
+        }
+        mph_pilots_[b] = pilot;
+        break;
+      }
+    }
+    // the open addressing table only keeps the words added from now on
+    std::vector<uint32_t>().swap(index_);
+    index_mask_ = 0;
+    num_indexed_ = 0;
   }
+
+  // the archive holds the words in id order and a map from words to ids
   template<class Archive> void serialize(Archive& ar, const unsigned int version) {
-    ar & b0_;
-    ar & words_;
-    ar & d_;
+    std::string b0 = Convert(0);
+    std::vector<std::string> words;
+    std::unordered_map<std::string, unsigned> d;
+    if (!Archive::is_loading::value) {
+      for (unsigned id = 1; id <= max(); ++id) {
+        words.push_back(Convert(id));
+        d[words.back()] = id;
+      }
+    }
+    ar & b0;
+    ar & words;
+    ar & d;
+    if (Archive::is_loading::value) {
+      *this = Dict();
+      for (auto& w : words) Convert(w);
+    }
   }
+
  private:
-  std::string b0_;
-  std::vector<std::string> words_;
-  Map d_;
+  static const uint32_t kDIRECT = 0x80000000u;
+
+  static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static uint64_t hash(const char* w, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL);
+    uint64_t k;
+    for (; len >= 8; w += 8, len -= 8) {
+      std::memcpy(&k, w, 8);
+      h = (h ^ mix(k)) * 0x9e3779b97f4a7c15ULL;
+    }
+    k = 0;
+    std::memcpy(&k, w, len);
+    return mix(h ^ k);
+  }
+
+  // x * n / 2^32 for the high 32 bits x of h
+  static unsigned Scale(uint64_t h, size_t n) { return ((h >> 32) * n) >> 32; }
+
+  unsigned Bucket(uint64_t h) const { return Scale(h << 32, mph_pilots_.size()); }
+
+  static unsigned Position(uint64_t h, uint32_t pilot, unsigned n) {
+    return Scale(mix(h ^ (pilot * 0x9e3779b97f4a7c15ULL)), n);
+  }
+
+  const char* chars(uint32_t e) const { return reinterpret_cast<const char*>(&arena_[e + 2]); }
+
+  bool Equals(uint32_t e, const char* w, size_t len) const {
+    return arena_[e] == len && !std::memcmp(chars(e), w, len);
+  }
+
+  // appends the entry of a new word
+  unsigned Add(const char* w, size_t len) {
+    const size_t e = arena_.size();
+    assert(e < 0xffffffffu - 2 - len / 4);
+    const unsigned id = entries_.size();
+    arena_.push_back(len);
+    arena_.push_back(id);
+    arena_.resize(e + 2 + (len + 4) / 4, 0);  // with a NUL after the word
+    std::memcpy(&arena_[e + 2], w, len);
+    entries_.push_back(e);
+    return id;
+  }
+
+  // rebuilds the open addressing table of the words added since freeze()
+  void Reindex(size_t size) {
+    index_.assign(size, 0);
+    index_mask_ = size - 1;
+    for (unsigned id = num_frozen_ + 1; id <= max(); ++id) {
+      size_t slot = hash(word(id), word_length(id)) & index_mask_;
+      while (index_[slot]) slot = (slot + 1) & index_mask_;
+      index_[slot] = entries_[id];
+    }
+  }
+
+  // the entries, each 2 + (length + 4) / 4 values: length, id, and the word
+  // (with a NUL after it)
+  std::vector<uint32_t> arena_;
+  std::vector<uint32_t> entries_;  // of each id in arena_ (0 is <bad0>)
+  std::vector<uint32_t> index_;  // open addressing table of entries (0 = empty)
+  size_t index_mask_;
+  unsigned num_indexed_;  // words in index_
+  unsigned num_frozen_;  // ids 1..num_frozen_ are found with the perfect hash
+  std::vector<uint32_t> mph_pilots_;  // of each bucket
+  std::vector<uint32_t> mph_slots_;  // the entry at each position
 };
 
-void ReadFromFile(const std::string& filename,
-                  Dict* d,
-                  std::vector<std::vector<unsigned> >* src,
-                  std::set<unsigned>* src_vocab) {
-  src->clear();
+// the sentences of a corpus as one array of word ids, with the offset of
+// the first word of each sentence. the arrays are either owned, or (for a
+// binary corpus, see ReadBinaryCorpus) read from a mapped file, which is
+// copied before the corpus is modified
+class FlatCorpus {
+ public:
+  // the words of one sentence
+  struct Sentence {
+    const unsigned* b;
+    const unsigned* e;
+    const unsigned* begin() const { return b; }
+    const unsigned* end() const { return e; }
+    size_t size() const { return e - b; }
+    bool empty() const { return b == e; }
+    unsigned operator[](size_t i) const { return b[i]; }
+  };
+
+  FlatCorpus() : offsets_(1, 0), mapped_words_(), mapped_offsets_(), mapped_sentences_() {}
+
+  // number of sentences
+  size_t size() const { return mapping_ ? mapped_sentences_ : offsets_.size() - 1; }
+  size_t num_tokens() const { return offset_data()[size()]; }
+
+  Sentence operator[](size_t i) const {
+    const unsigned* w = word_data();
+    const uint64_t* o = offset_data();
+    return Sentence{w + o[i], w + o[i + 1]};
+  }
+
+  // whether the word ids are read in place from a mapped file
+  bool mapped() const { return mapping_ != nullptr; }
+
+  // all the word ids, sentence after sentence
+  const unsigned* words_begin() const { return word_data(); }
+  const unsigned* words_end() const { return word_data() + num_tokens(); }
+
+  // adds a word to the sentence that end_sentence() will close
+  void push_back(unsigned word) { unmap(); words_.push_back(word); }
+  void end_sentence() { unmap(); offsets_.push_back(words_.size()); }
+
+  // adds the sentences of another corpus
+  void append(const FlatCorpus& o) {
+    unmap();
+    const size_t base = words_.size();
+    words_.insert(words_.end(), o.words_begin(), o.words_end());
+    const uint64_t* oo = o.offset_data();
+    for (size_t i = 1; i <= o.size(); ++i)
+      offsets_.push_back(base + oo[i]);
+  }
+
+  // replaces every word id w by ids[w]
+  void remap(const std::vector<unsigned>& ids) {
+    unmap();
+    for (unsigned& w : words_) w = ids[w];
+  }
+
+  void clear() {
+    mapping_.reset();
+    words_.clear();
+    offsets_.assign(1, 0);
+  }
+
+  // uses the sentences of a mapped file (offsets has sentences + 1 entries),
+  // which is kept mapped for as long as mapping is held
+  void map(const std::shared_ptr<const char>& mapping, const unsigned* words,
+           const uint64_t* offsets, size_t sentences) {
+    clear();
+    mapping_ = mapping;
+    mapped_words_ = words;
+    mapped_offsets_ = offsets;
+    mapped_sentences_ = sentences;
+  }
+
+ private:
+  const unsigned* word_data() const { return mapping_ ? mapped_words_ : words_.data(); }
+  const uint64_t* offset_data() const { return mapping_ ? mapped_offsets_ : offsets_.data(); }
+
+  // copies a mapped corpus to owned arrays
+  void unmap() {
+    if (!mapping_) return;
+    words_.assign(words_begin(), words_end());
+    offsets_.assign(mapped_offsets_, mapped_offsets_ + mapped_sentences_ + 1);
+    mapping_.reset();
+  }
+
+  std::vector<unsigned> words_;
+  std::vector<uint64_t> offsets_;  // of each sentence, and one past the last
+  std::shared_ptr<const char> mapping_;  // null unless mapped
+  const unsigned* mapped_words_;
+  const uint64_t* mapped_offsets_;
+  size_t mapped_sentences_;
+};
+
+// a binary corpus (written by WriteBinaryCorpus, or corpus_compile) is a
+// tokenized corpus that ReadFromFile maps into memory instead of reading
+// text. it consists of (in native byte order)
+//   the header below
+//   the vocabulary: num_words NUL-terminated words, for ids 1, 2, ...,
+//     padded with NULs to vocab_bytes (a multiple of 8)
+//   num_tokens uint32 word ids, padded to a multiple of 8 bytes
+//   num_sentences + 1 uint64 sentence offsets (into the word ids)
+// every word of the vocabulary occurs in the corpus
+struct BinaryCorpusHeader {
+  char magic[8];  // kBINARY_CORPUS_MAGIC
+  uint32_t version;
+  uint32_t num_words;
+  uint64_t num_sentences;
+  uint64_t num_tokens;
+  uint64_t vocab_bytes;
+};
+
+static const char kBINARY_CORPUS_MAGIC[8] = {'C', 'P', 'Y', 'P', 'C', 'O', 'R', 'P'};
+static const uint32_t kBINARY_CORPUS_VERSION = 1;
+
+// the sentences and (used) words of corpus, with the words of d
+inline void WriteBinaryCorpus(const std::string& filename, const Dict& d, const FlatCorpus& corpus) {
+  // the words that occur are numbered 1, 2, ... in the order of their ids
+  std::vector<unsigned> ids(d.max() + 1, 0);
+  for (const unsigned* w = corpus.words_begin(); w != corpus.words_end(); ++w) ids[*w] = 1;
+  BinaryCorpusHeader h;
+  std::memcpy(h.magic, kBINARY_CORPUS_MAGIC, sizeof(h.magic));
+  h.version = kBINARY_CORPUS_VERSION;
+  h.num_words = 0;
+  h.num_sentences = corpus.size();
+  h.num_tokens = corpus.num_tokens();
+  std::string vocab;
+  for (unsigned w = 1; w < ids.size(); ++w) {
+    if (!ids[w]) continue;
+    ids[w] = ++h.num_words;
+    vocab.append(d.word(w), d.word_length(w) + 1);
+  }
+  vocab.resize((vocab.size() + 7) / 8 * 8, '\0');
+  h.vocab_bytes = vocab.size();
+  FILE* f = std::fopen(filename.c_str(), "wb");
+  if (!f) {
+    std::cerr << "Failed to open " << filename << " for writing" << std::endl;
+    abort();
+  }
+  std::fwrite(&h, sizeof(h), 1, f);
+  std::fwrite(vocab.data(), 1, vocab.size(), f);
+  std::vector<unsigned> block;
+  for (const unsigned* w = corpus.words_begin(); w != corpus.words_end(); ) {
+    block.clear();
+    for (; w != corpus.words_end() && block.size() < (1 << 20); ++w) block.push_back(ids[*w]);
+    std::fwrite(block.data(), sizeof(unsigned), block.size(), f);
+  }
+  if (h.num_tokens % 2) {
+    const unsigned pad = 0;
+    std::fwrite(&pad, sizeof(pad), 1, f);
+  }
+  std::vector<uint64_t> offsets(corpus.size() + 1);
+  for (size_t i = 0; i < corpus.size(); ++i)
+    offsets[i + 1] = offsets[i] + corpus[i].size();
+  std::fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), f);
+  if (std::ferror(f) || std::fclose(f)) {
+    std::cerr << "Error writing " << filename << std::endl;
+    abort();
+  }
+}
+
+// maps the binary corpus in filename and adds its words to d. if d assigns
+// the words the ids that the file uses (e.g., d was empty), the word ids are
+// used in place, and otherwise they are renumbered into memory. sets
+// (*vocab)[id] for the id of every word in the corpus
+inline void ReadBinaryCorpus(const std::string& filename,
+                             Dict* d,
+                             FlatCorpus* corpus,
+                             std::vector<bool>* vocab) {
+  corpus->clear();
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    std::cerr << "Failed to open " << filename << std::endl;
+    abort();
+  }
+  const size_t size = st.st_size;
+  void* p = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    std::cerr << "Failed to map " << filename << std::endl;
+    abort();
+  }
+  std::shared_ptr<const char> mapping(static_cast<const char*>(p),
+                                      [size](const char* m) { munmap(const_cast<char*>(m), size); });
+  BinaryCorpusHeader h;
+  bool ok = size >= sizeof(h);
+  if (ok) std::memcpy(&h, mapping.get(), sizeof(h));
+  // the counts are bounded by the size first, so that the sizes of the
+  // sections cannot overflow
+  ok = ok && h.vocab_bytes <= size && h.num_words <= h.vocab_bytes &&
+       h.num_tokens <= size / sizeof(unsigned) &&
+       h.num_sentences < size / sizeof(uint64_t);
+  const size_t token_bytes = ok ? (h.num_tokens * sizeof(unsigned) + 7) / 8 * 8 : 0;
+  ok = ok && !std::memcmp(h.magic, kBINARY_CORPUS_MAGIC, sizeof(h.magic)) &&
+       h.version == kBINARY_CORPUS_VERSION && h.vocab_bytes % 8 == 0 &&
+       size == sizeof(h) + h.vocab_bytes + token_bytes + (h.num_sentences + 1) * sizeof(uint64_t);
+  const char* w = mapping.get() + sizeof(h);
+  const char* vocab_end = w + h.vocab_bytes;
+  const unsigned* words = reinterpret_cast<const unsigned*>(vocab_end);
+  const uint64_t* offsets = reinterpret_cast<const uint64_t*>(vocab_end + token_bytes);
+  // the sentences must cover the word ids in order, and the ids must be
+  // those of the vocabulary, since they index the tables of the readers
+  ok = ok && offsets[0] == 0 && offsets[h.num_sentences] == h.num_tokens;
+  for (uint64_t i = 0; ok && i < h.num_sentences; ++i)
+    ok = offsets[i] <= offsets[i + 1];
+  for (uint64_t i = 0; ok && i < h.num_tokens; ++i)
+    ok = words[i] >= 1 && words[i] <= h.num_words;
+  std::vector<unsigned> ids(ok ? h.num_words + 1 : 0, 0);
+  bool same_ids = true;
+  for (unsigned i = 1; ok && i <= h.num_words; ++i) {
+    const char* e = static_cast<const char*>(std::memchr(w, '\0', vocab_end - w));
+    if (!e) {
+      ok = false;
+      break;
+    }
+    ids[i] = d->ConvertRange(w, e);
+    same_ids = same_ids && ids[i] == i;
+    w = e + 1;
+  }
+  if (!ok) {
+    std::cerr << "Bad binary corpus " << filename << std::endl;
+    abort();
+  }
+  corpus->map(mapping, words, offsets, h.num_sentences);
+  if (!same_ids) corpus->remap(ids);
+  if (vocab->size() < d->max() + 1) vocab->resize(d->max() + 1);
+  for (unsigned i = 1; i <= h.num_words; ++i) (*vocab)[ids[i]] = true;
+}
+
+// whether filename starts like a binary corpus
+inline bool IsBinaryCorpus(const std::string& filename) {
+  char magic[sizeof(kBINARY_CORPUS_MAGIC)];
+  FILE* f = std::fopen(filename.c_str(), "rb");
+  if (!f) return false;
+  const bool binary = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                      !std::memcmp(magic, kBINARY_CORPUS_MAGIC, sizeof(magic));
+  std::fclose(f);
+  return binary;
+}
+
+// reads the lines in bytes [begin, end) of f (where begin is the start of a
+// line, and end the start of a line or the end of the file), in large blocks
+// that are tokenized in place, and adds them to corpus as sentences
+inline void ReadLines(FILE* f, long begin, long end, const std::string& filename,
+                      Dict* d, FlatCorpus* corpus) {
+  if (std::fseek(f, begin, SEEK_SET)) {
+    std::cerr << "Failed to seek in " << filename << std::endl;
+    abort();
+  }
+  long remaining = end - begin;
+  std::vector<char> buf(1 << 22);
+  size_t len = 0;  // bytes of buf holding an unfinished line
+  while (true) {
+    size_t n = buf.size() - len;
+    if (static_cast<long>(n) > remaining) n = remaining;
+    n = std::fread(&buf[len], 1, n, f);
+    remaining -= n;
+    len += n;
+    const char* cur = buf.data();
+    const char* last = cur + len;
+    const char* nl;
+    while ((nl = static_cast<const char*>(std::memchr(cur, '\n', last - cur)))) {
+      d->ConvertWhitespaceDelimited(cur, nl, corpus);
+      corpus->end_sentence();
+      cur = nl + 1;
+    }
+    len = last - cur;
+    if (n == 0) {  // the last line need not end with a newline
+      if (len) {
+        d->ConvertWhitespaceDelimited(cur, last, corpus);
+        corpus->end_sentence();
+      }
+      break;
+    }
+    std::memmove(buf.data(), cur, len);
+    if (len == buf.size()) buf.resize(2 * buf.size());  // a very long line
+  }
+  if (std::ferror(f)) {
+    std::cerr << "Error reading " << filename << std::endl;
+    abort();
+  }
+}
+
+// reads one sentence per line of whitespace (space or tab) delimited words,
+// and sets (*vocab)[id] for the id of every word in the corpus. a binary
+// corpus (see BinaryCorpusHeader) is read with ReadBinaryCorpus instead.
+// with threads > 1 (or 0, for one per core), the file is split into chunks
+// at line boundaries that are tokenized concurrently, each with a dictionary
+// of its own. these are then merged into d in chunk order, so that the ids
+// are the same as when the file is read from start to end
+inline void ReadFromFile(const std::string& filename,
+                         Dict* d,
+                         FlatCorpus* corpus,
+                         std::vector<bool>* vocab,
+                         unsigned threads = 1) {
+  corpus->clear();
   std::cerr << "Reading from " << filename << std::endl;
-  std::ifstream in(filename);
-  assert(in);
-  std::string line;
-  int lc = 0;
-  while(getline(in, line)) {
-    ++lc;
-    src->push_back(std::vector<unsigned>());
-    d->ConvertWhitespaceDelimitedLine(line, &src->back());
-    for (unsigned i = 0; i < src->back().size(); ++i) src_vocab->insert(src->back()[i]);
+  if (IsBinaryCorpus(filename)) {
+    ReadBinaryCorpus(filename, d, corpus, vocab);
+    return;
+  }
+  FILE* f = std::fopen(filename.c_str(), "rb");
+  if (!f || std::fseek(f, 0, SEEK_END)) {
+    std::cerr << "Failed to open " << filename << std::endl;
+    abort();
+  }
+  const long size = std::ftell(f);
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  const long kMIN_CHUNK = 1 << 22;  // bytes
+  const unsigned chunks = std::min<long>(threads, size / kMIN_CHUNK + 1);
+  if (chunks == 1) {
+    ReadLines(f, 0, size, filename, d, corpus);
+    std::fclose(f);
+  } else {
+    // chunk c is [bounds[c], bounds[c + 1]), moved forward to a line start
+    std::vector<long> bounds(chunks + 1, size);
+    for (unsigned c = 0; c < chunks; ++c) {
+      bounds[c] = c ? std::max(size * c / chunks, bounds[c - 1]) : 0;
+      if (c == 0 || bounds[c] == size || std::fseek(f, bounds[c] - 1, SEEK_SET)) continue;
+      int ch;
+      while ((ch = std::fgetc(f)) != EOF && ch != '\n') ++bounds[c];
+      bounds[c] = std::min(bounds[c], size);
+    }
+    std::fclose(f);
+    std::vector<Dict> dicts(chunks);
+    std::vector<FlatCorpus> parts(chunks);
+    std::vector<std::thread> workers;
+    for (unsigned c = 0; c < chunks; ++c) {
+      workers.push_back(std::thread([&, c]() {
+        FILE* cf = std::fopen(filename.c_str(), "rb");
+        if (!cf) {
+          std::cerr << "Failed to open " << filename << std::endl;
+          abort();
+        }
+        ReadLines(cf, bounds[c], bounds[c + 1], filename, &dicts[c], &parts[c]);
+        std::fclose(cf);
+      }));
+    }
+    for (auto& w : workers) w.join();
+    // the words of each chunk, in the order they first occur in it, get
+    // their ids in d; then the chunks are renumbered concurrently
+    std::vector<std::vector<unsigned> > ids(chunks);
+    for (unsigned c = 0; c < chunks; ++c) {
+      ids[c].resize(dicts[c].max() + 1);
+      for (unsigned w = 1; w <= dicts[c].max(); ++w)
+        ids[c][w] = d->ConvertRange(dicts[c].word(w), dicts[c].word(w) + dicts[c].word_length(w));
+      dicts[c] = Dict();
+    }
+    workers.clear();
+    for (unsigned c = 0; c < chunks; ++c)
+      workers.push_back(std::thread([&, c]() { parts[c].remap(ids[c]); }));
+    for (auto& w : workers) w.join();
+    for (auto& part : parts) {
+      corpus->append(part);
+      part = FlatCorpus();
+    }
+  }
+  if (vocab->size() < d->max() + 1) vocab->resize(d->max() + 1);
+  for (const unsigned* w = corpus->words_begin(); w != corpus->words_end(); ++w) (*vocab)[*w] = true;
+}
+
+// number of ids set in a vocabulary read by ReadFromFile
+inline unsigned VocabularySize(const std::vector<bool>& vocab) {
+  unsigned n = 0;
+  for (bool b : vocab) n += b;
+  return n;
+}
+
+inline void ReadFromFile(const std::string& filename,
+                         Dict* d,
+                         std::vector<std::vector<unsigned> >* src,
+                         std::set<unsigned>* src_vocab,
+                         unsigned threads = 1) {
+  FlatCorpus corpus;
+  std::vector<bool> vocab;
+  ReadFromFile(filename, d, &corpus, &vocab, threads);
+  src->clear();
+  src->reserve(corpus.size());
+  for (size_t i = 0; i < corpus.size(); ++i) {
+    const FlatCorpus::Sentence s = corpus[i];
+    src->push_back(std::vector<unsigned>(s.begin(), s.end()));
   }
+  for (unsigned w = 0; w < vocab.size(); ++w)
+    if (vocab[w]) src_vocab->insert(src_vocab->end(), w);
 }
 
 }
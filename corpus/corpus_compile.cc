@@ -0,0 +1,46 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+
+#include "corpus/corpus.h"
+
+using namespace std;
+using namespace cpyp;
+
+int main(int argc, char** argv) {
+  const char* prog = argv[0];
+  unsigned threads = 0;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+    if (!strcmp(argv[1], "-j") && argc > 2) {
+      threads = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else {
+      cerr << "Unknown option: " << argv[1] << endl;
+      argc = 0;
+    }
+  }
+  if (argc != 3) {
+    cerr << prog << " [-j nthreads] <corpus.txt> <corpus.bin>\n\nTokenize a corpus (one sentence per line) into a binary corpus, which the\ntraining tools read in place of the text (see BinaryCorpusHeader)\n"
+         << "With -j, the text is read by nthreads threads (default: one per core)\n";
+    return 1;
+  }
+  const string input_file = argv[1];
+  const string output_file = argv[2];
+  {
+    ifstream test(output_file);
+    if (test.good()) {
+      cerr << "File " << output_file << " appears to exist: please remove\n";
+      return 1;
+    }
+  }
+  Dict dict;
+  FlatCorpus corpus;
+  vector<bool> vocab;
+  ReadFromFile(input_file, &dict, &corpus, &vocab, threads);
+  cerr << "Corpus size: " << corpus.size() << " sentences, " << corpus.num_tokens() << " tokens\t ("
+       << VocabularySize(vocab) << " word types)\n";
+  cerr << "Writing " << output_file << " ...\n";
+  WriteBinaryCorpus(output_file, dict, corpus);
+  return 0;
+}
@@ -0,0 +1,212 @@
+#ifndef _CPYP_BINARY_ARCHIVE_H_
+#define _CPYP_BINARY_ARCHIVE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "msparse_vector.h"
+
+namespace cpyp {
+
+// minimal in-memory binary archives with the interface of the boost
+// serialization archives (ar & x, Archive::is_loading), so that the
+// serialize() members of the CRPs and models can be used without boost (see
+// checkpoint.h). supported are arithmetic types, std::string, std::vector,
+// std::pair, std::unordered_map, SparseVector and classes with a
+// serialize(Archive&, unsigned) member. values are stored in the byte order
+// of the machine, so the archives are not portable across architectures
+class binary_oarchive {
+ public:
+  typedef std::false_type is_loading;
+  typedef std::true_type is_saving;
+
+  template <class T>
+  binary_oarchive& operator&(const T& t) {
+    save(t);
+    return *this;
+  }
+
+  void write(const void* p, size_t n) { data_.append(static_cast<const char*>(p), n); }
+
+  size_t size() const { return data_.size(); }
+  std::string& data() { return data_; }
+
+ private:
+  template <class T>
+  typename std::enable_if<std::is_arithmetic<T>::value>::type save(const T& t) {
+    write(&t, sizeof(T));
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_class<T>::value>::type save(const T& t) {
+    const_cast<T&>(t).serialize(*this, 0);
+  }
+
+  void save(const std::string& s) {
+    save(static_cast<uint64_t>(s.size()));
+    write(s.data(), s.size());
+  }
+
+  template <class T, class A>
+  void save(const std::vector<T, A>& v) {
+    save(static_cast<uint64_t>(v.size()));
+    if (std::is_arithmetic<T>::value) {
+      if (!v.empty()) write(&v[0], v.size() * sizeof(T));
+    } else {
+      for (auto& x : v) save(x);
+    }
+  }
+
+  void save(const std::vector<bool>& v) {
+    save(static_cast<uint64_t>(v.size()));
+    for (bool x : v) save(x);
+  }
+
+  template <class A, class B>
+  void save(const std::pair<A, B>& p) {
+    save(p.first);
+    save(p.second);
+  }
+
+  template <class K, class V, class H, class E, class A>
+  void save(const std::unordered_map<K, V, H, E, A>& m) {
+    save(static_cast<uint64_t>(m.size()));
+    for (auto& kv : m) save(kv);
+  }
+
+  template <class T, unsigned L>
+  void save(const SparseVector<T, L>& v) {
+    v.save(*this, 0);
+  }
+
+  std::string data_;
+};
+
+// reads an archive written by binary_oarchive from [begin, end). reading
+// past the end (e.g., from a truncated file) zero fills the values and
+// clears good()
+class binary_iarchive {
+ public:
+  typedef std::true_type is_loading;
+  typedef std::false_type is_saving;
+
+  binary_iarchive(const char* begin, const char* end) : cur_(begin), end_(end), good_(true) {}
+
+  template <class T>
+  binary_iarchive& operator&(T& t) {
+    load(t);
+    return *this;
+  }
+
+  void read(void* p, size_t n) {
+    if (n > remaining()) {
+      good_ = false;
+      std::memset(p, 0, n);
+      cur_ = end_;
+      return;
+    }
+    std::memcpy(p, cur_, n);
+    cur_ += n;
+  }
+
+  bool good() const { return good_; }
+  size_t remaining() const { return end_ - cur_; }
+
+  // marks the archive as corrupt, e.g., when the values read are inconsistent
+  void fail() {
+    good_ = false;
+    cur_ = end_;
+  }
+
+ private:
+  template <class T>
+  typename std::enable_if<std::is_arithmetic<T>::value>::type load(T& t) {
+    read(&t, sizeof(T));
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_class<T>::value>::type load(T& t) {
+    t.serialize(*this, 0);
+  }
+
+  // every element takes at least one byte, so a larger count is corrupt
+  // (and must not be allocated)
+  uint64_t load_size() {
+    uint64_t n = 0;
+    load(n);
+    if (n > remaining()) {
+      good_ = false;
+      cur_ = end_;
+      return 0;
+    }
+    return n;
+  }
+
+  void load(std::string& s) {
+    s.resize(load_size());
+    if (!s.empty()) read(&s[0], s.size());
+  }
+
+  template <class T, class A>
+  void load(std::vector<T, A>& v) {
+    v.resize(load_size());
+    if (std::is_arithmetic<T>::value) {
+      if (!v.empty()) read(&v[0], v.size() * sizeof(T));
+    } else {
+      for (auto& x : v) load(x);
+    }
+  }
+
+  void load(std::vector<bool>& v) {
+    v.resize(load_size());
+    for (size_t i = 0; i < v.size(); ++i) {
+      bool x;
+      load(x);
+      v[i] = x;
+    }
+  }
+
+  template <class A, class B>
+  void load(std::pair<A, B>& p) {
+    load(const_cast<typename std::remove_const<A>::type&>(p.first));
+    load(p.second);
+  }
+
+  template <class K, class V, class H, class E, class A>
+  void load(std::unordered_map<K, V, H, E, A>& m) {
+    m.clear();
+    const uint64_t n = load_size();
+    m.reserve(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      K k;
+      load(k);
+      load(m[k]);
+    }
+  }
+
+  template <class T, unsigned L>
+  void load(SparseVector<T, L>& v) {
+    v.load(*this, 0);
+  }
+
+  const char* cur_;
+  const char* end_;
+  bool good_;
+};
+
+// whether Archive is one of the archives above, which write vectors of
+// numbers as single blocks. CRPs and models store their seating arrangements
+// as such columns in these archives (see dish_columns in
+// crp_table_manager.h), and dish by dish in boost archives
+template <class Archive> struct is_bulk_archive : std::false_type {};
+template <> struct is_bulk_archive<binary_oarchive> : std::true_type {};
+template <> struct is_bulk_archive<binary_iarchive> : std::true_type {};
+
+}
+
+#endif
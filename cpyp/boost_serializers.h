@@ -11,48 +11,54 @@
 
 #include <boost/serialization/utility.hpp>
 #include <boost/serialization/collections_save_imp.hpp>
-#include <boost/serialization/collections_load_imp.hpp>
+#include <boost/serialization/collection_size_type.hpp>
+#include <boost/serialization/item_version_type.hpp>
+#include <boost/serialization/nvp.hpp>
+#include <boost/archive/basic_archive.hpp>
 #include <boost/serialization/split_free.hpp>
 
 namespace boost { 
 namespace serialization {
 
-template<class Archive, class Type, class Key, class Compare, class Allocator >
+template<class Archive, class Key, class Type, class Hash, class Equal, class Allocator>
 inline void save(
     Archive & ar,
-    const std::unordered_map<Key, Type, Compare, Allocator> &t,
+    const std::unordered_map<Key, Type, Hash, Equal, Allocator> &t,
     const unsigned int /* file_version */
 ){
     boost::serialization::stl::save_collection<
         Archive, 
-        std::unordered_map<Key, Type, Compare, Allocator> 
+        std::unordered_map<Key, Type, Hash, Equal, Allocator> 
     >(ar, t);
 }
 
-template<class Archive, class Type, class Key, class Compare, class Allocator >
+// reads what save_collection wrote (the same in every boost version)
+template<class Archive, class Key, class Type, class Hash, class Equal, class Allocator>
 inline void load(
     Archive & ar,
-    std::unordered_map<Key, Type, Compare, Allocator> &t,
+    std::unordered_map<Key, Type, Hash, Equal, Allocator> &t,
     const unsigned int /* file_version */
 ){
-    boost::serialization::stl::load_collection<
-        Archive,
-        std::unordered_map<Key, Type, Compare, Allocator>,
-        boost::serialization::stl::archive_input_map<
-            Archive, std::unordered_map<Key, Type, Compare, Allocator> >,
-            boost::serialization::stl::no_reserve_imp<std::unordered_map<
-                Key, Type, Compare, Allocator
-            >
-        >
-    >(ar, t);
+    t.clear();
+    collection_size_type count;
+    item_version_type item_version(0);
+    ar >> BOOST_SERIALIZATION_NVP(count);
+    if (boost::archive::library_version_type(3) < ar.get_library_version())
+        ar >> BOOST_SERIALIZATION_NVP(item_version);
+    t.reserve(count);
+    while (count-- > 0) {
+        typename std::unordered_map<Key, Type, Hash, Equal, Allocator>::value_type item;
+        ar >> boost::serialization::make_nvp("item", item);
+        t.insert(std::move(item));
+    }
 }
 
 // split non-intrusive serialization function member into separate
 // non intrusive save/load member functions
-template<class Archive, class Type, class Key, class Compare, class Allocator >
+template<class Archive, class Key, class Type, class Hash, class Equal, class Allocator>
 inline void serialize(
     Archive & ar,
-    std::unordered_map<Key, Type, Compare, Allocator> &t,
+    std::unordered_map<Key, Type, Hash, Equal, Allocator> &t,
     const unsigned int file_version
 ){
     boost::serialization::split_free(ar, t, file_version);
@@ -0,0 +1,181 @@
+#ifndef _CPYP_CHECKPOINT_H_
+#define _CPYP_CHECKPOINT_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <unistd.h>
+
+#include "binary_archive.h"
+
+namespace cpyp {
+
+// a file holding a snapshot of the complete state of a sampler (model,
+// random number generators, number of samples taken, ...), so that a long
+// run that is interrupted can be resumed from the last snapshot, e.g.
+//   checkpoint ckpt("lm.ckpt", "hpyplm_train");
+//   if (ckpt.exists()) ckpt.load([&](binary_iarchive& ia) { ia & sample; ia & lm; return true; });
+//   ...
+//   ckpt.save([&](binary_oarchive& oa) { oa & sample; oa & lm; });
+// save() serializes the state into memory on the calling thread, which then
+// goes on sampling while a background thread writes it out (so the state
+// briefly needs twice the memory). the file is written next to the old one
+// and renamed over it once it is complete, so it always holds a complete
+// snapshot, even if the process is killed while writing
+class checkpoint {
+ public:
+  checkpoint(const std::string& filename, const std::string& tool) :
+      filename_(filename), tool_(tool) {}
+  ~checkpoint() { wait(); }
+
+  const std::string& filename() const { return filename_; }
+
+  bool exists() const {
+    std::ifstream test(filename_);
+    return test.good();
+  }
+
+  // true if x is the value in the archive (always, when saving), e.g., for
+  // the samplers to check that a checkpoint was taken on the same data
+  template <class Archive>
+  static bool same_value(Archive& ar, uint64_t x) {
+    uint64_t y = x;
+    ar & y;
+    return y == x;
+  }
+
+  template <class F>
+  void save(const F& f) {
+    binary_oarchive oa;
+    const uint32_t version = kVERSION;
+    oa.write(magic(), kMAGIC_SIZE);
+    oa & version;
+    oa & tool_;
+    f(oa);
+    const uint64_t size = oa.size() + sizeof(uint64_t);
+    oa & size;
+    wait();
+    writer_ = std::thread(write_file, filename_, std::move(oa.data()));
+  }
+
+  // f(binary_iarchive&) returns false (after reporting why) if the state
+  // does not belong to this run, e.g., was taken on other data. load returns
+  // false in that case too, or after reporting that the file is not a
+  // complete checkpoint written by the same tool
+  template <class F>
+  bool load(const F& f) {
+    std::ifstream in(filename_, std::ios::in | std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    binary_iarchive ia(data.data(), data.data() + data.size());
+    char m[kMAGIC_SIZE];
+    ia.read(m, kMAGIC_SIZE);
+    uint32_t version = 0;
+    ia & version;
+    if (!ia.good() || std::memcmp(m, magic(), kMAGIC_SIZE) || version != kVERSION) {
+      std::cerr << filename_ << " is not a checkpoint (or was written by an incompatible version)\n";
+      return false;
+    }
+    std::string tool;
+    ia & tool;
+    if (tool != tool_) {
+      std::cerr << filename_ << " is a checkpoint of " << tool << ", not of " << tool_ << std::endl;
+      return false;
+    }
+    if (!f(ia)) return false;
+    uint64_t size = 0;
+    ia & size;
+    if (!ia.good() || ia.remaining() || size != data.size()) {
+      std::cerr << filename_ << " is truncated or corrupt\n";
+      return false;
+    }
+    return true;
+  }
+
+  // waits until the last save() has been written
+  void wait() {
+    if (writer_.joinable()) writer_.join();
+  }
+
+ private:
+  static void write_file(const std::string filename, const std::string data) {
+    const std::string tmp = filename + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    bool ok = f && fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = f && fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    if (f && fclose(f)) ok = false;
+    if (!ok || rename(tmp.c_str(), filename.c_str())) {
+      std::cerr << "Failed to write checkpoint " << filename << ": " << strerror(errno) << std::endl;
+      remove(tmp.c_str());
+    }
+  }
+
+  static const char* magic() { return "CPYPCKPT"; }
+  static const unsigned kMAGIC_SIZE = 8;
+  static const uint32_t kVERSION = 4;
+
+  std::string filename_;
+  std::string tool_;
+  std::thread writer_;
+};
+
+// the checkpointing options of the samplers: -c <checkpoint> saves the state
+// every -i <interval> samples (and after the last one), and -r resumes from
+// the checkpoint if it exists
+struct checkpoint_options {
+  checkpoint_options() : interval(10), resume(false) {}
+
+  // if argv[1] is one of the options, consumes it (with its argument) and
+  // returns the number of arguments consumed, and returns 0 otherwise
+  int parse(int argc, char** argv) {
+    if (!std::strcmp(argv[1], "-c") && argc > 2) {
+      filename = argv[2];
+      return 2;
+    }
+    if (!std::strcmp(argv[1], "-i") && argc > 2) {
+      interval = std::atoi(argv[2]);
+      return 2;
+    }
+    if (!std::strcmp(argv[1], "-r")) {
+      resume = true;
+      return 1;
+    }
+    return 0;
+  }
+
+  bool valid() const { return interval > 0 && (!resume || !filename.empty()); }
+
+  // whether sampling may start: without -r, an existing checkpoint must not
+  // be overwritten. returns false after reporting it
+  bool check_fresh() const {
+    if (resume || filename.empty() || !std::ifstream(filename).good()) return true;
+    std::cerr << "Checkpoint " << filename << " exists: resume from it with -r or remove it\n";
+    return false;
+  }
+
+  // whether the state is saved after done of the samples
+  bool due(long done, long samples) const {
+    return !filename.empty() && (done % interval == 0 || done == samples);
+  }
+
+  static const char* usage() {
+    return "With -c, the state of the sampler is saved to <checkpoint> every <interval> (default: 10)\n"
+           "samples and after the last one; with -r, sampling resumes from <checkpoint> if it exists\n";
+  }
+
+  std::string filename;  // empty if checkpoints are not written
+  int interval;
+  bool resume;
+};
+
+}
+
+#endif
@@ -0,0 +1,483 @@
+#ifndef _CPYP_COMPACT_CRP_H_
+#define _CPYP_COMPACT_CRP_H_
+
+#include <iostream>
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <new>
+#include <utility>
+#include <unordered_map>
+#include <functional>
+#include "random.h"
+#include "binary_archive.h"
+#include "crp.h"
+#include "crp_table_manager.h"
+#include "lgamma_kernels.h"
+#include "tied_parameter_resampler.h"
+
+namespace cpyp {
+
+// a CRP (Pitman-Yor parameters) for the many small restaurants of a large
+// model, such as the contexts of a high-order n-gram LM, most of which seat
+// one or two dishes at a handful of tables. up to kINLINE tables are stored
+// in the restaurant itself, as the dish and the number of customers of each
+// table, so that with 4-byte dishes a restaurant takes one cache line rather
+// than an unordered_map and a histogram per dish. the inline tables are kept
+// sorted by dish and size, and a restaurant moves its tables to a crp when it
+// has more than kINLINE, and back when it has no more, so that the layout
+// only depends on the seating arrangement (and a restaurant loaded from an
+// archive samples as the one that was saved). Dish must be ordered by <.
+// the hyperparameters are not stored: they are those of the tie group (see
+// tied_parameter_resampler::share_parameters), whose arena also holds the
+// dishes of the crp. there are no priors on the hyperparameters and no
+// running log likelihood: log_likelihood() evaluates the seating
+template <typename Dish, typename DishHash = std::hash<Dish> >
+class compact_crp {
+ public:
+  static const unsigned kINLINE = 5;
+
+  // the customers and tables of a dish (see begin())
+  struct dish_counts {
+    unsigned customers, tables;
+    unsigned num_customers() const { return customers; }
+    unsigned num_tables() const { return tables; }
+  };
+
+  explicit compact_crp(shared_crp_parameters* params = nullptr) :
+      params_(params),
+      num_tables_(),
+      num_customers_(),
+      dishes_(),
+      sizes_() {}
+
+  compact_crp(const compact_crp& o) :
+      params_(o.params_),
+      large_(o.large_ ? copy_large(*o.large_, o.large_->arena()) : nullptr),
+      num_tables_(o.num_tables_),
+      num_customers_(o.num_customers_) {
+    std::copy(o.dishes_, o.dishes_ + kINLINE, dishes_);
+    std::copy(o.sizes_, o.sizes_ + kINLINE, sizes_);
+  }
+  compact_crp(compact_crp&&) = default;
+  compact_crp& operator=(const compact_crp& o) {
+    compact_crp c(o);
+    swap(c);
+    return *this;
+  }
+  compact_crp& operator=(compact_crp&&) = default;
+
+  // e.g., for restaurants that have been loaded from a boost archive. the
+  // crp of a large restaurant moves to the arena of the tie group
+  void set_parameters(shared_crp_parameters* params) {
+    params_ = params;
+    if (large_ && large_->arena() != params_->arena)
+      large_ = copy_large(*large_, params_->arena);
+  }
+
+  double discount() const { return params_->discount; }
+  double strength() const { return params_->strength; }
+  // these set the hyperparameters of every restaurant that shares them
+  void set_hyperparameters(double d, double s) {
+    params_->discount = d;
+    params_->strength = s;
+  }
+  void set_discount(double d) { params_->discount = d; }
+  void set_strength(double s) { params_->strength = s; }
+
+  bool has_discount_prior() const { return false; }
+  bool has_strength_prior() const { return false; }
+
+  void clear() {
+    large_.reset();
+    num_tables_ = 0;
+    num_customers_ = 0;
+  }
+
+  unsigned num_tables() const {
+    return num_tables_;
+  }
+
+  unsigned num_tables(const Dish& dish) const {
+    return large_ ? large_->num_tables(dish) : inline_counts(dish).tables;
+  }
+
+  unsigned num_customers() const {
+    return num_customers_;
+  }
+
+  unsigned num_customers(const Dish& dish) const {
+    return large_ ? large_->num_customers(dish) : inline_counts(dish).customers;
+  }
+
+  // number of tables seating each number of customers, over all dishes
+  crp_histogram table_sizes() const {
+    if (large_) return large_->table_sizes();
+    crp_histogram h;
+    for (unsigned i = 0; i < num_tables_; ++i) h.increment(sizes_[i]);
+    return h;
+  }
+
+  // the tables at which dish is served (see crp::tables)
+  crp_table_manager<1> tables(const Dish& dish) const {
+    if (large_) return large_->tables(dish);
+    crp_table_manager<1> tm;
+    for (unsigned i = 0; i < num_tables_; ++i) {
+      if (!(dishes_[i] == dish)) continue;
+      tm.h[0].increment(sizes_[i]);
+      ++tm.tables;
+      tm.customers += sizes_[i];
+    }
+    return tm;
+  }
+
+  // replaces the tables at which dish is served by tm
+  void set_tables(const Dish& dish, const crp_table_manager<1>& tm) {
+    if (!large_) {
+      for (unsigned i = 0; i < num_tables_; ) {
+        if (dishes_[i] == dish) {
+          num_customers_ -= sizes_[i];
+          erase_table(i);
+        } else {
+          ++i;
+        }
+      }
+      if (num_tables_ + tm.num_tables() <= kINLINE) {
+        for (auto& bin : tm.h[0])
+          for (unsigned k = 0; k < bin.second; ++k) insert_table(dish, bin.first);
+        num_customers_ += tm.num_customers();
+        return;
+      }
+      to_large();
+    }
+    large_->set_tables(dish, tm);
+    num_tables_ = large_->num_tables();
+    num_customers_ = large_->num_customers();
+    if (num_tables_ <= kINLINE) to_inline();
+  }
+
+  // returns +1 or 0 indicating whether a new table was opened
+  template<typename F, typename Engine>
+  int increment(const Dish& dish, const F& p0, Engine& eng) {
+    if (large_) {
+      update_large();
+      const int delta = large_->increment(dish, p0, eng);
+      num_tables_ += delta;
+      ++num_customers_;
+      return delta;
+    }
+    const double d = discount(), s = strength();
+    const dish_counts c = inline_counts(dish);
+    if (c.customers) {
+      const F p_empty = F(s + num_tables_ * d) * p0;
+      const F p_share = F(c.customers - c.tables * d);
+      if (sample_bernoulli(p_empty, p_share, eng)) {
+        const double r = (c.customers - c.tables * d) * sample_uniform01<double>(eng);
+        const unsigned t = select_table(dish, r, d);
+        ++sizes_[t];
+        reorder(t);
+        ++num_customers_;
+        return 0;
+      }
+    }
+    if (num_tables_ < kINLINE) {
+      insert_table(dish, 1);
+    } else {
+      to_large();
+      crp_table_manager<1> tm = large_->tables(dish);
+      tm.create_table();
+      large_->set_tables(dish, tm);
+      ++num_tables_;
+    }
+    ++num_customers_;
+    return 1;
+  }
+
+  // returns -1 or 0, indicating whether a table was closed
+  template<typename Engine>
+  int decrement(const Dish& dish, Engine& eng) {
+    if (large_) {
+      update_large();
+      const int delta = large_->decrement(dish, eng);
+      num_tables_ += delta;
+      --num_customers_;
+      if (num_tables_ <= kINLINE) to_inline();
+      return delta;
+    }
+    const unsigned n = inline_counts(dish).customers;
+    assert(n);
+    const unsigned t = select_table(dish, n * sample_uniform01<double>(eng), 0.0);
+    --num_customers_;
+    if (--sizes_[t]) {
+      reorder(t);
+      return 0;
+    }
+    erase_table(t);
+    return -1;
+  }
+
+  template <typename F>
+  F prob(const Dish& dish, const F& p0) const {
+    if (num_tables_ == 0) return p0;
+    const double d = discount(), s = strength();
+    const dish_counts c = large_ ?
+        dish_counts{large_->num_customers(dish), large_->num_tables(dish)} : inline_counts(dish);
+    const F r = F(num_tables_ * d + s);
+    return (F(c.customers - d * c.tables) + r * p0) / F(num_customers_ + s);
+  }
+
+  double log_likelihood() const {
+    return log_likelihood(discount(), strength());
+  }
+
+  // see crp::log_likelihood
+  double log_likelihood(const double& discount, const double& strength) const {
+    if (large_) return large_->log_likelihood(discount, strength);
+    double lp = 0.0;
+    if (!num_customers_) return lp;
+    if (discount > 0.0) {
+      const double r = cached_lgamma(1, -discount);
+      if (strength)
+        lp += lgamma(strength) - lgamma(strength / discount);
+      lp += - lgamma(strength + num_customers_)
+           + num_tables_ * log(discount) + lgamma(strength / discount + num_tables_);
+      for (unsigned i = 0; i < num_tables_; ++i)
+        lp += cached_lgamma(sizes_[i], -discount) - r;
+    } else if (!discount) {
+      lp += lgamma(strength) + num_tables_ * log(strength) - lgamma(strength + num_tables_);
+      for (auto& dish : *this)
+        lp += lgamma(dish.second.num_tables());
+    } else { // should never happen
+      assert(!"discount less than 0 detected!");
+    }
+    assert(std::isfinite(lp));
+    return lp;
+  }
+
+  // visits each dish once, as (dish, dish_counts)
+  class const_iterator {
+   public:
+    const_iterator(const compact_crp& r, bool end) : r(&r), i(), it() {
+      if (r.large_) {
+        it = end ? r.large_->end() : r.large_->begin();
+      } else {
+        i = end ? r.num_tables_ : 0;
+      }
+      load();
+    }
+    const std::pair<Dish, dish_counts>& operator*() const { return cur; }
+    const std::pair<Dish, dish_counts>* operator->() const { return &cur; }
+    const_iterator& operator++() {
+      if (r->large_) {
+        ++it;
+      } else {
+        while (++i < r->num_tables_ && r->first_table(r->dishes_[i]) != i) {}
+      }
+      load();
+      return *this;
+    }
+    bool operator==(const const_iterator& o) const { return i == o.i && it == o.it; }
+    bool operator!=(const const_iterator& o) const { return !(*this == o); }
+   private:
+    void load() {
+      if (r->large_) {
+        if (it != r->large_->end())
+          cur = std::make_pair(it->first, dish_counts{it->second.num_customers(), it->second.num_tables()});
+      } else if (i < r->num_tables_) {
+        cur = std::make_pair(r->dishes_[i], r->inline_counts(r->dishes_[i]));
+      }
+    }
+    const compact_crp* r;
+    unsigned i;  // inline table
+    typename crp<Dish, DishHash>::const_iterator it;
+    std::pair<Dish, dish_counts> cur;
+  };
+  const_iterator begin() const { return const_iterator(*this, false); }
+  const_iterator end() const { return const_iterator(*this, true); }
+
+  void swap(compact_crp& b) {
+    std::swap(params_, b.params_);
+    std::swap(large_, b.large_);
+    std::swap(num_tables_, b.num_tables_);
+    std::swap(num_customers_, b.num_customers_);
+    std::swap(dishes_, b.dishes_);
+    std::swap(sizes_, b.sizes_);
+  }
+
+  // appends the seating arrangement to cols (see dish_columns)
+  void save_seating(dish_columns<Dish>* cols) const {
+    if (large_) {
+      large_->save_seating(cols);
+      return;
+    }
+    unsigned n = 0;
+    for (auto it = begin(); it != end(); ++it) ++n;
+    cols->num_dishes.push_back(n);
+    for (auto& dish : *this) cols->add_dish(dish.first, tables(dish.first));
+  }
+
+  // replaces the seating arrangement by the next one in cols. returns false
+  // if cols are exhausted or inconsistent
+  bool load_seating(dish_columns<Dish>* cols) {
+    std::unordered_map<Dish, crp_table_manager<1>, DishHash> dish_locs;
+    const bool ok = cols->next(&dish_locs);
+    clear();
+    for (auto& dish_loc : dish_locs) num_tables_ += dish_loc.second.num_tables();
+    if (num_tables_ <= kINLINE) {
+      num_tables_ = 0;
+      for (auto& dish_loc : dish_locs) set_tables(dish_loc.first, dish_loc.second);
+      return ok;
+    }
+    // the tables of each dish stay in the order in which they were saved
+    large_ = new_large();
+    for (auto& dish_loc : dish_locs) large_->set_tables(dish_loc.first, dish_loc.second);
+    num_customers_ = large_->num_customers();
+    return ok;
+  }
+
+  // the seating arrangement, without the hyperparameters of the tie group
+  template<class Archive> void serialize(Archive& ar, const unsigned int version) {
+    dish_columns<Dish> cols;
+    if (!Archive::is_loading::value) save_seating(&cols);
+    ar & cols;
+    if (Archive::is_loading::value && (!load_seating(&cols) || !cols.done())) fail(ar);
+  }
+
+ private:
+  static void fail(binary_iarchive& ar) { ar.fail(); }
+  template<class Archive> static void fail(Archive&) {
+    std::cerr << "Inconsistent CRP seating arrangement in archive\n";
+    abort();
+  }
+
+  dish_counts inline_counts(const Dish& dish) const {
+    dish_counts c{0, 0};
+    for (unsigned i = 0; i < num_tables_; ++i) {
+      if (dishes_[i] == dish) {
+        c.customers += sizes_[i];
+        ++c.tables;
+      }
+    }
+    return c;
+  }
+
+  unsigned first_table(const Dish& dish) const {
+    unsigned i = 0;
+    while (!(dishes_[i] == dish)) ++i;
+    return i;
+  }
+
+  // the inline table of dish at which r falls when every table seating n
+  // customers has weight n - discount
+  unsigned select_table(const Dish& dish, double r, double discount) const {
+    unsigned t = kINLINE;
+    for (unsigned i = 0; i < num_tables_; ++i) {
+      if (!(dishes_[i] == dish)) continue;
+      t = i;
+      if ((r -= sizes_[i] - discount) < 0) break;
+    }
+    assert(t < kINLINE);
+    return t;
+  }
+
+  // whether inline table i comes before table j
+  bool before(unsigned i, unsigned j) const {
+    return dishes_[i] < dishes_[j] || (dishes_[i] == dishes_[j] && sizes_[i] < sizes_[j]);
+  }
+
+  void insert_table(const Dish& dish, unsigned size) {
+    unsigned i = num_tables_++;
+    for (; i > 0 && (dish < dishes_[i - 1] || (dish == dishes_[i - 1] && size < sizes_[i - 1])); --i) {
+      dishes_[i] = dishes_[i - 1];
+      sizes_[i] = sizes_[i - 1];
+    }
+    dishes_[i] = dish;
+    sizes_[i] = size;
+  }
+
+  void erase_table(unsigned i) {
+    --num_tables_;
+    for (; i < num_tables_; ++i) {
+      dishes_[i] = dishes_[i + 1];
+      sizes_[i] = sizes_[i + 1];
+    }
+  }
+
+  // moves inline table t, whose size has changed by one, to its place
+  void reorder(unsigned t) {
+    for (; t > 0 && before(t, t - 1); --t) {
+      std::swap(dishes_[t], dishes_[t - 1]);
+      std::swap(sizes_[t], sizes_[t - 1]);
+    }
+    for (; t + 1 < num_tables_ && before(t + 1, t); ++t) {
+      std::swap(dishes_[t], dishes_[t + 1]);
+      std::swap(sizes_[t], sizes_[t + 1]);
+    }
+  }
+
+  // gives the crp the current hyperparameters of the tie group
+  void update_large() {
+    if (large_->discount() != discount() || large_->strength() != strength())
+      large_->set_hyperparameters(discount(), strength());
+  }
+
+  typedef crp<Dish, DishHash> large_crp;
+
+  // the crp of a large restaurant lives in the arena of its dishes, from
+  // which it is also freed
+  struct large_deleter {
+    void operator()(large_crp* r) const {
+      pool_allocator<large_crp> alloc(r->arena());
+      r->~large_crp();
+      alloc.deallocate(r, 1);
+    }
+  };
+  typedef std::unique_ptr<large_crp, large_deleter> large_ptr;
+
+  static large_ptr copy_large(const large_crp& o, memory_arena* arena) {
+    pool_allocator<large_crp> alloc(arena);
+    large_ptr r(new (alloc.allocate(1)) large_crp(o));
+    if (arena != o.arena()) r->set_arena(arena);
+    return r;
+  }
+
+  // a restaurant without parameters yet (e.g. while a boost archive is being
+  // loaded) gets the defaults of crp, which update_large replaces before
+  // they are used
+  large_ptr new_large() const {
+    memory_arena* arena = params_ ? params_->arena : nullptr;
+    pool_allocator<large_crp> alloc(arena);
+    large_ptr r(new (alloc.allocate(1)) large_crp);
+    r->set_llh_tracking(false);
+    if (params_) r->set_hyperparameters(discount(), strength());
+    r->set_arena(arena);
+    return r;
+  }
+
+  void to_large() {
+    large_ptr r = new_large();
+    for (unsigned i = 0; i < num_tables_; ++i)
+      if (first_table(dishes_[i]) == i) r->set_tables(dishes_[i], tables(dishes_[i]));
+    large_ = std::move(r);
+  }
+
+  void to_inline() {
+    large_ptr r = std::move(large_);
+    num_tables_ = 0;
+    for (auto& dish_loc : *r)
+      for (auto& bin : dish_loc.second.h[0])
+        for (unsigned k = 0; k < bin.second; ++k) insert_table(dish_loc.first, bin.first);
+    assert(num_tables_ == r->num_tables());
+  }
+
+  shared_crp_parameters* params_;
+  large_ptr large_;  // null while the tables are inline
+  unsigned num_tables_;
+  unsigned num_customers_;
+  Dish dishes_[kINLINE];     // of the first num_tables_ tables, unless large_
+  unsigned sizes_[kINLINE];  // customers
+};
+
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef _CPYP_CRP_STATISTICS_H_
+#define _CPYP_CRP_STATISTICS_H_
+
+#include <cassert>
+#include <cmath>
+#include <map>
+#include <limits>
+#include <vector>
+#include "lgamma_kernels.h"
+
+namespace cpyp {
+
+// sufficient statistics of the seating arrangements of a group of CRPs (crp
+// or mf_crp) for their hyperparameters: how many of the restaurants seat each
+// number of customers and each number of tables, and how many tables seat
+// each number of customers (merged from every CRP's table_sizes()).
+// log_likelihood(d, s) is the sum of the CRPs' log_likelihood(d, s), without
+// their priors, in time proportional to the number of distinct counts rather
+// than to the number of CRPs and dishes. the counts are copied to arrays for
+// lgamma_dot on the first evaluation, and the table size term, which only
+// depends on d, is kept for the next evaluation (e.g., while the strength is
+// slice sampled), so log_likelihood must not be called by several threads at
+// once
+struct crp_statistics {
+  crp_statistics() : restaurants(), tables(), dp_dishes(), has_dp_dishes(true),
+      sizes_discount(std::numeric_limits<double>::quiet_NaN()), sizes_llh() {}
+
+  template <class CRP>
+  void add(const CRP& crp) {
+    if (!crp.num_customers()) return;
+    flat.clear();
+    ++restaurants;
+    tables += crp.num_tables();
+    ++customer_counts[crp.num_customers()];
+    ++table_counts[crp.num_tables()];
+    for (auto& bin : crp.table_sizes())
+      table_sizes[bin.first] += bin.second;
+    // the Dirichlet process (d = 0) likelihood depends on the number of
+    // tables of every dish, which is only collected from CRPs that currently
+    // have d = 0 (slice sampling the discount never proposes d = 0)
+    if (crp.discount() > 0.0) {
+      has_dp_dishes = false;
+    } else {
+      for (auto& dish_loc : crp)
+        dp_dishes += lgamma(dish_loc.second.num_tables());
+    }
+  }
+
+  // adds the restaurants of another group
+  void merge(const crp_statistics& o) {
+    flat.clear();
+    restaurants += o.restaurants;
+    tables += o.tables;
+    for (auto& c : o.customer_counts) customer_counts[c.first] += c.second;
+    for (auto& t : o.table_counts) table_counts[t.first] += t.second;
+    for (auto& bin : o.table_sizes) table_sizes[bin.first] += bin.second;
+    dp_dishes += o.dp_dishes;
+    has_dp_dishes = has_dp_dishes && o.has_dp_dishes;
+  }
+
+  double log_likelihood(const double& discount, const double& strength) const {
+    double lp = 0.0;
+    if (!restaurants) return lp;
+    if (flat.empty()) flatten();
+    if (discount > 0.0) {
+      if (strength)
+        lp += restaurants * (lgamma(strength) - lgamma(strength / discount));
+      lp += tables * log(discount);
+      lp -= flat[0].dot(strength);
+      lp += flat[1].dot(strength / discount);
+      if (!(discount == sizes_discount)) {
+        sizes_discount = discount;
+        sizes_llh = flat[2].dot(-discount) - lgamma(1.0 - discount) * flat[2].total;
+      }
+      lp += sizes_llh;
+    } else if (!discount) {
+      assert(has_dp_dishes);
+      lp += restaurants * lgamma(strength) + tables * log(strength) + dp_dishes;
+      lp -= flat[1].dot(strength);
+    } else { // should never happen
+      assert(!"discount less than 0 detected!");
+    }
+    assert(std::isfinite(lp));
+    return lp;
+  }
+
+  unsigned restaurants;  // non-empty CRPs added
+  double tables;  // over all restaurants
+  std::map<unsigned, unsigned> customer_counts;  // customers -> restaurants
+  std::map<unsigned, unsigned> table_counts;  // tables -> restaurants
+  std::map<unsigned, double> table_sizes;  // customers -> tables
+  double dp_dishes;  // sum of lgamma(tables of each dish), see add()
+  bool has_dp_dishes;
+
+ private:
+  // the (count, weight) pairs of one of the histograms
+  struct weighted_counts {
+    std::vector<double> x, w;
+    double total = 0;  // of the weights
+    template <class Map> explicit weighted_counts(const Map& m) {
+      for (auto& c : m) {
+        x.push_back(c.first);
+        w.push_back(c.second);
+        total += c.second;
+      }
+    }
+    // sum of w[i] * lgamma(x[i] + offset)
+    double dot(double offset) const { return lgamma_dot(x.data(), w.data(), x.size(), offset); }
+  };
+
+  void flatten() const {
+    flat.emplace_back(customer_counts);
+    flat.emplace_back(table_counts);
+    flat.emplace_back(table_sizes);
+    sizes_discount = std::numeric_limits<double>::quiet_NaN();
+  }
+
+  mutable std::vector<weighted_counts> flat;  // customers, tables, table sizes
+  mutable double sizes_discount;  // d of sizes_llh
+  mutable double sizes_llh;  // the table size term for sizes_discount
+};
+
+}
+
+#endif
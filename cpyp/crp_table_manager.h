@@ -3,43 +3,267 @@
 
 #include <iostream>
 #include <utility>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
 #include "msparse_vector.h"
 #include "random.h"
 
 namespace cpyp {
 
+// Fenwick (binary indexed) trees over table sizes 1 ... counts.size()-1,
+// holding the number of tables seating n customers and the number of
+// customers at those tables, so that the table of the r-th customer (in
+// order of table size) is found in O(log n) time. see crp_histogram
+struct table_size_tree {
+  table_size_tree() : bins(), tables(), customers() {}
+
+  unsigned count(unsigned bin) const { return bin < counts.size() ? counts[bin] : 0; }
+
+  void add(unsigned bin, int delta) {
+    if (bin >= counts.size()) grow(bin);
+    if (!counts[bin]) ++bins;
+    counts[bin] += delta;
+    if (!counts[bin]) --bins;
+    tables += delta;
+    customers += delta * bin;
+    for (unsigned i = bin; i < counts.size(); i += i & -i) {
+      table_tree[i] += delta;
+      customer_tree[i] += delta * bin;
+    }
+  }
+
+  // the size of the table seating the r-th customer (0 <= r < customers)
+  unsigned select_customer(unsigned r) const {
+    unsigned pos = 0;
+    for (unsigned step = counts.size() / 2; step; step >>= 1) {
+      if (customer_tree[pos + step] <= r) {
+        pos += step;
+        r -= customer_tree[pos];
+      }
+    }
+    return pos + 1;
+  }
+
+  // the smallest table size n with sum_{k <= n} (k - discount) c_k > r, or
+  // counts.size() if there is none
+  unsigned select_discounted(double r, const double discount) const {
+    unsigned pos = 0;
+    for (unsigned step = counts.size() / 2; step; step >>= 1) {
+      const double w = customer_tree[pos + step] - discount * table_tree[pos + step];
+      if (w <= r) {
+        pos += step;
+        r -= w;
+      }
+    }
+    return pos + 1;
+  }
+
+  // the smallest table size greater than bin that has any tables, or 0
+  unsigned next_bin(unsigned bin) const {
+    unsigned k = 1;
+    for (unsigned i = std::min<unsigned>(bin, counts.size() - 1); i; i -= i & -i)
+      k += table_tree[i];
+    return k > tables ? 0 : select_table(k);
+  }
+
+  // the size of the k-th table in order of size (1 <= k <= tables)
+  unsigned select_table(unsigned k) const {
+    unsigned pos = 0;
+    for (unsigned step = counts.size() / 2; step; step >>= 1) {
+      if (table_tree[pos + step] < k) {
+        pos += step;
+        k -= table_tree[pos];
+      }
+    }
+    return pos + 1;
+  }
+
+  unsigned bins;       // number of table sizes with any tables
+  unsigned tables;
+  unsigned customers;
+
+ private:
+  // makes room for table sizes up to bin
+  void grow(unsigned bin) {
+    unsigned size = 16;
+    while (size <= bin) size *= 2;
+    counts.resize(size);
+    table_tree.assign(size, 0);
+    customer_tree.assign(size, 0);
+    for (unsigned i = 1; i < size; ++i) {
+      table_tree[i] += counts[i];
+      customer_tree[i] += counts[i] * i;
+      const unsigned j = i + (i & -i);
+      if (j < size) {
+        table_tree[j] += table_tree[i];
+        customer_tree[j] += customer_tree[i];
+      }
+    }
+  }
+
+  std::vector<unsigned> counts;  // counts[n] = number of tables seating n customers
+  std::vector<unsigned> table_tree;
+  std::vector<unsigned> customer_tree;
+};
+
 // these are helper classes for implementing token-based CRP samplers
 // basically the data structures recommended by Blunsom et al. in the Note.
 // they are extended to deal with multifloor CRPs (see Wood & Teh, 2009)
 // but if you don't care about this, just set the number of floors to 1
+//
+// a crp_histogram maps table sizes to the number of tables of that size.
+// most dishes have tables of only a few different sizes, which are kept in
+// a SparseVector and searched linearly. once a dish has tables of more than
+// kMAX_SPARSE_BINS different sizes (typically, frequent words in low order
+// restaurants), the histogram switches to a table_size_tree, and goes back
+// when the number of sizes falls below kMIN_TREE_BINS
 struct crp_histogram {
   //typedef std::map<unsigned, unsigned> MAPTYPE;
   typedef SparseVector<unsigned> MAPTYPE;
-  typedef MAPTYPE::const_iterator const_iterator;
+  static const unsigned kMAX_SPARSE_BINS = 15;  // what a SparseVector<unsigned> stores locally
+  static const unsigned kMIN_TREE_BINS = 8;
+
+  struct const_iterator {
+    const_iterator(const crp_histogram& h, bool is_end) :
+        it(h.data, is_end), tree(h.tree.get()), cur(tree && !is_end ? tree->next_bin(0) : 0, 0) {
+      if (cur.first) cur.second = tree->count(cur.first);
+    }
+    const std::pair<const unsigned, unsigned>& operator*() const {
+      if (tree) return reinterpret_cast<const std::pair<const unsigned, unsigned>&>(cur);
+      return *it;
+    }
+    const std::pair<const unsigned, unsigned>* operator->() const { return &**this; }
+    const_iterator& operator++() {
+      if (tree) {
+        cur.first = tree->next_bin(cur.first);
+        cur.second = cur.first ? tree->count(cur.first) : 0;
+      } else {
+        ++it;
+      }
+      return *this;
+    }
+    bool operator==(const const_iterator& o) const {
+      return tree ? cur.first == o.cur.first : it == o.it;
+    }
+    bool operator!=(const const_iterator& o) const { return !(*this == o); }
+   private:
+    MAPTYPE::const_iterator it;
+    const table_size_tree* tree;
+    std::pair<unsigned, unsigned> cur;
+  };
+
+  crp_histogram() {}
+  crp_histogram(const crp_histogram& o) : data(o.data), tree(o.tree ? new table_size_tree(*o.tree) : nullptr) {}
+  crp_histogram(crp_histogram&& o) : data(o.data), tree(std::move(o.tree)) {}
+  crp_histogram& operator=(const crp_histogram& o) {
+    data = o.data;
+    tree.reset(o.tree ? new table_size_tree(*o.tree) : nullptr);
+    return *this;
+  }
+  crp_histogram& operator=(crp_histogram&& o) {
+    data = o.data;
+    tree = std::move(o.tree);
+    return *this;
+  }
 
   inline void increment(unsigned bin, unsigned delta = 1u) {
-    data[bin] += delta;
+    if (!tree && data.size() == kMAX_SPARSE_BINS && !data.nonzero(bin)) to_tree();
+    if (tree) tree->add(bin, delta); else data[bin] += delta;
   }
   inline void decrement(unsigned bin, unsigned delta = 1u) {
-    unsigned r = data[bin] -= delta;
-    if (!r) data.erase(bin);
+    if (tree) {
+      tree->add(bin, -static_cast<int>(delta));
+      if (tree->bins < kMIN_TREE_BINS) to_sparse();
+    } else {
+      unsigned r = data[bin] -= delta;
+      if (!r) data.erase(bin);
+    }
   }
   inline void move(unsigned from_bin, unsigned to_bin, unsigned delta = 1u) {
     decrement(from_bin, delta);
     increment(to_bin, delta);
   }
-  bool empty() const { return data.empty(); }
-  inline const_iterator begin() const { return data.begin(); }
-  inline const_iterator end() const { return data.end(); }
+  bool empty() const { return tree ? !tree->tables : data.empty(); }
+
+  unsigned num_tables() const {
+    if (tree) return tree->tables;
+    unsigned t = 0;
+    for (auto& bin : data) t += bin.second;
+    return t;
+  }
+  unsigned num_customers() const {
+    if (tree) return tree->customers;
+    unsigned c = 0;
+    for (auto& bin : data) c += bin.first * bin.second;
+    return c;
+  }
+
+  // the size of the table seating the r-th customer, in the order of
+  // iteration, or 0 if r >= num_customers()
+  unsigned select_customer(unsigned r) const {
+    if (tree) return r < tree->customers ? tree->select_customer(r) : 0;
+    for (auto& bin : data) {
+      const unsigned thresh = bin.first * bin.second;
+      if (thresh > r) return bin.first;
+      r -= thresh;
+    }
+    return 0;
+  }
+
+  // the size of the table at which r (0 <= r < num_customers() - discount *
+  // num_tables()) falls when every table seating n customers has weight
+  // n - discount, or 0 if r is out of range
+  unsigned select_discounted(double r, const double discount) const {
+    if (tree) {
+      if (r >= tree->customers - discount * tree->tables) return 0;
+      const unsigned n = tree->select_discounted(r, discount);
+      // r may only be within rounding error of the total
+      return tree->count(n) ? n : tree->select_table(tree->tables);
+    }
+    for (auto& bin : data) {
+      const double thresh = (bin.first - discount) * bin.second;
+      if (thresh > r) return bin.first;
+      r -= thresh;
+    }
+    return 0;
+  }
+
+  inline const_iterator begin() const { return const_iterator(*this, false); }
+  inline const_iterator end() const { return const_iterator(*this, true); }
   void swap(crp_histogram& other) {
     std::swap(data, other.data);
+    std::swap(tree, other.tree);
   }
 
+  // always stored as a SparseVector
   template<class Archive> void serialize(Archive& ar, const unsigned int version) {
-    ar & data;
+    if (Archive::is_loading::value) {
+      tree.reset();
+      ar & data;
+      if (data.size() > kMAX_SPARSE_BINS) to_tree();
+    } else if (tree) {
+      MAPTYPE all;
+      for (auto& bin : *this) all[bin.first] = bin.second;
+      ar & all;
+    } else {
+      ar & data;
+    }
   }
  private:
-  MAPTYPE data;
+  void to_tree() {
+    tree.reset(new table_size_tree);
+    for (auto& bin : data) tree->add(bin.first, bin.second);
+    data.clear();
+  }
+  void to_sparse() {
+    for (auto& bin : *this) data[bin.first] = bin.second;
+    tree.reset();
+  }
+
+  MAPTYPE data;  // empty if tree is used
+  std::unique_ptr<table_size_tree> tree;
 };
 
 void swap(crp_histogram& a, crp_histogram& b) {
@@ -79,13 +303,12 @@ struct crp_table_manager {
     double r = z * sample_uniform01<double>(eng);
     const auto floor_count = [&]()->std::pair<unsigned,int> {
       for (unsigned floor = 0; floor < NumFloors; ++floor) {
-        const auto end = h[floor].end();
-        auto i = h[floor].begin();
-        for (; i != end; ++i) {
-          const double thresh = (i->first - discount) * i->second;
-          if (thresh > r) return std::make_pair(floor, i->first);
-          r -= thresh;
+        if (floor + 1 < NumFloors) {
+          const double thresh = h[floor].num_customers() - discount * h[floor].num_tables();
+          if (thresh <= r) { r -= thresh; continue; }
         }
+        const unsigned cc = h[floor].select_discounted(r, discount);
+        if (cc) return std::make_pair(floor, cc);
       }
       std::cerr << "Serious error while incrementing: Floors=" << NumFloors
                 << " r=" << r << std::endl;
@@ -102,17 +325,16 @@ struct crp_table_manager {
   // returns (floor,table delta). Will be (0,0) unless a table is removed
   template<typename Engine>
   inline std::pair<unsigned,int> remove_customer(Engine& eng, unsigned* selected_table_postcount) {
-    int r = sample_uniform01<double>(eng) * num_customers();
+    unsigned r = sample_uniform01<double>(eng) * num_customers();
     const auto floor_count = [&]()->std::pair<unsigned,int> {
       for (unsigned floor = 0; floor < NumFloors; ++floor) {
-        const auto end = h[floor].end();
-        auto i = h[floor].begin();
-        for (; i != end; ++i) {
-          // sample randomly, i.e. *don't* discount
-          const int thresh = i->first * i->second;
-          if (thresh > r) return std::make_pair(floor, i->first);
-          r -= thresh;
+        // sample randomly, i.e. *don't* discount
+        if (floor + 1 < NumFloors) {
+          const unsigned thresh = h[floor].num_customers();
+          if (thresh <= r) { r -= thresh; continue; }
         }
+        const unsigned tc = h[floor].select_customer(r);
+        if (tc) return std::make_pair(floor, tc);
       }
       std::cerr << "Serious error while decrementing: Floors=" << NumFloors
                 << " r=" << r << std::endl;
@@ -165,6 +387,84 @@ std::ostream& operator<<(std::ostream& os, const crp_table_manager<N>& tm) {
   return os << ']';
 }
 
+// the seating arrangements of a sequence of CRPs, column by column: the
+// number of dishes of each CRP, the dishes, the number of table sizes of each
+// dish and floor, and the (table size, number of tables) pairs. bulk archives
+// (see binary_archive.h) write each column as a single block, so a model with
+// millions of restaurants is saved and loaded without a call per dish
+template <typename Dish>
+struct dish_columns {
+  dish_columns() : crp_pos(), dish_pos(), count_pos(), bin_pos() {}
+
+  // appends the dishes of a CRP
+  template <unsigned NumFloors, class Hash, class Eq, class Alloc>
+  void add(const std::unordered_map<Dish, crp_table_manager<NumFloors>, Hash, Eq, Alloc>& dish_locs) {
+    num_dishes.push_back(dish_locs.size());
+    for (auto& dish_loc : dish_locs) add_dish(dish_loc.first, dish_loc.second);
+  }
+
+  // appends a dish of the CRP whose number of dishes was appended last
+  template <unsigned NumFloors>
+  void add_dish(const Dish& dish, const crp_table_manager<NumFloors>& tm) {
+    dishes.push_back(dish);
+    for (unsigned floor = 0; floor < NumFloors; ++floor) {
+      const size_t begin = bins.size();
+      for (auto& bin : tm.h[floor]) {
+        bins.push_back(bin.first);
+        bins.push_back(bin.second);
+      }
+      num_bins.push_back((bins.size() - begin) / 2);
+    }
+  }
+
+  // replaces dish_locs by the dishes of the next CRP. returns false if there
+  // is none or the columns are inconsistent
+  template <unsigned NumFloors, class Hash, class Eq, class Alloc>
+  bool next(std::unordered_map<Dish, crp_table_manager<NumFloors>, Hash, Eq, Alloc>* dish_locs) {
+    dish_locs->clear();
+    if (crp_pos == num_dishes.size()) return false;
+    const size_t n = num_dishes[crp_pos++];
+    if (n > dishes.size() - dish_pos || n * NumFloors > num_bins.size() - count_pos) return false;
+    dish_locs->reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      crp_table_manager<NumFloors>& loc = (*dish_locs)[dishes[dish_pos++]];
+      for (unsigned floor = 0; floor < NumFloors; ++floor) {
+        const size_t m = num_bins[count_pos++];
+        if (m > (bins.size() - bin_pos) / 2) return false;
+        for (size_t j = 0; j < m; ++j, bin_pos += 2) {
+          const unsigned size = bins[bin_pos], count = bins[bin_pos + 1];
+          if (!size || !count) return false;
+          loc.h[floor].increment(size, count);
+          loc.tables += count;
+          loc.customers += size * count;
+        }
+      }
+      if (!loc.tables) return false;
+    }
+    return true;
+  }
+
+  // whether next() has consumed every column
+  bool done() const {
+    return crp_pos == num_dishes.size() && dish_pos == dishes.size() &&
+           count_pos == num_bins.size() && bin_pos == bins.size();
+  }
+
+  template<class Archive> void serialize(Archive& ar, const unsigned int version) {
+    ar & num_dishes;
+    ar & dishes;
+    ar & num_bins;
+    ar & bins;
+  }
+
+  std::vector<unsigned> num_dishes;  // per CRP
+  std::vector<Dish> dishes;
+  std::vector<unsigned> num_bins;    // per dish and floor
+  std::vector<unsigned> bins;        // (table size, number of tables) pairs
+ private:
+  size_t crp_pos, dish_pos, count_pos, bin_pos;  // read positions of next()
+};
+
 }
 
 #endif
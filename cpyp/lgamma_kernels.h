@@ -0,0 +1,178 @@
+#ifndef _CPYP_LGAMMA_KERNELS_H_
+#define _CPYP_LGAMMA_KERNELS_H_
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+// batched lgamma for the CRP likelihoods, which evaluate lgamma at every
+// distinct table size (or number of customers, or tables) once per slice
+// sampler proposal
+//
+// lgamma_dot(x, w, n, offset) = sum_i w[i] * lgamma(x[i] + offset), where
+// every x[i] + offset must be positive. on x86 CPUs with AVX2 or AVX-512 the
+// lgamma values are computed 4 or 8 at a time with an approximation whose
+// error is below 2e-14 * max(1, |lgamma|); otherwise (or after
+// set_lgamma_kernel(kLGAMMA_SCALAR)) std::lgamma is used. the kernel is
+// chosen when it is first used, from what the CPU supports
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPYP_LGAMMA_DISPATCH 1
+#endif
+
+namespace cpyp {
+
+enum lgamma_kernel { kLGAMMA_SCALAR = 0, kLGAMMA_AVX2 = 1, kLGAMMA_AVX512 = 2 };
+
+namespace lgamma_detail {
+
+inline double as_double(uint64_t u) { double d; std::memcpy(&d, &u, sizeof(d)); return d; }
+inline uint64_t as_bits(double d) { uint64_t u; std::memcpy(&u, &d, sizeof(u)); return u; }
+
+// natural log of a positive normal double, using only arithmetic and bit
+// operations so that a loop over it vectorizes. x = 2^k z with z in
+// [0.707, 1.414) (computed as in musl's log), and log(z) = 2 atanh(f)
+__attribute__((always_inline)) inline double log_approx(double x) {
+  const uint64_t ix = as_bits(x);
+  const uint64_t tmp = ix - 0x3fe6955500000000ULL;
+  const double z = as_double(ix - (tmp & 0xfff0000000000000ULL));
+  // k = tmp >> 52 as a signed 12-bit number, converted to double without an
+  // integer to double conversion (which AVX2 lacks)
+  const double k = as_double((((tmp >> 52) + 0x800) & 0xfff) | 0x4330000000000000ULL) -
+                   (4503599627370496.0 + 2048.0);
+  const double f = (z - 1.0) / (z + 1.0);
+  const double s = f * f;
+  double p = 1.0 / 25;
+  p = p * s + 1.0 / 23; p = p * s + 1.0 / 21; p = p * s + 1.0 / 19;
+  p = p * s + 1.0 / 17; p = p * s + 1.0 / 15; p = p * s + 1.0 / 13;
+  p = p * s + 1.0 / 11; p = p * s + 1.0 / 9;  p = p * s + 1.0 / 7;
+  p = p * s + 1.0 / 5;  p = p * s + 1.0 / 3;
+  const double logz = 2.0 * f + 2.0 * f * s * p;
+  return k * 6.93147180369123816490e-01 + (logz + k * 1.90821492927058770002e-10);
+}
+
+// lgamma(x) for 0 < x < 1e60: Stirling's series at y = x + 10, with
+// Gamma(x) = Gamma(x + 10) / (x (x + 1) ... (x + 9)). the shift is applied
+// to every argument, since selecting it only for small x would leave a
+// branch in the loop (the compiler will not speculate floating point
+// operations that may trap)
+__attribute__((always_inline)) inline double lgamma_approx(double x) {
+  const double p1 = x * (x + 1.0) * (x + 2.0) * (x + 3.0) * (x + 4.0);
+  const double p2 = (x + 5.0) * (x + 6.0) * (x + 7.0) * (x + 8.0) * (x + 9.0);
+  const double y = x + 10.0;
+  const double r = 1.0 / y;
+  const double r2 = r * r;
+  const double series = r * (1.0 / 12 + r2 * (-1.0 / 360 + r2 * (1.0 / 1260 + r2 * (-1.0 / 1680 + r2 * (1.0 / 1188)))));
+  return (y - 0.5) * log_approx(y) - y + 0.91893853320467274178 + series -
+         (log_approx(p1) + log_approx(p2));
+}
+
+// out[i] = lgamma(x[i] + offset)
+__attribute__((always_inline)) inline void lgamma_block(const double* x, double offset, size_t n, double* out) {
+  for (size_t i = 0; i < n; ++i) out[i] = lgamma_approx(x[i] + offset);
+}
+
+#ifdef CPYP_LGAMMA_DISPATCH
+__attribute__((target("avx2"), noinline))
+inline void lgamma_block_avx2(const double* x, double offset, size_t n, double* out) {
+  lgamma_block(x, offset, n, out);
+}
+
+__attribute__((target("avx512f"), noinline))
+inline void lgamma_block_avx512(const double* x, double offset, size_t n, double* out) {
+  lgamma_block(x, offset, n, out);
+}
+#endif
+
+inline int& kernel() {
+  static int k = [] {
+#ifdef CPYP_LGAMMA_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return static_cast<int>(kLGAMMA_AVX512);
+    if (__builtin_cpu_supports("avx2")) return static_cast<int>(kLGAMMA_AVX2);
+#endif
+    return static_cast<int>(kLGAMMA_SCALAR);
+  }();
+  return k;
+}
+
+}  // namespace lgamma_detail
+
+inline lgamma_kernel get_lgamma_kernel() {
+  return static_cast<lgamma_kernel>(lgamma_detail::kernel());
+}
+
+// selects the kernel used by lgamma_dot (e.g., kLGAMMA_SCALAR for exact
+// std::lgamma values). returns false, and keeps the current kernel, if the
+// CPU does not support k. not to be called while other threads use lgamma_dot
+inline bool set_lgamma_kernel(lgamma_kernel k) {
+#ifdef CPYP_LGAMMA_DISPATCH
+  __builtin_cpu_init();
+  if (k == kLGAMMA_AVX512 && !__builtin_cpu_supports("avx512f")) return false;
+  if (k == kLGAMMA_AVX2 && !__builtin_cpu_supports("avx2")) return false;
+#else
+  if (k != kLGAMMA_SCALAR) return false;
+#endif
+  lgamma_detail::kernel() = k;
+  return true;
+}
+
+// out[i] = lgamma(x[i] + offset), x[i] + offset > 0
+inline void lgamma_batch(const double* x, double offset, size_t n, double* out) {
+  switch (lgamma_detail::kernel()) {
+#ifdef CPYP_LGAMMA_DISPATCH
+    case kLGAMMA_AVX512: lgamma_detail::lgamma_block_avx512(x, offset, n, out); return;
+    case kLGAMMA_AVX2: lgamma_detail::lgamma_block_avx2(x, offset, n, out); return;
+#endif
+    default:
+      for (size_t i = 0; i < n; ++i) out[i] = lgamma(x[i] + offset);
+  }
+}
+
+// sum_i w[i] * lgamma(x[i] + offset), x[i] + offset > 0. the terms are
+// added in order, so the result does not depend on the vector width
+inline double lgamma_dot(const double* x, const double* w, size_t n, double offset) {
+  const size_t kBLOCK = 256;
+  double buf[kBLOCK];
+  double sum = 0;
+  for (size_t b = 0; b < n; b += kBLOCK) {
+    const size_t m = (n - b < kBLOCK ? n - b : kBLOCK);
+    lgamma_batch(x + b, offset, m, buf);
+    for (size_t i = 0; i < m; ++i) sum += w[b + i] * buf[i];
+  }
+  return sum;
+}
+
+// lgamma(n + offset) for n + offset > 0, looked up for small n in a
+// per-thread table of the values for the most recent offset (such as
+// -discount, while the tables of many CRPs with the same discount are
+// visited). entries are computed on first use after the offset changes
+inline double cached_lgamma(unsigned n, double offset) {
+  static const unsigned kSIZE = 64;
+  struct table {
+    double offset = std::numeric_limits<double>::quiet_NaN();
+    unsigned generation = 1;
+    unsigned stamp[kSIZE] = {};
+    double value[kSIZE];
+  };
+  static thread_local table t;
+  if (n >= kSIZE) return lgamma(n + offset);
+  if (!(offset == t.offset)) {
+    t.offset = offset;
+    if (++t.generation == 0) {
+      std::memset(t.stamp, 0, sizeof(t.stamp));
+      t.generation = 1;
+    }
+  }
+  if (t.stamp[n] != t.generation) {
+    t.stamp[n] = t.generation;
+    t.value[n] = lgamma(n + offset);
+  }
+  return t.value[n];
+}
+
+}
+
+#endif
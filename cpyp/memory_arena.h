@@ -0,0 +1,167 @@
+#ifndef _CPYP_MEMORY_ARENA_H_
+#define _CPYP_MEMORY_ARENA_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace cpyp {
+
+// fixed-size blocks of memory carved from large chunks, for the many small
+// objects of one model: the dish nodes of its CRPs and the crps that hold the
+// tables of its large compact_crps. blocks are grouped into size classes of
+// kALIGN bytes, and a freed block goes onto the free list of its class, from
+// which the next allocation of that size is served, so that seating and
+// removing customers does not go through malloc. requests larger than
+// kMAX_POOLED bytes (e.g. the bucket arrays of large hash tables) are passed
+// on to operator new, and the table size trees of dishes with many distinct
+// table sizes (see crp_histogram) never come from the arena. the chunks are
+// only returned when the arena is released or destroyed, all at once, so an
+// arena should outlive everything that allocates from it (e.g. by being
+// declared before the containers)
+class memory_arena {
+ public:
+  static const size_t kALIGN = 16;
+  static const size_t kMAX_POOLED = 512;
+  static const size_t kCHUNK_SIZE = 64 * 1024;
+  // pools of a concurrent arena (see set_concurrent)
+  static const unsigned kPOOLS = 16;
+
+  memory_arena() : concurrent_(false) {}
+  ~memory_arena() { release(); }
+  memory_arena(const memory_arena&) = delete;
+  memory_arena& operator=(const memory_arena&) = delete;
+
+  void* allocate(size_t n) {
+    if (n > kMAX_POOLED) return ::operator new(n);
+    pool& p = this_pool();
+    std::unique_lock<std::mutex> lock = p.lock(concurrent_);
+    const unsigned c = size_class(n);
+    if (free_block* b = p.free[c]) {
+      p.free[c] = b->next;
+      return b;
+    }
+    const size_t size = (c + 1) * kALIGN;
+    if (static_cast<size_t>(p.end - p.next) < size) {
+      p.next = new_chunk();
+      p.end = p.next + kCHUNK_SIZE;
+    }
+    void* b = p.next;
+    p.next += size;
+    return b;
+  }
+
+  // n must be the size with which b was allocated
+  void deallocate(void* b, size_t n) {
+    if (n > kMAX_POOLED) { ::operator delete(b); return; }
+    pool& p = this_pool();
+    std::unique_lock<std::mutex> lock = p.lock(concurrent_);
+    free_block* fb = static_cast<free_block*>(b);
+    const unsigned c = size_class(n);
+    fb->next = p.free[c];
+    p.free[c] = fb;
+  }
+
+  // frees every chunk, invalidating all the pooled blocks that have been
+  // allocated, whether or not they have been deallocated
+  void release() {
+    for (char* chunk : chunks_) ::operator delete(chunk);
+    chunks_.clear();
+    for (pool& p : pools_) p.clear();
+  }
+
+  // whether allocate and deallocate may be called from several threads at
+  // once. each thread then uses one of kPOOLS pools (chosen round robin when
+  // the thread first allocates), whose lock it only shares with threads
+  // that got the same pool, so that up to kPOOLS threads do not contend. a
+  // block goes onto the free list of the thread that frees it
+  void set_concurrent(bool on) { concurrent_ = on; }
+
+  // bytes held in chunks (in use or on the free lists)
+  size_t bytes_reserved() const { return chunks_.size() * kCHUNK_SIZE; }
+
+ private:
+  static const unsigned kCLASSES = kMAX_POOLED / kALIGN;
+  struct free_block { free_block* next; };
+
+  // free lists and the unused part of the most recent chunk
+  struct pool {
+    pool() { clear(); }
+    void clear() {
+      for (unsigned c = 0; c < kCLASSES; ++c) free[c] = nullptr;
+      next = end = nullptr;
+    }
+    std::unique_lock<std::mutex> lock(bool concurrent) {
+      if (!concurrent) return std::unique_lock<std::mutex>();
+      return std::unique_lock<std::mutex>(mutex);
+    }
+    std::mutex mutex;
+    free_block* free[kCLASSES];
+    char* next;
+    char* end;
+  };
+
+  static unsigned size_class(size_t n) {
+    return n ? (n - 1) / kALIGN : 0;
+  }
+
+  pool& this_pool() {
+    if (!concurrent_) return pools_[0];
+    static std::atomic<unsigned> threads(0);
+    static thread_local const unsigned slot = threads++;
+    return pools_[slot % kPOOLS];
+  }
+
+  char* new_chunk() {
+    char* chunk = static_cast<char*>(::operator new(kCHUNK_SIZE));
+    std::unique_lock<std::mutex> lock;
+    if (concurrent_) lock = std::unique_lock<std::mutex>(chunks_mutex_);
+    chunks_.push_back(chunk);
+    return chunk;
+  }
+
+  bool concurrent_;
+  pool pools_[kPOOLS];
+  std::mutex chunks_mutex_;
+  std::vector<char*> chunks_;
+};
+
+// a standard allocator that draws from a memory_arena, or from operator new
+// if it has none (the default, so that containers that are not given an
+// arena behave as with std::allocator). the arena moves with the elements
+// when containers are copy or move assigned or swapped
+template <class T>
+struct pool_allocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  pool_allocator() : arena() {}
+  explicit pool_allocator(memory_arena* a) : arena(a) {}
+  template <class U> pool_allocator(const pool_allocator<U>& o) : arena(o.arena) {}
+
+  T* allocate(size_t n) {
+    static_assert(alignof(T) <= memory_arena::kALIGN, "over-aligned type");
+    const size_t bytes = n * sizeof(T);
+    return static_cast<T*>(arena ? arena->allocate(bytes) : ::operator new(bytes));
+  }
+  void deallocate(T* p, size_t n) {
+    if (arena) arena->deallocate(p, n * sizeof(T)); else ::operator delete(p);
+  }
+
+  memory_arena* arena;
+};
+
+template <class T, class U>
+bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b) { return a.arena == b.arena; }
+template <class T, class U>
+bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b) { return a.arena != b.arena; }
+
+}
+
+#endif
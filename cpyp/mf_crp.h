@@ -9,8 +9,12 @@
 #include <unordered_map>
 #include <functional>
 #include "random.h"
+#include "binary_archive.h"
 #include "slice_sampler.h"
 #include "crp_table_manager.h"
+#include "memory_arena.h"
+#include "lgamma_kernels.h"
+#include "seating_logs.h"
 #include "m.h"
 
 namespace cpyp {
@@ -24,6 +28,10 @@ namespace cpyp {
 template <unsigned NumFloors, typename Dish, typename DishHash = std::hash<Dish> >
 class mf_crp {
  public:
+  // the table managers of the dishes (see set_arena)
+  typedef std::unordered_map<Dish, crp_table_manager<NumFloors>, DishHash, std::equal_to<Dish>,
+                             pool_allocator<std::pair<const Dish, crp_table_manager<NumFloors>> > > dish_map;
+
   mf_crp() :
       num_tables_(),
       num_customers_(),
@@ -32,7 +40,8 @@ class mf_crp {
       discount_prior_strength_(std::numeric_limits<double>::quiet_NaN()),
       discount_prior_beta_(std::numeric_limits<double>::quiet_NaN()),
       strength_prior_shape_(std::numeric_limits<double>::quiet_NaN()),
-      strength_prior_rate_(std::numeric_limits<double>::quiet_NaN()) {
+      strength_prior_rate_(std::numeric_limits<double>::quiet_NaN()),
+      track_llh_(true) {
     check_hyperparameters();
   }
 
@@ -44,7 +53,8 @@ class mf_crp {
       discount_prior_strength_(std::numeric_limits<double>::quiet_NaN()),
       discount_prior_beta_(std::numeric_limits<double>::quiet_NaN()),
       strength_prior_shape_(std::numeric_limits<double>::quiet_NaN()),
-      strength_prior_rate_(std::numeric_limits<double>::quiet_NaN()) {
+      strength_prior_rate_(std::numeric_limits<double>::quiet_NaN()),
+      track_llh_(true) {
     check_hyperparameters();
   }
 
@@ -56,7 +66,8 @@ class mf_crp {
       discount_prior_strength_(d_strength),
       discount_prior_beta_(d_beta),
       strength_prior_shape_(c_shape),
-      strength_prior_rate_(c_rate) {
+      strength_prior_rate_(c_rate),
+      track_llh_(true) {
     check_hyperparameters();
   }
 
@@ -70,12 +81,7 @@ class mf_crp {
       abort();
     }
 
-    llh_ = lgamma(strength_) - lgamma(strength_ / discount_);
-    if (has_discount_prior())
-      llh_ = Md::log_beta_density(discount_, discount_prior_strength_, discount_prior_beta_);
-    if (has_strength_prior())
-      llh_ += Md::log_gamma_density(strength_ + discount_, strength_prior_shape_, strength_prior_rate_);
-    if (num_tables_ > 0) llh_ = log_likelihood(discount_, strength_);
+    if (track_llh_) llh_ = log_likelihood(discount_, strength_);
   }
 
   double discount() const { return discount_; }
@@ -87,6 +93,14 @@ class mf_crp {
   void set_discount(double d) { discount_ = d; check_hyperparameters(); }
   void set_strength(double a) { strength_ = a; check_hyperparameters(); }
 
+  // whether log_likelihood() is kept up to date while customers are seated
+  // and removed (the default). without it seating is cheaper, and
+  // log_likelihood() evaluates the seating arrangement when it is called
+  void set_llh_tracking(bool on) {
+    track_llh_ = on;
+    if (on) llh_ = log_likelihood(discount_, strength_);
+  }
+
   bool has_discount_prior() const {
     return !std::isnan(discount_prior_strength_);
   }
@@ -99,7 +113,18 @@ class mf_crp {
     num_tables_ = 0;
     num_customers_ = 0;
     dish_locs_.clear();
+    table_sizes_ = crp_histogram();
+  }
+
+  // allocates the dishes from arena (if it is not null) rather than with
+  // operator new. the arena must outlive the restaurant and its copies, which
+  // share it
+  void set_arena(memory_arena* arena) {
+    dish_map m(dish_locs_.begin(), dish_locs_.end(), dish_locs_.bucket_count(),
+               DishHash(), std::equal_to<Dish>(), pool_allocator<typename dish_map::value_type>(arena));
+    dish_locs_.swap(m);
   }
+  memory_arena* arena() const { return dish_locs_.get_allocator().arena; }
 
   unsigned num_tables() const {
     return num_tables_;
@@ -121,6 +146,11 @@ class mf_crp {
     return it->num_customers();
   }
 
+  // number of tables seating each number of customers, over all dishes and floors
+  const crp_histogram& table_sizes() const {
+    return table_sizes_;
+  }
+
   // returns (floor,table delta) where table delta +1 or 0 indicates whether a new table was opened or not
   template <class InputIterator, class InputIterator2, typename Engine>
   std::pair<unsigned,int> increment(const Dish& dish, InputIterator p0i, InputIterator2 lambdas, Engine& eng) {
@@ -225,26 +255,33 @@ class mf_crp {
   }
 
   double log_likelihood() const {
-    return llh_;
-//    return log_likelihood(discount_, strength_);
+    return track_llh_ ? llh_ : log_likelihood(discount_, strength_);
   }
 
   // call this before changing the number of tables / customers
+  // (this also keeps table_sizes() up to date)
   void update_llh_add_customer_to_table_seating(unsigned n) {
+    if (n) table_sizes_.move(n, n + 1); else table_sizes_.increment(1);
+    if (!track_llh_) return;
+    seating_logs& logs = seating_logs::get(discount_, strength_);
     unsigned t = 0;
     if (n == 0) t = 1;
-    llh_ -= log(strength_ + num_customers_);
-    if (t == 1) llh_ += log(discount_) + log(strength_ / discount_ + num_tables_);
-    if (n > 0) llh_ += log(n - discount_);
+    llh_ -= logs.customers(num_customers_);
+    if (t == 1) llh_ += logs.tables(num_tables_);
+    if (n > 0) llh_ += logs.table(n);
   }
 
   // call this before changing the number of tables / customers
+  // (this also keeps table_sizes() up to date)
   void update_llh_remove_customer_from_table_seating(unsigned n) {
+    if (n > 1) table_sizes_.move(n, n - 1); else table_sizes_.decrement(1);
+    if (!track_llh_) return;
+    seating_logs& logs = seating_logs::get(discount_, strength_);
     unsigned t = 0;
     if (n == 1) t = 1;
-    llh_ += log(strength_ + num_customers_ - 1);
-    if (t == 1) llh_ -= log(discount_) + log(strength_ / discount_ + num_tables_ - 1);
-    if (n > 1) llh_ -= log(n - discount_ - 1);
+    llh_ += logs.customers(num_customers_ - 1);
+    if (t == 1) llh_ -= logs.tables(num_tables_ - 1);
+    if (n > 1) llh_ -= logs.table(n - 1);
   }
 
   // adapted from http://en.wikipedia.org/wiki/Chinese_restaurant_process
@@ -258,7 +295,7 @@ class mf_crp {
     assert(lp <= 0.0);
     if (num_customers_) {  // if restaurant is not empty
       if (discount > 0.0) {  // two parameter case: discount > 0
-        const double r = lgamma(1.0 - discount);
+        const double r = cached_lgamma(1, -discount);
         if (strength)
           lp += lgamma(strength) - lgamma(strength / discount);
         lp += - lgamma(strength + num_customers_)
@@ -274,10 +311,8 @@ class mf_crp {
         //    lp -= log(discount) + log(s / d + T - 1)
 
         assert(std::isfinite(lp));
-        for (auto& dish_loc : dish_locs_)
-          for (unsigned floor = 0; floor < NumFloors; ++floor)
-            for (auto& bin : dish_loc.second.h[floor])
-              lp += (lgamma(bin.first - discount) - r) * bin.second;
+        for (auto& bin : table_sizes_)
+          lp += (cached_lgamma(bin.first, -discount) - r) * bin.second;
          // above implies
          // 1) when adding to a table seating N > 1 customers
          //    lp += log(N - discount)
@@ -332,7 +367,7 @@ class mf_crp {
       (*out) << dish_loc.first << " : " << dish_loc.second << std::endl;
   }
 
-  typedef typename std::unordered_map<Dish, crp_table_manager<NumFloors>, DishHash>::const_iterator const_iterator;
+  typedef typename dish_map::const_iterator const_iterator;
   const_iterator begin() const {
     return dish_locs_.begin();
   }
@@ -344,6 +379,7 @@ class mf_crp {
     std::swap(num_tables_, b.num_tables_);
     std::swap(num_customers_, b.num_customers_);
     std::swap(dish_locs_, b.dish_locs_);
+    table_sizes_.swap(b.table_sizes_);
     std::swap(discount_, b.discount_);
     std::swap(strength_, b.strength_);
     std::swap(discount_prior_strength_, b.discount_prior_strength_);
@@ -351,24 +387,81 @@ class mf_crp {
     std::swap(strength_prior_shape_, b.strength_prior_shape_);
     std::swap(strength_prior_rate_, b.strength_prior_rate_);
     std::swap(llh_, b.llh_);
+    std::swap(track_llh_, b.track_llh_);
   }
 
   template<class Archive> void serialize(Archive& ar, const unsigned int version) {
+    serialize(ar, is_bulk_archive<Archive>());
+  }
+
+  // appends the seating arrangement to cols (see dish_columns)
+  void save_seating(dish_columns<Dish>* cols) const {
+    cols->add(dish_locs_);
+  }
+
+  // replaces the seating arrangement by the next one in cols, keeping the
+  // hyperparameters. returns false if cols are exhausted or inconsistent
+  bool load_seating(dish_columns<Dish>* cols) {
+    const bool ok = cols->next(&dish_locs_);
+    num_tables_ = 0;
+    num_customers_ = 0;
+    table_sizes_ = crp_histogram();
+    for (auto& dish_loc : dish_locs_) {
+      num_tables_ += dish_loc.second.num_tables();
+      num_customers_ += dish_loc.second.num_customers();
+      for (unsigned floor = 0; floor < NumFloors; ++floor)
+        for (auto& bin : dish_loc.second.h[floor])
+          table_sizes_.increment(bin.first, bin.second);
+    }
+    if (track_llh_) llh_ = log_likelihood(discount_, strength_);
+    return ok;
+  }
+ private:
+  // boost archives store the table managers of the dishes one by one
+  template<class Archive> void serialize(Archive& ar, std::false_type) {
     ar & num_tables_;
     ar & num_customers_;
+    serialize_hyperparameters(ar);
+    ar & llh_;  // llh of current partition structure
+    ar & dish_locs_;
+    // table_sizes_ is not stored
+    if (Archive::is_loading::value) {
+      table_sizes_ = crp_histogram();
+      for (auto& dish_loc : dish_locs_)
+        for (unsigned floor = 0; floor < NumFloors; ++floor)
+          for (auto& bin : dish_loc.second.h[floor])
+            table_sizes_.increment(bin.first, bin.second);
+    }
+  }
+
+  // bulk archives store the seating arrangement as dish_columns, from which
+  // the number of tables and customers and the likelihood are recomputed
+  void serialize(binary_oarchive& ar, std::true_type) {
+    serialize_hyperparameters(ar);
+    dish_columns<Dish> cols;
+    save_seating(&cols);
+    ar & cols;
+  }
+  void serialize(binary_iarchive& ar, std::true_type) {
+    serialize_hyperparameters(ar);
+    dish_columns<Dish> cols;
+    ar & cols;
+    if (!load_seating(&cols) || !cols.done()) ar.fail();
+  }
+
+  template<class Archive> void serialize_hyperparameters(Archive& ar) {
     ar & discount_;
     ar & strength_;
     ar & discount_prior_strength_;
     ar & discount_prior_beta_;
     ar & strength_prior_shape_;
     ar & strength_prior_rate_;
-    ar & llh_;  // llh of current partition structure
-    ar & dish_locs_;
   }
- private:
+
   unsigned num_tables_;
   unsigned num_customers_;
-  std::unordered_map<Dish, crp_table_manager<NumFloors>, DishHash> dish_locs_;
+  dish_map dish_locs_;
+  crp_histogram table_sizes_;  // see table_sizes()
 
   double discount_;
   double strength_;
@@ -382,6 +475,7 @@ class mf_crp {
   double strength_prior_rate_;
 
   double llh_;  // llh of current partition structure
+  bool track_llh_;  // whether llh_ is kept up to date, see set_llh_tracking()
 };
 
 template<unsigned N,typename T>
@@ -0,0 +1,206 @@
+#ifndef _CPYP_MODEL_FILE_H_
+#define _CPYP_MODEL_FILE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binary_archive.h"
+
+namespace cpyp {
+
+// what the header of a model file records about the model, so that tools
+// can choose how to load it (and report on it) before reading the model
+struct model_info {
+  model_info() : order(), vocab_size() {}
+
+  std::string kind;      // e.g., "PYPLM"
+  uint32_t order;
+  uint32_t vocab_size;
+  std::vector<double> hyperparameters;  // e.g., (discount, strength) of each order
+
+  template<class Archive> void serialize(Archive& ar, const unsigned int version) {
+    ar & kind;
+    ar & order;
+    ar & vocab_size;
+    ar & hyperparameters;
+  }
+};
+
+// a 64-bit checksum of [p, p + n), computed on four independent 8-byte lanes
+// so that it runs at memory speed on multi-GB models
+inline uint64_t model_checksum(const char* p, size_t n) {
+  const uint64_t kMUL = 0x9e3779b97f4a7c15ULL;
+  uint64_t h[4] = {n, 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL};
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (unsigned l = 0; l < 4; ++l) {
+      uint64_t w;
+      std::memcpy(&w, p + i + 8 * l, 8);
+      h[l] = (h[l] ^ w) * kMUL;
+      h[l] ^= h[l] >> 29;
+    }
+  }
+  for (; i < n; ++i) h[i & 3] = (h[i & 3] ^ static_cast<unsigned char>(p[i])) * kMUL;
+  uint64_t r = h[0];
+  for (unsigned l = 1; l < 4; ++l) r = (r ^ (h[l] >> 31) ^ h[l]) * kMUL;
+  r ^= r >> 33;
+  r *= 0xff51afd7ed558ccdULL;
+  r ^= r >> 33;
+  return r;
+}
+
+// a model file is a fixed header (magic, version, size and checksum of the
+// rest), a model_info and the model itself, written by binary_oarchive.
+// CRPs and models store their seating arrangements in it as a few large
+// arrays (see dish_columns), so saving and loading take about as long as
+// copying the arrays, and do not need boost. values are stored in the byte
+// order of the machine, like the checkpoints
+//   write_model_file("lm.bin", info, [&](binary_oarchive& oa) { oa & dict; oa & lm; });
+//   model_reader in;
+//   if (!in.open("lm.bin", "PYPLM")) ...
+//   in.archive() & dict; in.archive() & lm;
+//   if (!in.done()) ...
+class model_reader {
+ public:
+  model_reader() : size_(), ia_(nullptr, nullptr) {}
+
+  // maps filename and checks that it is a complete model file of the given
+  // kind. returns false after reporting why not
+  bool open(const std::string& filename, const std::string& kind) {
+    filename_ = filename;
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+      if (fd >= 0) close(fd);
+      std::cerr << "Failed to open " << filename << " for reading\n";
+      return false;
+    }
+    size_ = st.st_size;
+    void* p = size_ ? mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+      std::cerr << "Failed to map " << filename << std::endl;
+      return false;
+    }
+    const size_t size = size_;
+    mapping_.reset(static_cast<const char*>(p),
+                   [size](const char* m) { munmap(const_cast<char*>(m), size); });
+    Header h;
+    bool ok = size_ >= sizeof(h);
+    if (ok) std::memcpy(&h, mapping_.get(), sizeof(h));
+    if (!ok || std::memcmp(h.magic, magic(), kMAGIC_SIZE) || h.version != kVERSION) {
+      if (is_boost_archive(mapping_.get(), size_))
+        std::cerr << filename << " is a boost archive from before models were stored in model files (see README.md)\n";
+      else
+        std::cerr << filename << " is not a model file (or was written by an incompatible version)\n";
+      return false;
+    }
+    const char* body = mapping_.get() + sizeof(h);
+    if (h.size != size_ - sizeof(h) || model_checksum(body, h.size) != h.checksum) {
+      std::cerr << filename << " is truncated or corrupt\n";
+      return false;
+    }
+    ia_ = binary_iarchive(body, body + h.size);
+    ia_ & info_;
+    if (!ia_.good()) {
+      std::cerr << filename << " has a corrupt header\n";
+      return false;
+    }
+    if (info_.kind != kind) {
+      std::cerr << filename << " holds a " << info_.kind << ", not a " << kind << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  const model_info& info() const { return info_; }
+
+  // the model, following the model_info
+  binary_iarchive& archive() { return ia_; }
+
+  // whether the model has been read completely (reporting it if not)
+  bool done() const {
+    if (ia_.good() && !ia_.remaining()) return true;
+    std::cerr << filename_ << " does not hold the expected model\n";
+    return false;
+  }
+
+  // whether filename starts like a model file
+  static bool is_model_file(const std::string& filename) {
+    char m[kMAGIC_SIZE];
+    FILE* f = std::fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    const bool ok = std::fread(m, 1, kMAGIC_SIZE, f) == kMAGIC_SIZE && !std::memcmp(m, magic(), kMAGIC_SIZE);
+    std::fclose(f);
+    return ok;
+  }
+
+ private:
+  template <class F>
+  friend bool write_model_file(const std::string& filename, const model_info& info, const F& f);
+
+  // whether the n bytes at p start with the signature of a boost archive
+  static bool is_boost_archive(const char* p, size_t n) {
+    static const char kSIGNATURE[] = "serialization::archive";
+    const size_t len = sizeof(kSIGNATURE) - 1;
+    const size_t limit = std::min<size_t>(n, 16 + len);
+    for (size_t i = 0; i + len <= limit; ++i)
+      if (!std::memcmp(p + i, kSIGNATURE, len)) return true;
+    return false;
+  }
+
+  static const char* magic() { return "CPYPMODL"; }
+  static const unsigned kMAGIC_SIZE = 8;
+  static const uint32_t kVERSION = 1;
+
+  struct Header {
+    char magic[kMAGIC_SIZE];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;      // bytes after the header
+    uint64_t checksum;  // model_checksum of those bytes
+  };
+
+  std::string filename_;
+  std::shared_ptr<const char> mapping_;
+  size_t size_;
+  model_info info_;
+  binary_iarchive ia_;
+};
+
+// writes info and the model written by f(binary_oarchive&) to filename.
+// returns false after reporting an error
+template <class F>
+bool write_model_file(const std::string& filename, const model_info& info, const F& f) {
+  binary_oarchive oa;
+  oa & info;
+  f(oa);
+  model_reader::Header h;
+  std::memcpy(h.magic, model_reader::magic(), model_reader::kMAGIC_SIZE);
+  h.version = model_reader::kVERSION;
+  h.reserved = 0;
+  h.size = oa.size();
+  h.checksum = model_checksum(oa.data().data(), oa.size());
+  FILE* out = std::fopen(filename.c_str(), "wb");
+  bool ok = out && std::fwrite(&h, sizeof(h), 1, out) == 1 &&
+            std::fwrite(oa.data().data(), 1, oa.size(), out) == oa.size();
+  if (out && std::fclose(out)) ok = false;
+  if (!ok) std::cerr << "Failed to write " << filename << ": " << strerror(errno) << std::endl;
+  return ok;
+}
+
+}
+
+#endif
@@ -2,11 +2,19 @@
 #define _CPYP_RANDOM_H_
 
 #include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <limits>
 #include <vector>
+#include <numeric>
 #include <ctime>
 #include <random>
+#include <sstream>
+#include <string>
 
 namespace cpyp {
 
@@ -31,6 +39,107 @@ struct MT19937 : public std::mt19937 {
     std::cerr << "Seeding random number sequence to " << seed << std::endl;
     return seed;
   }
+  // the state is stored in the text format of std::mt19937
+  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+    std::mt19937& eng = *this;
+    std::string state;
+    if (!Archive::is_loading::value) {
+      std::ostringstream os;
+      os << eng;
+      state = os.str();
+    }
+    ar & state;
+    if (Archive::is_loading::value) {
+      std::istringstream is(state);
+      is >> eng;
+    }
+  }
+};
+
+// fills blocks of uniform [0, 1) doubles with a batched kernel; defined only
+// for the engines that have one (see uniform_buffer)
+template <class Engine> struct uniform_block_source;
+
+// xoshiro256++ (Blackman & Vigna, 2018): a 32-byte state instead of the
+// 2.5 KB of std::mt19937, and 64 bits per call. the sequence is determined
+// by a seed and a stream number, and split() hands out non-overlapping
+// streams, so that the streams of all threads (or documents) of a sampler
+// can be derived from a single master seed
+//   Xoshiro256 eng(seed);
+//   Xoshiro256 t0 = eng.split(), t1 = eng.split();  // one per thread
+//   Xoshiro256 d(seed, doc_id);                     // one per document
+struct Xoshiro256 {
+  typedef uint64_t result_type;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type(0); }
+
+  Xoshiro256() {
+    seed(MT19937::GetTrulyRandomSeed());
+  }
+  explicit Xoshiro256(uint64_t s, uint64_t stream = 0) {
+    seed(s, stream);
+  }
+
+  // the state is filled by splitmix64 started from a mix of s and stream,
+  // which never leaves it all zero
+  void seed(uint64_t s, uint64_t stream = 0) {
+    uint64_t x = s ^ splitmix64(stream + 0x632be59bd9b4e019ULL);
+    for (unsigned i = 0; i < 4; ++i) {
+      x += 0x9e3779b97f4a7c15ULL;
+      state[i] = splitmix64(x);
+    }
+  }
+
+  result_type operator()() {
+    const uint64_t r = rotl(state[0] + state[3], 23) + state[0];
+    const uint64_t t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+    return r;
+  }
+
+  // advances the stream by 2^128 draws
+  void jump() {
+    static const uint64_t kJUMP[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                      0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (uint64_t j : kJUMP) {
+      for (unsigned b = 0; b < 64; ++b) {
+        if (j & (uint64_t(1) << b))
+          for (unsigned i = 0; i < 4; ++i) s[i] ^= state[i];
+        (*this)();
+      }
+    }
+    std::copy(s, s + 4, state);
+  }
+
+  // a stream that starts here and does not overlap the next 2^128 draws of
+  // this one, which skips past it
+  Xoshiro256 split() {
+    Xoshiro256 r = *this;
+    jump();
+    return r;
+  }
+
+  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+    for (unsigned i = 0; i < 4; ++i) ar & state[i];
+  }
+
+  static uint64_t splitmix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+ private:
+  friend struct uniform_block_source<Xoshiro256>;
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  uint64_t state[4];
 };
 
 template<typename F, typename Engine>
@@ -38,6 +147,182 @@ inline F sample_uniform01(Engine& eng) {
   return std::uniform_real_distribution<F>(0,1)(eng);
 }
 
+// the top bits of one draw (as many as F has in its mantissa, so that the
+// result is never rounded up to 1), without going through a distribution
+template<typename F>
+inline F sample_uniform01(Xoshiro256& eng) {
+  const int kBITS = std::numeric_limits<F>::digits < 53 ? std::numeric_limits<F>::digits : 53;
+  return F(eng() >> (64 - kBITS)) * (F(1) / F(uint64_t(1) << kBITS));
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPYP_RANDOM_DISPATCH 1
+#endif
+
+namespace random_detail {
+
+static const unsigned kLANES = 8;
+
+inline uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+// n (a multiple of kLANES) uniform [0, 1) doubles from kLANES xoshiro256++
+// streams, whose states are stored word by word (s[w * kLANES + l] is word w
+// of lane l). the doubles are made from 52 bits by setting the exponent of
+// 1, which needs no integer to double conversion (which AVX2 lacks). with
+// GCC and Clang the lanes are a vector type, so that each step is a few
+// vector instructions (the compiler does not vectorize the loop over the
+// lanes by itself)
+#ifdef __GNUC__
+typedef uint64_t lanes_u64 __attribute__((vector_size(8 * kLANES)));
+typedef double lanes_f64 __attribute__((vector_size(8 * kLANES)));
+
+__attribute__((always_inline)) inline void xoshiro_block(uint64_t* state, unsigned n, double* out) {
+  lanes_u64 s0, s1, s2, s3;
+  std::memcpy(&s0, state, sizeof(s0));
+  std::memcpy(&s1, state + kLANES, sizeof(s1));
+  std::memcpy(&s2, state + 2 * kLANES, sizeof(s2));
+  std::memcpy(&s3, state + 3 * kLANES, sizeof(s3));
+  for (unsigned i = 0; i < n; i += kLANES) {
+    const lanes_u64 sum = s0 + s3;
+    const lanes_u64 r = ((sum << 23) | (sum >> 41)) + s0;
+    const lanes_u64 t = s1 << 17;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = (s3 << 45) | (s3 >> 19);
+    const lanes_u64 bits = (r >> 12) | 0x3ff0000000000000ULL;
+    lanes_f64 d;
+    std::memcpy(&d, &bits, sizeof(d));
+    d -= 1.0;
+    std::memcpy(out + i, &d, sizeof(d));
+  }
+  std::memcpy(state, &s0, sizeof(s0));
+  std::memcpy(state + kLANES, &s1, sizeof(s1));
+  std::memcpy(state + 2 * kLANES, &s2, sizeof(s2));
+  std::memcpy(state + 3 * kLANES, &s3, sizeof(s3));
+}
+#else
+inline void xoshiro_block(uint64_t* state, unsigned n, double* out) {
+  uint64_t* s0 = state;
+  uint64_t* s1 = state + kLANES;
+  uint64_t* s2 = state + 2 * kLANES;
+  uint64_t* s3 = state + 3 * kLANES;
+  for (unsigned i = 0; i < n; i += kLANES) {
+    for (unsigned l = 0; l < kLANES; ++l) {
+      const uint64_t r = rotl(s0[l] + s3[l], 23) + s0[l];
+      const uint64_t t = s1[l] << 17;
+      s2[l] ^= s0[l];
+      s3[l] ^= s1[l];
+      s1[l] ^= s2[l];
+      s0[l] ^= s3[l];
+      s2[l] ^= t;
+      s3[l] = rotl(s3[l], 45);
+      const uint64_t bits = (r >> 12) | 0x3ff0000000000000ULL;
+      double d;
+      std::memcpy(&d, &bits, sizeof(d));
+      out[i + l] = d - 1.0;
+    }
+  }
+}
+#endif
+
+#ifdef CPYP_RANDOM_DISPATCH
+__attribute__((target("avx2"), noinline))
+inline void xoshiro_block_avx2(uint64_t* state, unsigned n, double* out) {
+  xoshiro_block(state, n, out);
+}
+
+__attribute__((target("avx512f"), noinline))
+inline void xoshiro_block_avx512(uint64_t* state, unsigned n, double* out) {
+  xoshiro_block(state, n, out);
+}
+#endif
+
+// the widest of the kernels above that the CPU supports (the draws are the
+// same with every kernel)
+inline void xoshiro_batch(uint64_t* state, unsigned n, double* out) {
+#ifdef CPYP_RANDOM_DISPATCH
+  static const int kernel = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") ? 2 : __builtin_cpu_supports("avx2") ? 1 : 0;
+  }();
+  if (kernel == 2) return xoshiro_block_avx512(state, n, out);
+  if (kernel == 1) return xoshiro_block_avx2(state, n, out);
+#endif
+  xoshiro_block(state, n, out);
+}
+
+}  // namespace random_detail
+
+// kLANES xoshiro256++ streams advanced side by side. lane l is stream l of
+// a seed drawn from eng (as with Xoshiro256(seed, stream)), which costs one
+// draw, where split() would advance eng by 256 steps per lane
+template <>
+struct uniform_block_source<Xoshiro256> {
+  explicit uniform_block_source(Xoshiro256& e) : eng(e) {
+    const unsigned kLANES = random_detail::kLANES;
+    const uint64_t seed = eng();
+    for (unsigned l = 0; l < kLANES; ++l) {
+      const Xoshiro256 lane(seed, l);
+      for (unsigned w = 0; w < 4; ++w) state[w * kLANES + l] = lane.state[w];
+    }
+  }
+  void fill(double* out, unsigned n) {
+    assert(n % random_detail::kLANES == 0);
+    random_detail::xoshiro_batch(state, n, out);
+  }
+  Xoshiro256& eng;
+
+ private:
+  uint64_t state[4 * random_detail::kLANES];
+};
+
+// a block of uniform [0, 1) doubles drawn ahead of time, handed out one at
+// a time by sample_uniform01 (and so by sample_bernoulli, the CRPs and the
+// distributions below), so that a tight sampling loop calls into the engine
+// once per kSIZE draws. it only exists for engines with a batched kernel
+// (Xoshiro256): for the others, filling a buffer one draw at a time is
+// slower than drawing directly. it can be passed wherever an Engine& is expected;
+// raw draws (e.g., for std distributions) come straight from the engine.
+// draws left in the buffer when it is destroyed are lost, so it should
+// live as long as the loop that uses it
+//   uniform_buffer<Xoshiro256> buf(eng);
+//   for (...) lm.increment(w, ctx, buf);
+template <class Engine>
+class uniform_buffer {
+ public:
+  typedef typename Engine::result_type result_type;
+  static constexpr result_type min() { return Engine::min(); }
+  static constexpr result_type max() { return Engine::max(); }
+  static const unsigned kSIZE = 256;
+
+  explicit uniform_buffer(Engine& eng) : source_(eng), next_(kSIZE) {}
+
+  result_type operator()() { return source_.eng(); }
+
+  double next() {
+    if (next_ == kSIZE) {
+      source_.fill(buf_, kSIZE);
+      next_ = 0;
+    }
+    return buf_[next_++];
+  }
+
+ private:
+  uniform_block_source<Engine> source_;
+  unsigned next_;
+  double buf_[kSIZE];
+};
+
+template<typename F, class Engine>
+inline F sample_uniform01(uniform_buffer<Engine>& buf) {
+  const F u = F(buf.next());
+  // a double just below 1 may round up to 1 as a float
+  return u < F(1) ? u : std::nextafter(F(1), F(0));
+}
+
 template<typename F, typename Engine>
 inline unsigned sample_bernoulli(const F a, const F b, Engine& eng) {
   const F z = a + b;
@@ -73,6 +358,52 @@ struct multinomial_distribution {
   const F sum;
 };
 
+// Walker's alias method (in Vose's formulation): after O(n) preprocessing of
+// a vector of unnormalized probabilities, each draw takes O(1) time
+//   alias_distribution<double> alias(foo);
+//   unsigned k = alias(eng);
+template <typename F>
+struct alias_distribution {
+  alias_distribution() : sum() {}
+  explicit alias_distribution(const std::vector<F>& v) { build(v); }
+
+  void build(const std::vector<F>& v) {
+    const unsigned n = v.size();
+    sum = std::accumulate(v.begin(), v.end(), F(0));
+    prob.resize(n);
+    alias.resize(n);
+    std::vector<unsigned> small, large;
+    for (unsigned i = 0; i < n; ++i) {
+      prob[i] = v[i] * n / sum;
+      alias[i] = i;
+      if (prob[i] < F(1)) small.push_back(i); else large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+      const unsigned s = small.back(); small.pop_back();
+      const unsigned l = large.back();
+      alias[s] = l;
+      prob[l] -= F(1) - prob[s];
+      if (prob[l] < F(1)) { large.pop_back(); small.push_back(l); }
+    }
+    // what is left over is 1 up to rounding error
+    for (unsigned i : small) prob[i] = F(1);
+    for (unsigned i : large) prob[i] = F(1);
+  }
+
+  template <class Engine>
+  unsigned operator()(Engine& eng) const {
+    const double u = sample_uniform01<double>(eng) * prob.size();
+    const unsigned i = std::min(static_cast<unsigned>(u), static_cast<unsigned>(prob.size() - 1));
+    return (u - i < prob[i]) ? i : alias[i];
+  }
+
+  unsigned size() const { return prob.size(); }
+
+  std::vector<F> prob;  // probability of keeping column i rather than taking alias[i]
+  std::vector<unsigned> alias;
+  F sum;  // of the unnormalized probabilities
+};
+
 }
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef _CPYP_SEATING_LOGS_H_
+#define _CPYP_SEATING_LOGS_H_
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+namespace cpyp {
+
+// the log terms by which the log likelihood of a CRP with discount d and
+// strength s changes when a customer is seated or removed (see
+// crp::update_llh_add_customer_to_table_seating), for counts below kSIZE:
+//   customers(n) = log(s + n)              a restaurant with n customers
+//   tables(t)    = log(d) + log(s / d + t) a restaurant with t tables
+//   table(n)     = log(n - d)              a table with n customers
+// the hyperparameters only change when they are resampled, and all the CRPs
+// of a tie group share them, so get(d, s) returns a per-thread table for
+// (d, s), one of kSLOTS that are selected by a hash of (d, s) (typically one
+// per tie group that the thread visits, e.g. one per order of an n-gram LM).
+// the entries are computed on first use. the reference stays valid until
+// the thread calls get again
+class seating_logs {
+ public:
+  static const unsigned kSIZE = 64;
+  static const unsigned kSLOTS = 8;
+
+  static seating_logs& get(double d, double s) {
+    // zero initialized, without a constructor, so that access is cheap
+    static thread_local seating_logs slots[kSLOTS];
+    seating_logs& t = slots[slot(d, s)];
+    if (!t.generation || !(t.d == d && t.s == s)) t.reset(d, s);
+    return t;
+  }
+
+  double customers(unsigned n) {
+    if (n >= kSIZE) return log(s + n);
+    return lookup(0, n, [this](unsigned n) { return log(s + n); });
+  }
+
+  double tables(unsigned t) {
+    if (t >= kSIZE) return log(d) + log(s / d + t);
+    return lookup(1, t, [this](unsigned t) { return log(d) + log(s / d + t); });
+  }
+
+  double table(unsigned n) {
+    if (n >= kSIZE) return log(n - d);
+    return lookup(2, n, [this](unsigned n) { return log(n - d); });
+  }
+
+ private:
+  static unsigned slot(double d, double s) {
+    uint64_t a, b;
+    std::memcpy(&a, &d, sizeof(a));
+    std::memcpy(&b, &s, sizeof(b));
+    return ((a * 0x9e3779b97f4a7c15ULL) ^ (b * 0xc2b2ae3d27d4eb4fULL)) >> 61;
+  }
+
+  void reset(double nd, double ns) {
+    d = nd;
+    s = ns;
+    if (++generation == 0) {
+      std::memset(stamp, 0, sizeof(stamp));
+      generation = 1;
+    }
+  }
+
+  template <class F>
+  double lookup(unsigned k, unsigned n, const F& f) {
+    if (stamp[k][n] != generation) {
+      stamp[k][n] = generation;
+      value[k][n] = f(n);
+    }
+    return value[k][n];
+  }
+
+  double d, s;
+  unsigned generation;  // of (d, s); 0 before the first use
+  unsigned stamp[3][kSIZE];  // generation in which value was computed
+  double value[3][kSIZE];
+};
+
+}
+
+#endif
@@ -1,14 +1,47 @@
 #ifndef _TIED_RESAMPLER_H_
 #define _TIED_RESAMPLER_H_
 
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include "random.h"
 #include "slice_sampler.h"
+#include "crp_statistics.h"
 #include "m.h"
 
 namespace cpyp {
 
+// calls f(c, begin, end) for every chunk c = [begin, end) of chunk_size
+// consecutive indices of [0, n), on up to nthreads threads. the chunks do not
+// depend on nthreads, so a reduction that combines per-chunk results in
+// chunk order gives the same result for any number of threads
+template <class F>
+void for_each_chunk(size_t n, size_t chunk_size, unsigned nthreads, const F& f) {
+  const size_t chunks = (n + chunk_size - 1) / chunk_size;
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t c; (c = next++) < chunks; )
+      f(c, c * chunk_size, std::min(n, (c + 1) * chunk_size));
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < std::min<size_t>(nthreads, chunks); ++t)
+    workers.push_back(std::thread(work));
+  work();
+  for (auto& w : workers) w.join();
+}
+
+class memory_arena;
+
+// what the CRPs of a tie group can refer to instead of keeping their own
+// copies (see compact_crp): the hyperparameters of the group, and the arena
+// (if any) from which the CRPs allocate
+struct shared_crp_parameters {
+  shared_crp_parameters() : discount(0.5), strength(1.0), arena() {}
+  double discount, strength;
+  memory_arena* arena;
+};
+
 // tie together CRPs that are conditionally independent given their hyperparameters
 template <class CRP>
 struct tied_parameter_resampler {
@@ -18,18 +51,60 @@ struct tied_parameter_resampler {
       s_shape(ss),
       s_rate(sr),
       discount(d),
-      strength(s) {}
+      strength(s),
+      threads(1),
+      shared() {}
+
+  // the CRPs of the group refer to *params for their hyperparameters, which
+  // are then set there once rather than in every CRP
+  void share_parameters(shared_crp_parameters* params) {
+    shared = params;
+    shared->discount = discount;
+    shared->strength = strength;
+  }
 
+  // crp must not already be in the group
   void insert(CRP* crp) {
-    crps.insert(crp);
-    crp->set_discount(discount);
-    crp->set_strength(strength);
+    crps.push_back(crp);
+    if (!shared) {
+      crp->set_discount(discount);
+      crp->set_strength(strength);
+    }
     assert(!crp->has_discount_prior());
     assert(!crp->has_strength_prior());
   }
 
   void erase(CRP* crp) {
-    crps.erase(crp);
+    auto it = std::find(crps.begin(), crps.end(), crp);
+    if (it == crps.end()) return;
+    *it = crps.back();
+    crps.pop_back();
+  }
+
+  void clear() {
+    crps.clear();
+  }
+
+  // sets the hyperparameters of the group, e.g., to those of CRPs that have
+  // been loaded from an archive
+  void set_hyperparameters(double d, double s) {
+    discount = d;
+    strength = s;
+    if (shared) {
+      shared->discount = d;
+      shared->strength = s;
+      return;
+    }
+    for (CRP* crp : crps) crp->set_hyperparameters(d, s);
+  }
+
+  double get_discount() const { return discount; }
+  double get_strength() const { return strength; }
+
+  // number of threads that evaluate likelihoods and update the CRPs. the
+  // results do not depend on it (see for_each_chunk)
+  void set_threads(unsigned n) {
+    threads = n;
   }
 
   size_t size() const {
@@ -38,9 +113,13 @@ struct tied_parameter_resampler {
 
   double log_likelihood(double d, double s) const {
     if (s <= -d) return -std::numeric_limits<double>::infinity();
+    std::vector<double> chunk_llh(num_chunks());
+    for_each_chunk(crps.size(), kCHUNK, threads, [&](size_t c, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) chunk_llh[c] += crps[i]->log_likelihood(d, s);
+    });
     double llh = Md::log_beta_density(d, d_alpha, d_beta) +
                  Md::log_gamma_density(d + s, s_shape, s_rate);
-    for (auto& crp : crps) { llh += crp->log_likelihood(d, s); }
+    for (double l : chunk_llh) llh += l;
     return llh;
   }
 
@@ -48,31 +127,58 @@ struct tied_parameter_resampler {
     return log_likelihood(discount, strength);
   }
 
+  // the seating statistics of all the CRPs are merged once (see
+  // crp_statistics), so that each likelihood evaluation of the slice sampler
+  // does not have to visit every CRP
   template<typename Engine>
   void resample_hyperparameters(Engine& eng, const unsigned nloop = 5, const unsigned niterations = 10) {
     if (size() == 0) { std::cerr << "EMPTY - not resampling\n"; return; }
+    std::vector<crp_statistics> chunk_stats(num_chunks());
+    for_each_chunk(crps.size(), kCHUNK, threads, [&](size_t c, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) chunk_stats[c].add(*crps[i]);
+    });
+    crp_statistics stats;
+    for (auto& cs : chunk_stats) stats.merge(cs);
     for (unsigned iter = 0; iter < nloop; ++iter) {
-      strength = slice_sampler1d([this](double prop_s) { return this->log_likelihood(discount, prop_s); },
+      strength = slice_sampler1d([this,&stats](double prop_s) { return this->log_likelihood(stats, discount, prop_s); },
                               strength, eng, -discount + std::numeric_limits<double>::min(),
                               std::numeric_limits<double>::infinity(), 0.0, niterations, 100*niterations);
       double min_discount = std::numeric_limits<double>::min();
       if (strength < 0.0) min_discount -= strength;
-      discount = slice_sampler1d([this](double prop_d) { return this->log_likelihood(prop_d, strength); },
+      discount = slice_sampler1d([this,&stats](double prop_d) { return this->log_likelihood(stats, prop_d, strength); },
                           discount, eng, min_discount,
                           1.0, 0.0, niterations, 100*niterations);
     }
-    strength = slice_sampler1d([this](double prop_s) { return this->log_likelihood(discount, prop_s); },
+    strength = slice_sampler1d([this,&stats](double prop_s) { return this->log_likelihood(stats, discount, prop_s); },
                             strength, eng, -discount + std::numeric_limits<double>::min(),
                             std::numeric_limits<double>::infinity(), 0.0, niterations, 100*niterations);
     std::cerr << "Resampled " << crps.size() << " CRPs (d=" << discount << ",s="
-              << strength << ") = " << log_likelihood(discount, strength) << std::endl;
-    for (auto& crp : crps)
-      crp->set_hyperparameters(discount, strength);
+              << strength << ") = " << log_likelihood(stats, discount, strength) << std::endl;
+    if (shared) {
+      shared->discount = discount;
+      shared->strength = strength;
+      return;
+    }
+    for_each_chunk(crps.size(), kCHUNK, threads, [&](size_t, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) crps[i]->set_hyperparameters(discount, strength);
+    });
   }
  private:
-  std::set<CRP*> crps;
+  static const size_t kCHUNK = 4096;  // CRPs per unit of work
+  size_t num_chunks() const { return (crps.size() + kCHUNK - 1) / kCHUNK; }
+
+  double log_likelihood(const crp_statistics& stats, double d, double s) const {
+    if (s <= -d) return -std::numeric_limits<double>::infinity();
+    return Md::log_beta_density(d, d_alpha, d_beta) +
+           Md::log_gamma_density(d + s, s_shape, s_rate) +
+           stats.log_likelihood(d, s);
+  }
+
+  std::vector<CRP*> crps;
   const double d_alpha, d_beta, s_shape, s_rate;
   double discount, strength;
+  unsigned threads;
+  shared_crp_parameters* shared;  // null unless share_parameters has been called
 };
 
 // split according to some criterion
@@ -89,6 +195,10 @@ struct bintied_parameter_resampler {
     resamplers[bin].erase(crp);
   }
 
+  void set_threads(unsigned n) {
+    for (auto& r : resamplers) r.set_threads(n);
+  }
+
   template <typename Engine>
   void resample_hyperparameters(Engine& eng) {
     for (unsigned i = 0; i < resamplers.size(); ++i) {
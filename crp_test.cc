@@ -2,10 +2,19 @@
 #include <vector>
 #include <cassert>
 #include <string>
+#include <map>
+#include <algorithm>
 
 #include "cpyp/crp.h"
 #include "cpyp/mf_crp.h"
+#include "cpyp/compact_crp.h"
+#include "cpyp/crp_statistics.h"
+#include "cpyp/tied_parameter_resampler.h"
 #include "cpyp/random.h"
+#include "cpyp/binary_archive.h"
+#include "cpyp/model_file.h"
+#include "corpus/corpus.h"
+#include "hpyplm/hpyplm.h"
 
 using namespace std;
 
@@ -24,7 +33,7 @@ void test_mh1() {
   cpyp::MT19937 eng;
   const vector<double> ref = {0, 0, 0, 0.00466121, 0.0233846, 0.0647365, 0.125693, 0.183448, 0.204806, 0.177036, 0.119629, 0.0627523, 0.02507, 0.00725451, 0.0013911};
   cpyp::crp<int> crp(0.5, 1.0);
-  vector<int> hist(15, 0);
+  vector<int> hist(16, 0);  // up to 15 tables
   double c = 0;
   double ac = 0;
   double tmh = 0;
@@ -58,7 +67,8 @@ void test_mh1() {
   int j =0;
   double te = 0;
   double me = 0;
-  for (auto i : hist) {
+  for (unsigned k = 0; k < ref.size(); ++k) {
+    const int i = hist[k];
     double err = (i / c - ref[j++]);
     cerr << err << "\t" << i/c << endl;
     te += fabs(err);
@@ -78,7 +88,7 @@ void test_mh1a() {
   cpyp::MT19937 eng;
   const vector<double> ref = {0, 0, 0, 0.00466121, 0.0233846, 0.0647365, 0.125693, 0.183448, 0.204806, 0.177036, 0.119629, 0.0627523, 0.02507, 0.00725451, 0.0013911};
   cpyp::crp<int> crp(0.5, 1.0);
-  vector<int> hist(15, 0);
+  vector<int> hist(16, 0);  // up to 15 tables
   double c = 0;
   double ac = 0;
   double tmh = 0;
@@ -110,7 +120,8 @@ void test_mh1a() {
   int j =0;
   double te = 0;
   double me = 0;
-  for (auto i : hist) {
+  for (unsigned k = 0; k < ref.size(); ++k) {
+    const int i = hist[k];
     double err = (i / c - ref[j++]);
     cerr << err << "\t" << i/c << endl;
     te += fabs(err);
@@ -124,6 +135,152 @@ void test_mh1a() {
   cerr << endl;
 }
 
+// like test_mh1a, but the proposals reseat blocks of three customers, and
+// rejected proposals are undone by putting the saved tables back
+void test_mh3() {
+  cpyp::MT19937 eng;
+  const vector<double> ref = {0, 0, 0, 0.00466121, 0.0233846, 0.0647365, 0.125693, 0.183448, 0.204806, 0.177036, 0.119629, 0.0627523, 0.02507, 0.00725451, 0.0013911};
+  cpyp::crp<int> crp(0.5, 1.0);
+  for (int i = 0; i < 15; ++i) crp.increment(i % 3, p0[i % 3], eng);
+  vector<int> hist(16, 0);
+  double c = 0;
+  double ac = 0;
+  double tmh = 0;
+  for (int s = 0; s < 200000; ++s) {
+    for (int b = 0; b < 5; ++b) {
+      vector<cpyp::crp_table_manager<1>> prev;
+      for (int y = 0; y < 3; ++y) prev.push_back(crp.tables(y));
+      const double lp_old = llh(crp, p0);
+      double lq_old = 0, lq_new = 0;
+      for (int y = 2; y >= 0; --y) crp.decrement(y, eng, &lq_old);
+      for (int y = 0; y < 3; ++y) crp.increment_no_base(y, eng, &lq_new);
+      const double a = exp(llh(crp, p0) - lp_old + lq_old - lq_new);
+      ++tmh;
+      if (a >= 1.0 || cpyp::sample_uniform01<double>(eng) < a) {
+        ++ac;
+      } else {
+        for (int y = 0; y < 3; ++y) crp.set_tables(y, prev[y]);
+        assert(fabs(llh(crp, p0) - lp_old) < 1e-9);
+      }
+    }
+    if (s > 300 && s % 4 == 3) { ++c; hist[crp.num_tables()]++; }
+  }
+  cerr << "ACCEPTANCE: " << ac / tmh << endl;
+  double te = 0;
+  double me = 0;
+  for (unsigned k = 0; k < ref.size(); ++k) {
+    double err = (hist[k] / c - ref[k]);
+    te += fabs(err);
+    if (fabs(err) > me) { me = fabs(err); }
+  }
+  te /= 12;
+  cerr << "Average error: " << te;
+  if (te > 0.01) { cerr << "  ** TOO HIGH **"; }
+  cerr << endl << "    Max error: " << me;
+  if (me > 0.01) { cerr << "  ** TOO HIGH **"; }
+  cerr << endl;
+}
+
+// the seating of every order of lm, as sorted (order, context, dish,
+// customers, table sizes...) entries, and the draws from the base
+void pyplm_seating(const cpyp::PYPLM<0>& lm, vector<vector<unsigned> >* seating) {
+  seating->push_back(vector<unsigned>(1, lm.draws));
+}
+template <unsigned N>
+void pyplm_seating(const cpyp::PYPLM<N>& lm, vector<vector<unsigned> >* seating) {
+  for (auto& kv : lm.p) {
+    for (auto& dish : kv.second) {
+      vector<unsigned> e(1, N);
+      e.insert(e.end(), kv.first.begin(), kv.first.end());
+      e.push_back(dish.first);
+      e.push_back(dish.second.num_customers());
+      vector<unsigned> sizes;
+      for (auto& bin : kv.second.tables(dish.first).h[0]) sizes.insert(sizes.end(), bin.second, bin.first);
+      sort(sizes.begin(), sizes.end());
+      e.insert(e.end(), sizes.begin(), sizes.end());
+      seating->push_back(e);
+    }
+  }
+  pyplm_seating(lm.backoff, seating);
+  sort(seating->begin(), seating->end());
+}
+
+// a generator whose every draw is (almost) its maximum, so that
+// sample_uniform01 is close to 1 and every Metropolis-Hastings test that
+// can reject does
+struct high_engine {
+  typedef uint32_t result_type;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xffffffffu; }
+  result_type operator()() { return max() - 1; }
+};
+
+// PYPLM::resample_block must put back the seating (and the base draws)
+// exactly when it rejects, and a chain of block moves must have the same
+// stationary distribution as token-level Gibbs sampling: the mean number of
+// tables of every dish of every restaurant is compared
+void test_resample_block() {
+  const unsigned kSOS = 4, kEOS = 5;
+  const vector<vector<unsigned> > sentences = {{1, 1, 1, 1, 1}, {2, 2, 2}, {1, 3}};
+  vector<vector<unsigned> > padded;
+  for (auto& s : sentences) {
+    padded.push_back(vector<unsigned>(1, kSOS));
+    padded.back().insert(padded.back().end(), s.begin(), s.end());
+    padded.back().push_back(kEOS);
+  }
+  unsigned errors = 0, rejected = 0;
+  double max_error = 0;
+  map<vector<unsigned>, double> mean_tables[2];
+  for (unsigned blocked = 0; blocked < 2; ++blocked) {
+    cpyp::MT19937 eng;
+    cpyp::PYPLM<2> lm(5, 1, 1, 1, 1);
+    cpyp::sentence_block b;
+    const unsigned kSWEEPS = 100000, kBURN_IN = 100;
+    for (unsigned sweep = 0; sweep < kSWEEPS; ++sweep) {
+      for (auto& s : padded) {
+        if (blocked && sweep > 0) {
+          lm.resample_block(&s[0], s.size() - 1, &b, eng);
+          continue;
+        }
+        vector<unsigned> ctx(1, kSOS);
+        for (unsigned i = 1; i < s.size(); ++i) {
+          if (sweep > 0) lm.decrement(s[i], ctx, eng);
+          lm.increment(s[i], ctx, eng);
+          ctx.push_back(s[i]);
+        }
+      }
+      if (blocked && sweep % 1000 == 1) {
+        // rejected moves must leave no trace
+        high_engine high;
+        for (auto& s : padded) {
+          vector<vector<unsigned> > before, after;
+          pyplm_seating(lm, &before);
+          const double llh = lm.log_likelihood();
+          if (lm.resample_block(&s[0], s.size() - 1, &b, high)) continue;
+          ++rejected;
+          pyplm_seating(lm, &after);
+          // the dishes of a large restaurant may be summed in another order
+          if (after != before || fabs(lm.log_likelihood() - llh) > 1e-9) ++errors;
+        }
+      }
+      if (sweep < kBURN_IN) continue;
+      vector<vector<unsigned> > seating;
+      pyplm_seating(lm, &seating);
+      for (auto& e : seating) {
+        if (e.size() < 4) continue;
+        const vector<unsigned> dish(e.begin(), e.begin() + e[0] + 1);
+        mean_tables[blocked][dish] += double(e.size() - e[0] - 2) / (kSWEEPS - kBURN_IN);
+      }
+    }
+  }
+  for (auto& kv : mean_tables[0])
+    max_error = max(max_error, fabs(kv.second - mean_tables[1][kv.first]));
+  if (mean_tables[0].size() != mean_tables[1].size() || !rejected) ++errors;
+  cerr << "resample_block errors: " << errors << "  rejected = " << rejected
+       << "  max error of mean tables = " << max_error << endl;
+  if (errors || max_error > 0.05) cerr << "*** error is too big = " << errors << endl;
+}
+
 static const double p0_a[] = { 0.1, 0.2, 0.7 };  // actual base distribution
 static const double p0_b[] = { 0.6, 0.3, 0.1 };  // actual base of d2
 
@@ -282,6 +439,511 @@ void test_mfcrp() {
   cerr << "avg_down=" << tot_down << endl;
 }
 
+// checks the table size histogram of a dish with many different table sizes
+// (which switches to a Fenwick tree) against a reference map
+void test_histogram() {
+  cpyp::MT19937 eng;
+  cpyp::crp_histogram h;
+  map<unsigned, unsigned> ref;
+  unsigned errors = 0;
+  for (int s = 0; s < 20000; ++s) {
+    const unsigned bin = 1 + cpyp::sample_uniform01<double>(eng) * (s < 10000 ? 100 : 10);
+    if (ref.count(bin) && cpyp::sample_uniform01<double>(eng) < 0.45) {
+      if (!--ref[bin]) ref.erase(bin);
+      h.decrement(bin);
+    } else {
+      ++ref[bin];
+      h.increment(bin);
+    }
+    unsigned tables = 0, customers = 0, bins = 0;
+    for (auto& b : h) {
+      if (ref.count(b.first) == 0 || ref[b.first] != b.second) ++errors;
+      tables += b.second;
+      customers += b.first * b.second;
+      ++bins;
+    }
+    if (bins != ref.size() || tables != h.num_tables() || customers != h.num_customers()) ++errors;
+    // the customer with index r sits at a table of size select_customer(r)
+    const unsigned r = cpyp::sample_uniform01<double>(eng) * customers;
+    const double d = 0.5;
+    const double rd = cpyp::sample_uniform01<double>(eng) * (customers - d * tables);
+    unsigned c = 0, cr = 0, cd = 0;
+    double wd = 0;
+    for (auto& b : h) {
+      c += b.first * b.second;
+      wd += (b.first - d) * b.second;
+      if (!cr && c > r) cr = b.first;
+      if (!cd && wd > rd) cd = b.first;
+    }
+    if (customers && (h.select_customer(r) != cr || h.select_discounted(rd, d) != cd)) ++errors;
+  }
+  cerr << "histogram errors: " << errors << endl;
+  if (errors) cerr << "*** error is too big = " << errors << endl;
+
+  // number of singleton tables and size of the largest table of a dish with
+  // 1000 customers (which have tables of many different sizes), after
+  // seating them and then resampling 100 of them, compared with a direct
+  // simulation that keeps a list of tables
+  const double disc = 0.5, str = 1.0;
+  const unsigned n = 1000;
+  const int runs = 3000;
+  double ones = 0, largest = 0, ref_ones = 0, ref_largest = 0;
+  for (int k = 0; k < runs; ++k) {
+    cpyp::crp<int> crp(disc, str);
+    for (unsigned i = 0; i < n; ++i) crp.increment(1, 1.0, eng);
+    for (unsigned i = 0; i < 100; ++i) {
+      crp.decrement(1, eng);
+      crp.increment(1, 1.0, eng);
+    }
+    for (auto& bin : crp.begin()->second.h[0]) {
+      if (bin.first == 1) ones += bin.second;
+    }
+    unsigned big = 0;
+    for (auto& bin : crp.begin()->second.h[0]) big = max(big, bin.first);
+    largest += big;
+
+    vector<unsigned> tables;
+    unsigned customers = 0;
+    auto seat = [&]() {
+      double r = cpyp::sample_uniform01<double>(eng) * (customers + str);
+      ++customers;
+      for (auto& t : tables) {
+        r -= t - disc;
+        if (r < 0) { ++t; return; }
+      }
+      tables.push_back(1);
+    };
+    for (unsigned i = 0; i < n; ++i) seat();
+    for (unsigned i = 0; i < 100; ++i) {
+      int r = cpyp::sample_uniform01<double>(eng) * customers;
+      --customers;
+      for (unsigned j = 0; j < tables.size(); ++j) {
+        r -= tables[j];
+        if (r < 0) {
+          if (!--tables[j]) tables.erase(tables.begin() + j);
+          break;
+        }
+      }
+      seat();
+    }
+    ref_ones += count(tables.begin(), tables.end(), 1u);
+    ref_largest += *max_element(tables.begin(), tables.end());
+  }
+  const double err_ones = fabs(ones - ref_ones) / ref_ones;
+  const double err_largest = fabs(largest - ref_largest) / ref_largest;
+  cerr << "singletons: " << (ones / runs) << " (reference " << (ref_ones / runs) << ")  error = " << err_ones << endl;
+  cerr << "largest table: " << (largest / runs) << " (reference " << (ref_largest / runs) << ")  error = " << err_largest << endl;
+  if (err_ones > 0.02 || err_largest > 0.04) { cerr << "*** error is too big" << endl; }
+}
+
+// the likelihood of (d, s) from the table_sizes() of CRPs and from their
+// crp_statistics must match the sum over every table of every dish
+void test_statistics() {
+  cpyp::MT19937 eng;
+  unsigned errors = 0;
+  for (double disc : {0.0, 0.3}) {
+    vector<cpyp::crp<unsigned>> crps(20, cpyp::crp<unsigned>(disc, 1.0));
+    for (unsigned i = 0; i < crps.size(); ++i) {
+      vector<unsigned> seated;
+      for (unsigned j = 0; j < 50 * i; ++j) {
+        if (!seated.empty() && cpyp::sample_uniform01<double>(eng) < 0.3) {
+          const unsigned k = cpyp::sample_uniform01<double>(eng) * seated.size();
+          crps[i].decrement(seated[k], eng);
+          seated[k] = seated.back();
+          seated.pop_back();
+        } else {
+          seated.push_back(cpyp::sample_uniform01<double>(eng) * 10);
+          crps[i].increment(seated.back(), 0.1, eng);
+        }
+      }
+    }
+    cpyp::crp_statistics stats;
+    for (auto& crp : crps) stats.add(crp);
+    for (double d : {disc, disc / 2}) {
+      if (d == 0 && disc > 0) continue;
+      for (double s : {0.5, 1.0, 7.0}) {
+        double total = 0;
+        for (auto& crp : crps) {
+          double ref = 0;
+          if (crp.num_customers() && d > 0) {
+            ref = lgamma(s) - lgamma(s / d) - lgamma(s + crp.num_customers()) +
+                  crp.num_tables() * log(d) + lgamma(s / d + crp.num_tables());
+            for (auto& dish : crp)
+              for (auto& bin : dish.second.h[0])
+                ref += (lgamma(bin.first - d) - lgamma(1 - d)) * bin.second;
+          } else if (crp.num_customers()) {
+            ref = lgamma(s) + crp.num_tables() * log(s) - lgamma(s + crp.num_tables());
+            for (auto& dish : crp) ref += lgamma(dish.second.num_tables());
+          }
+          if (fabs(crp.log_likelihood(d, s) - ref) > 1e-6) ++errors;
+          total += ref;
+        }
+        if (fabs(stats.log_likelihood(d, s) - total) > 1e-6 * fabs(total)) ++errors;
+      }
+    }
+  }
+  cerr << "statistics errors: " << errors << endl;
+  if (errors) cerr << "*** error is too big = " << errors << endl;
+}
+
+// the hyperparameters sampled for a group of tied CRPs must not depend on
+// the number of threads that evaluate their likelihood
+void test_tied_threads() {
+  cpyp::MT19937 eng;
+  vector<cpyp::crp<unsigned>> crps(10000, cpyp::crp<unsigned>(0.5, 1.0));
+  for (auto& crp : crps) {
+    const unsigned n = cpyp::sample_uniform01<double>(eng) * 20;
+    for (unsigned j = 0; j < n; ++j) crp.increment(cpyp::sample_uniform01<double>(eng) * 5, 0.2, eng);
+  }
+  double d[2], s[2], llh[2];
+  for (unsigned t = 0; t < 2; ++t) {
+    cpyp::tied_parameter_resampler<cpyp::crp<unsigned>> tr(1, 1, 1, 1);
+    for (auto& crp : crps) tr.insert(&crp);
+    tr.set_threads(t ? 3 : 1);
+    llh[t] = tr.log_likelihood(0.3, 2.0);
+    cpyp::MT19937 teng(17);
+    tr.resample_hyperparameters(teng);
+    d[t] = crps[0].discount();
+    s[t] = crps[0].strength();
+  }
+  if (llh[0] != llh[1] || d[0] != d[1] || s[0] != s[1])
+    cerr << "*** error is too big: threads changed the tied hyperparameters" << endl;
+}
+
+// the running log likelihood (whose log terms come from seating_logs, shared
+// by CRPs with the same hyperparameters) must follow the seating arrangement
+void test_llh_tracking() {
+  cpyp::MT19937 eng;
+  vector<cpyp::crp<unsigned>> crps;
+  for (unsigned i = 0; i < 24; ++i)  // more hyperparameters than seating_logs::kSLOTS
+    crps.push_back(cpyp::crp<unsigned>(0.1 + 0.8 * (i % 12) / 12, 0.5 + i / 12));
+  vector<cpyp::crp<unsigned>> untracked = crps;
+  for (auto& crp : untracked) crp.set_llh_tracking(false);
+  double max_error = 0;
+  for (unsigned j = 0; j < 20000; ++j) {
+    const unsigned i = cpyp::sample_uniform01<double>(eng) * crps.size();
+    const unsigned dish = cpyp::sample_uniform01<double>(eng) * 4;
+    const bool remove = crps[i].num_customers(dish) && cpyp::sample_uniform01<double>(eng) < 0.4;
+    cpyp::MT19937 e1(j), e2(j);
+    if (remove) {
+      crps[i].decrement(dish, e1);
+      untracked[i].decrement(dish, e2);
+    } else {
+      crps[i].increment(dish, 0.25, e1);
+      untracked[i].increment(dish, 0.25, e2);
+    }
+    const double ref = untracked[i].log_likelihood();
+    max_error = max(max_error, fabs(crps[i].log_likelihood() - ref) / max(1.0, fabs(ref)));
+  }
+  cerr << "llh tracking error: " << max_error << endl;
+  if (max_error > 1e-9) cerr << "*** error is too big = " << max_error << endl;
+}
+
+// restaurants whose dishes come from an arena must seat customers exactly as
+// those that use operator new, and keep their arena when copied
+void test_arena() {
+  unsigned errors = 0;
+  cpyp::memory_arena arena;
+  cpyp::MT19937 eng;
+  vector<cpyp::crp<unsigned>> plain(8, cpyp::crp<unsigned>(0.5, 1.0)), pooled = plain;
+  for (auto& crp : pooled) crp.set_arena(&arena);
+  for (unsigned j = 0; j < 20000; ++j) {
+    const unsigned i = cpyp::sample_uniform01<double>(eng) * plain.size();
+    const unsigned dish = cpyp::sample_uniform01<double>(eng) * 50;
+    const bool remove = plain[i].num_customers(dish) && cpyp::sample_uniform01<double>(eng) < 0.45;
+    cpyp::MT19937 e1(j), e2(j);
+    if (remove) {
+      plain[i].decrement(dish, e1);
+      pooled[i].decrement(dish, e2);
+    } else {
+      plain[i].increment(dish, 0.02, e1);
+      pooled[i].increment(dish, 0.02, e2);
+    }
+    if (j == 10000) {  // moving the dishes in and out of the arena
+      pooled[0].set_arena(nullptr);
+      pooled[0].set_arena(&arena);
+    }
+  }
+  for (unsigned i = 0; i < plain.size(); ++i) {
+    cpyp::crp<unsigned> copy = pooled[i];
+    if (copy.arena() != &arena || copy.log_likelihood() != plain[i].log_likelihood() ||
+        pooled[i].num_tables() != plain[i].num_tables()) ++errors;
+  }
+  if (!arena.bytes_reserved()) ++errors;
+  cerr << "arena errors: " << errors << "  reserved = " << arena.bytes_reserved() << endl;
+  if (errors) cerr << "*** error is too big = " << errors << endl;
+}
+
+// a compact_crp must seat customers with the same probabilities as a crp,
+// also once its tables no longer fit inline, keep its tables consistent with
+// its likelihood, and come back unchanged from a binary archive
+void test_compact_crp() {
+  unsigned errors = 0;
+  cpyp::shared_crp_parameters params;
+  params.discount = 0.5;
+  params.strength = 1.0;
+  cpyp::MT19937 eng;
+  // tables opened by the 8 customers of one dish
+  const unsigned trials = 200000;
+  double compact_tables = 0, crp_tables = 0;
+  for (unsigned k = 0; k < trials; ++k) {
+    cpyp::compact_crp<unsigned> c(&params);
+    cpyp::crp<unsigned> r(0.5, 1.0);
+    for (unsigned i = 0; i < 8; ++i) {
+      compact_tables += c.increment(1u, 0.3, eng);
+      crp_tables += r.increment(1u, 0.3, eng);
+    }
+  }
+  // random seating of 10 dishes, moving between inline and crp storage
+  cpyp::compact_crp<unsigned> c(&params);
+  cpyp::crp<unsigned> r(0.5, 1.0);
+  double max_error = 0;
+  for (unsigned j = 0; j < 20000; ++j) {
+    const unsigned dish = cpyp::sample_uniform01<double>(eng) * 10;
+    if (c.num_customers(dish) && cpyp::sample_uniform01<double>(eng) < 0.5) {
+      c.decrement(dish, eng);
+      r.decrement(dish, eng);
+    } else {
+      c.increment(dish, 0.1, eng);
+      r.increment(dish, 0.1, eng);
+    }
+    if (c.num_customers(dish) != r.num_customers(dish) || c.num_customers() != r.num_customers()) ++errors;
+    if (j % 100 == 0) {
+      cpyp::crp<unsigned> same(0.5, 1.0);
+      for (auto& dish_loc : c) same.set_tables(dish_loc.first, c.tables(dish_loc.first));
+      if (same.num_tables() != c.num_tables()) ++errors;
+      max_error = max(max_error, fabs(same.log_likelihood() - c.log_likelihood()));
+    }
+  }
+  cpyp::compact_crp<unsigned> copy = c;
+  cpyp::binary_oarchive oa;
+  oa & copy;
+  cpyp::compact_crp<unsigned> loaded(&params);
+  cpyp::binary_iarchive ia(oa.data().data(), oa.data().data() + oa.size());
+  ia & loaded;
+  if (!ia.good() || loaded.num_tables() != c.num_tables() ||
+      fabs(loaded.log_likelihood() - c.log_likelihood()) > 1e-9)
+    ++errors;
+  // restaurants loaded from a boost archive only get their parameters (and
+  // arena) afterwards
+  cpyp::memory_arena arena;
+  cpyp::shared_crp_parameters arena_params = params;
+  arena_params.arena = &arena;
+  cpyp::compact_crp<unsigned> orphan;
+  cpyp::binary_iarchive orphan_ia(oa.data().data(), oa.data().data() + oa.size());
+  orphan_ia & orphan;
+  orphan.set_parameters(&arena_params);
+  if (!orphan_ia.good() || c.num_tables() <= 5 || orphan.num_tables() != c.num_tables() ||
+      fabs(orphan.log_likelihood() - c.log_likelihood()) > 1e-9 || !arena.bytes_reserved())
+    ++errors;
+  orphan.increment(1u, 0.1, eng);
+  if (orphan.num_customers() != c.num_customers() + 1) ++errors;
+  const double diff = fabs(compact_tables - crp_tables) / trials;
+  cerr << "compact crp errors: " << errors << "  llh error = " << max_error
+       << "  tables/8 customers = " << compact_tables / trials << " (crp: " << crp_tables / trials << ")\n";
+  if (errors || max_error > 1e-9 || diff > 0.02)
+    cerr << "*** error is too big = " << errors << endl;
+}
+
+// ids must not change when the dictionary is frozen, and words added
+// afterwards must still be found
+void test_dict() {
+  cpyp::MT19937 eng;
+  cpyp::Dict dict;
+  vector<string> words;
+  for (unsigned i = 0; i < 20000; ++i) {
+    string w(1 + i % 23, 'a' + i % 26);
+    w += to_string(cpyp::sample_uniform01<double>(eng) * 1e9);
+    if (dict.Convert(w) == dict.max() && dict.max() > words.size()) words.push_back(w);
+  }
+  unsigned errors = 0;
+  for (unsigned frozen = 0; frozen < 2; ++frozen) {
+    if (frozen) dict.freeze();
+    for (unsigned i = 0; i < words.size(); ++i) {
+      if (dict.Convert(words[i], true) != i + 1 || dict.Convert(i + 1) != words[i]) ++errors;
+      if (dict.Convert(words[i] + "x", true) != 0) ++errors;
+    }
+  }
+  const unsigned id = dict.Convert("new word");
+  if (id != words.size() + 1 || dict.Convert("new word", true) != id || dict.Convert(words[0]) != 1) ++errors;
+  const unsigned bad = 0;
+  if (dict.Convert(bad) != "<bad0>") ++errors;
+  cerr << "dict errors: " << errors << endl;
+  if (errors) cerr << "*** error is too big = " << errors << endl;
+}
+
+// a Xoshiro256 stream must be determined by its seed and stream number,
+// split() must hand out other streams, the state must survive an archive,
+// and the uniform draws (also through a uniform_buffer) must lie in [0, 1)
+// with mean 1/2
+void test_xoshiro() {
+  unsigned errors = 0;
+  cpyp::Xoshiro256 a(42), b(42), c(42, 1);
+  for (unsigned i = 0; i < 100; ++i) {
+    const uint64_t x = a();
+    if (x != b()) ++errors;
+    if (x == c()) ++errors;
+  }
+  cpyp::Xoshiro256 t0 = a.split(), t1 = a.split();
+  if (t0() == t1() || t1() == a()) ++errors;
+  cpyp::binary_oarchive oa;
+  oa & a;
+  cpyp::Xoshiro256 loaded(0);
+  cpyp::binary_iarchive ia(oa.data().data(), oa.data().data() + oa.size());
+  ia & loaded;
+  if (!ia.good() || loaded() != a()) ++errors;
+  double sum = 0;
+  const unsigned n = 1000000;
+  for (unsigned i = 0; i < n; ++i) {
+    const double u = cpyp::sample_uniform01<double>(a);
+    const float f = cpyp::sample_uniform01<float>(a);
+    if (!(u >= 0 && u < 1) || !(f >= 0 && f < 1)) ++errors;
+    sum += u;
+  }
+  // buffered draws (from lanes split off the engine) must be reproducible too
+  cpyp::Xoshiro256 e1(7), e2(7);
+  cpyp::uniform_buffer<cpyp::Xoshiro256> b1(e1), b2(e2);
+  double bsum = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    const double u = cpyp::sample_uniform01<double>(b1);
+    if (!(u >= 0 && u < 1) || u != cpyp::sample_uniform01<double>(b2)) ++errors;
+    bsum += u;
+  }
+  cerr << "xoshiro errors: " << errors << "  mean = " << sum / n << "  buffered mean = " << bsum / n << endl;
+  if (errors || fabs(sum / n - 0.5) > 0.002 || fabs(bsum / n - 0.5) > 0.002)
+    cerr << "*** error is too big = " << errors << endl;
+}
+
+// CRPs (and random streams) must come back from a binary archive unchanged,
+// including large tables (whose histograms are trees), and truncated
+// archives must be detected
+void test_archive() {
+  cpyp::MT19937 eng;
+  cpyp::crp<unsigned> crp(0.5, 1.0);
+  cpyp::mf_crp<2, unsigned> mfcrp(0.3, 2.0);
+  const double p0[2] = {0.1, 0.2}, lam[2] = {0.4, 0.6};
+  for (unsigned i = 0; i < 5000; ++i) {
+    const unsigned dish = cpyp::sample_uniform01<double>(eng) * (i % 2 ? 3 : 40);
+    crp.increment(dish, 0.025, eng);
+    mfcrp.increment(dish, p0, lam, eng);
+  }
+  cpyp::binary_oarchive oa;
+  oa & crp;
+  oa & mfcrp;
+  const size_t crps_size = oa.size();
+  oa & eng;
+  const string& data = oa.data();
+  cpyp::crp<unsigned> crp2;
+  cpyp::mf_crp<2, unsigned> mfcrp2;
+  cpyp::MT19937 eng2(0);
+  cpyp::binary_iarchive ia(data.data(), data.data() + data.size());
+  ia & crp2;
+  ia & mfcrp2;
+  ia & eng2;
+  // the likelihoods are recomputed on loading, so they differ by rounding
+  double max_error = fabs(crp.log_likelihood() - crp2.log_likelihood()) / fabs(crp.log_likelihood()) +
+                     fabs(mfcrp.log_likelihood() - mfcrp2.log_likelihood()) / fabs(mfcrp.log_likelihood());
+  for (unsigned dish = 0; dish < 40; ++dish)
+    max_error = max(max_error, fabs(crp.prob(dish, 0.025) - crp2.prob(dish, 0.025)) +
+                               fabs(mfcrp.prob(dish, p0, lam) - mfcrp2.prob(dish, p0, lam)));
+  if (crp.num_tables() != crp2.num_tables() || mfcrp.num_tables() != mfcrp2.num_tables() ||
+      eng() != eng2() || !ia.good() || ia.remaining())
+    max_error = 1;
+  cpyp::binary_iarchive truncated(data.data(), data.data() + crps_size - 1);
+  truncated & crp2;
+  truncated & mfcrp2;
+  if (truncated.good()) max_error = 1;
+  cerr << "archive round trip error: " << max_error << endl;
+  if (max_error > 1e-12) cerr << "*** error is too big = " << max_error << endl;
+}
+
+// a model file must give back the dictionary and CRPs it was written with,
+// and must be rejected once a byte of it has changed
+void test_model_file() {
+  const string filename = "crp_test.model";
+  cpyp::MT19937 eng;
+  cpyp::Dict dict;
+  cpyp::crp<unsigned> crp(0.5, 1.0);
+  for (unsigned i = 0; i < 3000; ++i)
+    crp.increment(dict.Convert(to_string(static_cast<unsigned>(cpyp::sample_uniform01<double>(eng) * 50))), 0.02, eng);
+  cpyp::model_info info;
+  info.kind = "test";
+  info.order = 1;
+  info.vocab_size = dict.max();
+  info.hyperparameters = {crp.discount(), crp.strength()};
+  double max_error = 0;
+  if (!cpyp::write_model_file(filename, info, [&](cpyp::binary_oarchive& oa) { oa & dict; oa & crp; }))
+    max_error = 1;
+  cpyp::Dict dict2;
+  cpyp::crp<unsigned> crp2;
+  {
+    cpyp::model_reader in;
+    if (!cpyp::model_reader::is_model_file(filename) || !in.open(filename, "test") ||
+        in.info().vocab_size != dict.max() || in.info().hyperparameters.size() != 2) {
+      max_error = 1;
+    } else {
+      in.archive() & dict2;
+      in.archive() & crp2;
+      if (!in.done()) max_error = 1;
+    }
+  }
+  for (unsigned id = 1; id <= dict.max(); ++id)
+    max_error = max(max_error, fabs(crp.prob(id, 0.02) - crp2.prob(dict2.Convert(dict.Convert(id)), 0.02)));
+  max_error = max(max_error, fabs(crp.log_likelihood() - crp2.log_likelihood()) / fabs(crp.log_likelihood()));
+  {
+    FILE* f = fopen(filename.c_str(), "r+b");
+    fseek(f, -3, SEEK_END);
+    fputc('x', f);
+    fclose(f);
+    cpyp::model_reader in;
+    cerr << "(expecting an error) ";
+    if (in.open(filename, "test")) max_error = 1;
+  }
+  remove(filename.c_str());
+  cerr << "model file round trip error: " << max_error << endl;
+  if (max_error > 1e-12) cerr << "*** error is too big = " << max_error << endl;
+}
+
+// a binary corpus read into an empty dictionary (as by the trainers, which
+// add <s> and </s> afterwards) must be used in place, and one read into a
+// dictionary that numbers its words otherwise must be renumbered
+void test_binary_corpus() {
+  const string filename = "crp_test.corpus";
+  cpyp::MT19937 eng;
+  cpyp::Dict dict;
+  cpyp::FlatCorpus corpus;
+  dict.Convert("unused");
+  for (unsigned i = 0; i < 500; ++i) {
+    const unsigned len = cpyp::sample_uniform01<double>(eng) * 20;
+    for (unsigned j = 0; j < len; ++j)
+      corpus.push_back(dict.Convert(to_string(static_cast<unsigned>(cpyp::sample_uniform01<double>(eng) * 300))));
+    corpus.end_sentence();
+  }
+  cpyp::WriteBinaryCorpus(filename, dict, corpus);
+  unsigned errors = 0;
+  for (unsigned in_place = 0; in_place < 2; ++in_place) {
+    cpyp::Dict d;
+    if (!in_place) d.Convert("first");
+    cpyp::FlatCorpus loaded;
+    vector<bool> vocab;
+    cpyp::ReadFromFile(filename, &d, &loaded, &vocab);
+    d.Convert("<s>");
+    d.Convert("</s>");
+    if (loaded.mapped() != (in_place == 1) || loaded.size() != corpus.size() ||
+        loaded.num_tokens() != corpus.num_tokens() || cpyp::VocabularySize(vocab) + 1 != dict.max())
+      ++errors;
+    for (size_t i = 0; !errors && i < corpus.size(); ++i) {
+      const cpyp::FlatCorpus::Sentence a = corpus[i], b = loaded[i];
+      if (a.size() != b.size()) ++errors;
+      for (size_t j = 0; !errors && j < a.size(); ++j)
+        if (dict.Convert(a[j]) != d.Convert(b[j])) ++errors;
+    }
+  }
+  remove(filename.c_str());
+  cerr << "binary corpus errors: " << errors << endl;
+  if (errors) cerr << "*** error is too big = " << errors << endl;
+}
+
 int main() {
   cpyp::MT19937 eng;
   double tot = 0;
@@ -327,8 +989,21 @@ int main() {
   }
   test_mh1();
   test_mh1a();
+  test_mh3();
+  test_resample_block();
   test_mh2();
   test_mfcrp();
+  test_histogram();
+  test_statistics();
+  test_tied_threads();
+  test_llh_tracking();
+  test_arena();
+  test_compact_crp();
+  test_dict();
+  test_xoshiro();
+  test_archive();
+  test_model_file();
+  test_binary_corpus();
   return 0;
 }
 
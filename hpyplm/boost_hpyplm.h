@@ -0,0 +1,30 @@
+#ifndef BOOST_HPYPLM_H_
+#define BOOST_HPYPLM_H_
+
+// this is an optional header if you want to load and save PYPLMs and
+// DAPYPLMs with the boost serialization framework. it gives PYPLM class
+// version 1 (the restaurants of each level are tied, see PYPLM::serialize);
+// archives of version 0 are still read
+
+#include <boost/mpl/int.hpp>
+#include <boost/serialization/version.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include "cpyp/boost_serializers.h"
+#include "hpyplm/hpyplm.h"
+#include "hpyplm/dhpyplm.h"
+
+namespace boost {
+namespace serialization {
+
+template <unsigned N>
+struct version<cpyp::PYPLM<N> > {
+  typedef mpl::int_<1> type;
+  typedef mpl::integral_c_tag tag;
+  BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+
+} // namespace serialization
+} // namespace boost
+
+#endif
@@ -1,14 +1,13 @@
 #include <iostream>
 #include <string>
-
-#include "cpyp/boost_serializers.h"
-#include <boost/serialization/vector.hpp>
-#include <boost/archive/binary_iarchive.hpp>
+#include <memory>
 
 // cpyp stuff
 #include "cpyp/random.h"
+#include "cpyp/model_file.h"
 #include "corpus/corpus.h"
 #include "hpyplm/hpyplm.h"
+#include "hpyplm/compiled_hpyplm.h"
 
 // cdec stuff
 #include "stringlib.h"
@@ -17,8 +16,6 @@
 #include "fdict.h"
 #include "sentence_metadata.h"
 
-#define kORDER 3
-
 using namespace std;
 
 namespace {
@@ -73,18 +70,27 @@ struct SimplePair {
   double second;
 };
 
+template <unsigned N>
 class FF_HPYPLM : public FeatureFunction {
  public:
+  static const int kORDER = N;
+
   FF_HPYPLM(const string& lm_file, const string& feat, const string& reffile) : fid(fd_convert_string(feat)), fid_oov(fd_convert_string(feat+"_OOV")) {
     cerr << "Reading LM from " << lm_file << " ...\n";
-    ifstream ifile(lm_file.c_str(), ios::in | ios::binary);
-    if (!ifile.good()) {
-      cerr << "Failed to open " << lm_file << " for reading\n";
-      abort();
+    if (cpyp::CompiledPYPLM::IsCompiled(lm_file)) {
+      clm.reset(new cpyp::CompiledPYPLM);
+      if (!clm->Open(lm_file)) abort();
+      assert(clm->order() == N);
+      clm->PopulateDict(&dict);
+    } else {
+      cpyp::model_reader in;
+      if (!in.open(lm_file, "PYPLM")) abort();
+      assert(in.info().order == N);
+      in.archive() & dict;
+      in.archive() & lm;
+      if (!in.done()) abort();
     }
-    boost::archive::binary_iarchive ia(ifile);
-    ia & dict;
-    ia & lm;
+    dict.freeze();
     cerr << "Initializing map contents (map size=" << dict.max() << ")\n";
     for (unsigned i = 1; i < dict.max(); ++i)
       AddToWordMap(i);
@@ -100,9 +106,15 @@ class FF_HPYPLM : public FeatureFunction {
 
     // optional online "adaptation" by training on previous references
     if (reffile.size()) {
+      if (clm) {
+        cerr << "Adapting to references (-r) requires a trained LM, not a compiled one\n";
+        abort();
+      }
       cerr << "Reference file: " << reffile << endl;
       set<unsigned> rv;
       cpyp::ReadFromFile(reffile, &dict, &ref_sents, &rv);
+    } else if (!clm) {
+      lm.freeze();  // the model will not change, so cache its probabilities
     }
   }
 
@@ -193,7 +205,7 @@ class FF_HPYPLM : public FeatureFunction {
     //cerr << dict.Convert(word) << " | ";
     //for (unsigned j = 0; j < xx.size(); ++j)
     //  cerr << dict.Convert(xx[j]) << " ";
-    return log(lm.prob(word, xx)) / log(10);
+    return log(clm ? clm->prob(word, xx) : lm.prob(word, xx)) / log(10);
   }
 
   // first = prob, second = unk
@@ -331,7 +343,8 @@ class FF_HPYPLM : public FeatureFunction {
   WordID kUNKNOWN;
   WordID kNONE;
   WordID kSTAR;
-  cpyp::PYPLM<kORDER> lm; 
+  cpyp::PYPLM<N> lm; 
+  std::unique_ptr<cpyp::CompiledPYPLM> clm;  // used instead of lm when loading a compiled model
   const int fid;
   const int fid_oov;
   vector<int> cdec2cpyp; // cdec2cpyp[TD::Convert("word")] returns the index in the cpyp model
@@ -341,10 +354,38 @@ class FF_HPYPLM : public FeatureFunction {
   unsigned last_id; // id of the last sentence that was translated
 };
 
+namespace {
+
+// reads the order of a trained or compiled model from the head of lm_file
+unsigned ReadLMOrder(const string& lm_file) {
+  if (cpyp::CompiledPYPLM::IsCompiled(lm_file)) {
+    cpyp::CompiledPYPLM clm;
+    if (!clm.Open(lm_file)) abort();
+    return clm.order();
+  }
+  cpyp::model_reader in;
+  if (!in.open(lm_file, "PYPLM")) abort();
+  return in.info().order;
+}
+
+struct FFFactory {
+  const string& filename;
+  const string& featurename;
+  const string& reffile;
+
+  template <unsigned N>
+  FeatureFunction* operator()(std::integral_constant<unsigned, N>) const {
+    return new FF_HPYPLM<N>(filename, featurename, reffile);
+  }
+};
+
+} // namespace
+
 extern "C" FeatureFunction* create_ff(const string& str) {
   string featurename, filename, reffile;
   parse_lmspec(str, featurename, filename, reffile);
-  return new FF_HPYPLM(filename, featurename, reffile);
+  FFFactory factory{filename, featurename, reffile};
+  return cpyp::DispatchOrder(ReadLMOrder(filename), factory);
 }
 
 
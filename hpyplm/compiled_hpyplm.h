@@ -0,0 +1,505 @@
+#ifndef HPYPLM_COMPILED_HPYPLM_H_
+#define HPYPLM_COMPILED_HPYPLM_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "corpus/corpus.h"
+#include "cpyp/model_file.h"
+#include "hpyplm/hpyplm.h"
+
+// A read-only, memory-mappable representation of a trained PYPLM<N>.
+//
+// hpyplm_compile writes the seating statistics of every non-empty
+// restaurant into a flat file; CompiledPYPLM maps that file and evaluates
+// p(w | context) directly from the mapping, so loading a model costs one
+// pass to check it (at memory speed, without deserialization) and several
+// processes can share one page-cached copy.
+//
+// file layout (native byte order, every section 8-byte aligned):
+//   compiled_header
+//   compiled_level[order]       level k (k = 1..order) has contexts of k-1 words
+//   word offsets + '\0'-separated words, in Dict id order (ids 1..num_words)
+//   per level:
+//     keys      num_contexts * (k-1) x uint32, sorted, most recent word first
+//     contexts  num_contexts x compiled_context
+//     dishes    num_dishes x compiled_dish, sorted by word within a context
+//     index     num_slots x uint32, open-addressing hash of the keys
+
+namespace cpyp {
+
+static const char kCOMPILED_MAGIC[8] = {'H','P','Y','P','L','M','C','\0'};
+
+static const uint32_t kCOMPILED_VERSION = 2;
+
+struct compiled_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint64_t size;      // of the whole file
+  uint64_t checksum;  // model_checksum of the bytes after the header
+  double p0;  // uniform base distribution
+  uint64_t num_words;
+  uint64_t words_offset;  // num_words+1 uint64 offsets, then the words
+};
+
+struct compiled_level {
+  double discount;
+  double strength;
+  uint64_t num_contexts;
+  uint64_t num_dishes;
+  uint64_t num_slots;  // power of 2
+  uint64_t keys_offset;
+  uint64_t contexts_offset;
+  uint64_t dishes_offset;
+  uint64_t index_offset;
+};
+
+struct compiled_context {
+  uint64_t dish_begin;  // dishes are [dish_begin, next context's dish_begin)
+  uint32_t customers;
+  uint32_t tables;
+};
+
+struct compiled_dish {
+  uint32_t word;
+  uint32_t customers;
+  uint32_t tables;
+};
+
+static const uint32_t kCOMPILED_EMPTY_SLOT = 0xffffffffu;
+
+// hash of a context of n words (the same mixing as context_map)
+inline uint64_t compiled_key_hash(const uint32_t* key, unsigned n) {
+  uint64_t h = n;
+  for (unsigned i = 0; i < n; ++i) {
+    h ^= key[i];
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// in-memory version of one level, used while compiling
+struct compiled_level_builder {
+  compiled_level_builder() : width(), discount(), strength() {}
+  unsigned width;  // words per context
+  double discount;
+  double strength;
+  std::vector<uint32_t> keys;
+  std::vector<compiled_context> contexts;
+  std::vector<compiled_dish> dishes;
+  std::vector<uint32_t> index;
+};
+
+inline void collect_compiled_levels(const PYPLM<0>& lm, double* p0, std::vector<compiled_level_builder>*) {
+  *p0 = lm.p0;
+}
+
+template <unsigned N>
+void collect_compiled_levels(const PYPLM<N>& lm, double* p0, std::vector<compiled_level_builder>* levels) {
+  collect_compiled_levels(lm.backoff, p0, levels);
+  levels->push_back(compiled_level_builder());
+  compiled_level_builder& level = levels->back();
+  level.width = N - 1;
+
+  // sort the non-empty restaurants by context
+  std::vector<const typename context_map<N-1, pyplm_crp>::value_type*> rs;
+  for (auto& kv : lm.p)
+    if (kv.second.num_customers()) rs.push_back(&kv);
+  std::sort(rs.begin(), rs.end(), [](const typename context_map<N-1, pyplm_crp>::value_type* a,
+                                     const typename context_map<N-1, pyplm_crp>::value_type* b) {
+    return a->first < b->first;
+  });
+
+  bool first = true;
+  for (auto kv : rs) {
+    const pyplm_crp& r = kv->second;
+    if (first) {
+      level.discount = r.discount();
+      level.strength = r.strength();
+      first = false;
+    } else if (r.discount() != level.discount || r.strength() != level.strength) {
+      std::cerr << "PYPLM<" << N << ">: restaurants do not share hyperparameters, using d="
+                << level.discount << ",s=" << level.strength << std::endl;
+    }
+    level.keys.insert(level.keys.end(), kv->first.begin(), kv->first.end());
+    compiled_context c;
+    c.dish_begin = level.dishes.size();
+    c.customers = r.num_customers();
+    c.tables = r.num_tables();
+    level.contexts.push_back(c);
+    for (auto& dish : r) {
+      compiled_dish d;
+      d.word = dish.first;
+      d.customers = dish.second.num_customers();
+      d.tables = dish.second.num_tables();
+      level.dishes.push_back(d);
+    }
+    std::sort(level.dishes.begin() + c.dish_begin, level.dishes.end(),
+              [](const compiled_dish& a, const compiled_dish& b) { return a.word < b.word; });
+  }
+
+  // load factor <= 0.5
+  size_t num_slots = 2;
+  while (num_slots < 2 * level.contexts.size()) num_slots *= 2;
+  level.index.assign(num_slots, kCOMPILED_EMPTY_SLOT);
+  for (size_t i = 0; i < level.contexts.size(); ++i) {
+    size_t j = compiled_key_hash(level.keys.data() + i * level.width, level.width) & (num_slots - 1);
+    while (level.index[j] != kCOMPILED_EMPTY_SLOT) j = (j + 1) & (num_slots - 1);
+    level.index[j] = i;
+  }
+}
+
+// fills in the size and checksum of the header of the compiled file
+// written to filename, and syncs it to disk
+inline bool FinishCompiledFile(const std::string& filename, compiled_header* h) {
+  const int fd = open(filename.c_str(), O_RDWR);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(compiled_header)) {
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  h->size = st.st_size;
+  void* m = mmap(nullptr, h->size, PROT_READ, MAP_SHARED, fd, 0);
+  bool ok = m != MAP_FAILED;
+  if (ok) {
+    const char* data = static_cast<const char*>(m);
+    h->checksum = model_checksum(data + sizeof(compiled_header), h->size - sizeof(compiled_header));
+    munmap(m, h->size);
+  }
+  ok = ok && pwrite(fd, h, sizeof(*h), 0) == static_cast<ssize_t>(sizeof(*h));
+  ok = fsync(fd) == 0 && ok;
+  return close(fd) == 0 && ok;
+}
+
+// writes lm (with its vocabulary dict) in the compiled format. the file is
+// written next to filename and renamed once it is complete, so that an
+// interrupted compilation does not leave a truncated model behind. returns
+// false after reporting an error
+template <unsigned N>
+bool WriteCompiledPYPLM(const PYPLM<N>& lm, const Dict& dict, const std::string& filename) {
+  std::vector<compiled_level_builder> levels;
+  compiled_header h;
+  std::memcpy(h.magic, kCOMPILED_MAGIC, sizeof(h.magic));
+  h.version = kCOMPILED_VERSION;
+  h.order = N;
+  h.size = h.checksum = 0;  // see FinishCompiledFile
+  collect_compiled_levels(lm, &h.p0, &levels);
+  h.num_words = dict.max();
+
+  const std::string tmp = filename + ".tmp";
+  std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary);
+  uint64_t pos = 0;
+  auto align = [&]() {
+    static const char zeros[8] = {0};
+    if (pos % 8) { out.write(zeros, 8 - pos % 8); pos += 8 - pos % 8; }
+  };
+  auto write = [&](const void* data, size_t bytes) {
+    out.write(static_cast<const char*>(data), bytes);
+    pos += bytes;
+  };
+
+  std::vector<compiled_level> lh(N);
+  std::vector<uint64_t> word_offsets(1, 0);
+  for (unsigned i = 1; i <= dict.max(); ++i)
+    word_offsets.push_back(word_offsets.back() + dict.word_length(i) + 1);
+  h.words_offset = sizeof(compiled_header) + N * sizeof(compiled_level);
+  uint64_t off = h.words_offset + word_offsets.size() * sizeof(uint64_t) + word_offsets.back();
+  for (unsigned k = 0; k < N; ++k) {
+    const compiled_level_builder& b = levels[k];
+    compiled_level& l = lh[k];
+    l.discount = b.discount;
+    l.strength = b.strength;
+    l.num_contexts = b.contexts.size();
+    l.num_dishes = b.dishes.size();
+    l.num_slots = b.index.size();
+    off = (off + 7) / 8 * 8;
+    l.keys_offset = off;
+    off += b.keys.size() * sizeof(uint32_t);
+    off = (off + 7) / 8 * 8;
+    l.contexts_offset = off;
+    off += b.contexts.size() * sizeof(compiled_context);
+    off = (off + 7) / 8 * 8;
+    l.dishes_offset = off;
+    off += b.dishes.size() * sizeof(compiled_dish);
+    off = (off + 7) / 8 * 8;
+    l.index_offset = off;
+    off += b.index.size() * sizeof(uint32_t);
+  }
+
+  write(&h, sizeof(h));
+  write(&lh[0], N * sizeof(compiled_level));
+  write(&word_offsets[0], word_offsets.size() * sizeof(uint64_t));
+  for (unsigned i = 1; i <= dict.max(); ++i)
+    write(dict.word(i), dict.word_length(i) + 1);
+  for (unsigned k = 0; k < N; ++k) {
+    const compiled_level_builder& b = levels[k];
+    align(); assert(pos == lh[k].keys_offset);
+    if (b.keys.size()) write(&b.keys[0], b.keys.size() * sizeof(uint32_t));
+    align(); assert(pos == lh[k].contexts_offset);
+    if (b.contexts.size()) write(&b.contexts[0], b.contexts.size() * sizeof(compiled_context));
+    align(); assert(pos == lh[k].dishes_offset);
+    if (b.dishes.size()) write(&b.dishes[0], b.dishes.size() * sizeof(compiled_dish));
+    align(); assert(pos == lh[k].index_offset);
+    write(&b.index[0], b.index.size() * sizeof(uint32_t));
+  }
+  out.close();
+  if (!out || !FinishCompiledFile(tmp, &h) || rename(tmp.c_str(), filename.c_str())) {
+    std::cerr << "Failed to write " << filename << ": " << strerror(errno) << std::endl;
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// read-only N-gram LM evaluated directly from a memory-mapped compiled file
+//   CompiledPYPLM lm;
+//   if (!lm.Open("lm.clm")) ...
+class CompiledPYPLM {
+ public:
+  CompiledPYPLM() : data_(), size_() {}
+  ~CompiledPYPLM() {
+    if (data_) munmap(const_cast<char*>(data_), size_);
+  }
+
+  // maps filename and checks that it is a complete compiled model whose
+  // sections all lie within the file, so that evaluating it cannot read
+  // out of bounds. returns false after reporting why not
+  bool Open(const std::string& filename) {
+    assert(!data_);
+    const int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) close(fd);
+      std::cerr << "Failed to open " << filename << " for reading\n";
+      return false;
+    }
+    void* m = st.st_size ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (m == MAP_FAILED) {
+      std::cerr << "Failed to map " << filename << std::endl;
+      return false;
+    }
+    data_ = static_cast<const char*>(m);
+    size_ = st.st_size;
+    header_ = reinterpret_cast<const compiled_header*>(data_);
+    if (size_ < sizeof(compiled_header) ||
+        std::memcmp(header_->magic, kCOMPILED_MAGIC, sizeof(kCOMPILED_MAGIC)) ||
+        header_->version != kCOMPILED_VERSION) {
+      std::cerr << filename << " is not a compiled HPYPLM (or was written by an incompatible version of hpyplm_compile)\n";
+      return false;
+    }
+    if (header_->size != size_ ||
+        model_checksum(data_ + sizeof(compiled_header), size_ - sizeof(compiled_header)) != header_->checksum) {
+      std::cerr << filename << " is truncated or corrupt\n";
+      return false;
+    }
+    if (!CheckSections()) {
+      std::cerr << filename << " is not a valid compiled HPYPLM\n";
+      return false;
+    }
+    return true;
+  }
+  CompiledPYPLM(const CompiledPYPLM&) = delete;
+  CompiledPYPLM& operator=(const CompiledPYPLM&) = delete;
+
+  // true if filename starts with the compiled model magic number
+  static bool IsCompiled(const std::string& filename) {
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    char magic[sizeof(kCOMPILED_MAGIC)];
+    return in.read(magic, sizeof(magic)) && !std::memcmp(magic, kCOMPILED_MAGIC, sizeof(magic));
+  }
+
+  unsigned order() const { return header_->order; }
+  unsigned num_words() const { return header_->num_words; }
+
+  // word with id (1 <= id <= num_words())
+  const char* word(unsigned id) const {
+    return words_ + word_offsets_[id - 1];
+  }
+
+  // adds the model's vocabulary to an empty dict so that ids agree
+  void PopulateDict(Dict* dict) const {
+    for (unsigned i = 1; i <= num_words(); ++i) {
+      const char* w = word(i);
+      const unsigned id = dict->ConvertRange(w, w + std::strlen(w));
+      if (id != i) {
+        std::cerr << "Dict is not consistent with the compiled LM: " << word(i) << std::endl;
+        abort();
+      }
+    }
+  }
+
+  // same semantics as PYPLM<N>::prob
+  double prob(unsigned w, const std::vector<unsigned>& context) const {
+    double p = header_->p0;
+    uint32_t key[kMAX_KEY];
+    for (unsigned k = 0; k < header_->order; ++k) {
+      const compiled_level& l = levels_[k];
+      assert(k <= kMAX_KEY);
+      for (unsigned i = 0; i < k; ++i)
+        key[i] = context[context.size() - 1 - i];
+      const compiled_context* c = find_context(l, key, k);
+      if (c) p = level_prob(l, c, w, p);
+    }
+    return p;
+  }
+
+  // same semantics as PYPLM<N>::prob_span
+  void prob_span(const unsigned* words, unsigned n, double* probs) const {
+    static const unsigned kPREFETCH_DISTANCE = 4;
+    const unsigned order = header_->order;
+    std::fill(probs, probs + n, header_->p0);
+    uint32_t key[kMAX_KEY], ahead[kMAX_KEY];
+    for (unsigned k = 0; k < order; ++k) {
+      const compiled_level& l = levels_[k];
+      assert(k <= kMAX_KEY);
+      const unsigned* ctx = words + order - 1 - k;  // the k words before words[order-1]
+      for (unsigned i = 0; i < n; ++i) {
+        if (i + kPREFETCH_DISTANCE < n) {
+          for (unsigned j = 0; j < k; ++j)
+            ahead[j] = ctx[i + kPREFETCH_DISTANCE + k - 1 - j];
+          prefetch_context(l, ahead, k);
+        }
+        for (unsigned j = 0; j < k; ++j)
+          key[j] = ctx[i + k - 1 - j];
+        const compiled_context* c = find_context(l, key, k);
+        if (c) probs[i] = level_prob(l, c, ctx[i + k], probs[i]);
+      }
+    }
+  }
+
+ private:
+  static const unsigned kMAX_KEY = 32;
+
+  // whether count elements of type T starting at offset are within the
+  // file and aligned
+  template <typename T>
+  bool InRange(uint64_t offset, uint64_t count) const {
+    return offset <= size_ && offset % alignof(T) == 0 && count <= (size_ - offset) / sizeof(T);
+  }
+
+  // checks the layout of every section against the mapping, and sets up
+  // levels_, word_offsets_ and words_
+  bool CheckSections() {
+    const compiled_header& h = *header_;
+    if (h.order == 0 || h.order > kMAX_ORDER ||
+        !InRange<compiled_level>(sizeof(compiled_header), h.order))
+      return false;
+    levels_ = section<compiled_level>(sizeof(compiled_header));
+
+    // the words, each terminated by '\0'
+    if (h.num_words >= size_ || !InRange<uint64_t>(h.words_offset, h.num_words + 1))
+      return false;
+    word_offsets_ = section<uint64_t>(h.words_offset);
+    const uint64_t words_begin = h.words_offset + (h.num_words + 1) * sizeof(uint64_t);
+    words_ = data_ + words_begin;
+    if (word_offsets_[0] != 0) return false;
+    for (uint64_t i = 1; i <= h.num_words; ++i) {
+      const uint64_t end = word_offsets_[i];
+      if (end <= word_offsets_[i - 1] || end > size_ - words_begin || words_[end - 1] != '\0')
+        return false;
+    }
+
+    for (unsigned k = 0; k < h.order; ++k) {
+      const compiled_level& l = levels_[k];
+      // the index holds context numbers below kCOMPILED_EMPTY_SLOT and must
+      // have an empty slot for lookups to terminate
+      if (l.num_slots == 0 || (l.num_slots & (l.num_slots - 1)) || l.num_contexts >= l.num_slots ||
+          !InRange<compiled_context>(l.contexts_offset, l.num_contexts) ||
+          !InRange<uint32_t>(l.keys_offset, l.num_contexts * k) ||
+          !InRange<compiled_dish>(l.dishes_offset, l.num_dishes) ||
+          !InRange<uint32_t>(l.index_offset, l.num_slots) ||
+          l.num_contexts >= kCOMPILED_EMPTY_SLOT)
+        return false;
+      const compiled_context* contexts = section<compiled_context>(l.contexts_offset);
+      uint64_t dish_begin = 0;
+      for (uint64_t i = 0; i < l.num_contexts; ++i) {
+        if (contexts[i].dish_begin < dish_begin || contexts[i].dish_begin > l.num_dishes)
+          return false;
+        dish_begin = contexts[i].dish_begin;
+      }
+      const uint32_t* index = section<uint32_t>(l.index_offset);
+      bool empty_slot = false;
+      for (uint64_t i = 0; i < l.num_slots; ++i) {
+        if (index[i] == kCOMPILED_EMPTY_SLOT)
+          empty_slot = true;
+        else if (index[i] >= l.num_contexts)
+          return false;
+      }
+      if (!empty_slot) return false;
+    }
+    return true;
+  }
+
+  template <typename T>
+  const T* section(uint64_t offset) const {
+    return reinterpret_cast<const T*>(data_ + offset);
+  }
+
+  const compiled_context* find_context(const compiled_level& l, const uint32_t* key, unsigned width) const {
+    const uint32_t* index = section<uint32_t>(l.index_offset);
+    const uint32_t* keys = section<uint32_t>(l.keys_offset);
+    const uint64_t mask = l.num_slots - 1;
+    for (uint64_t i = compiled_key_hash(key, width) & mask; ; i = (i + 1) & mask) {
+      const uint32_t ci = index[i];
+      if (ci == kCOMPILED_EMPTY_SLOT) return nullptr;
+      if (std::equal(key, key + width, keys + static_cast<uint64_t>(ci) * width))
+        return section<compiled_context>(l.contexts_offset) + ci;
+    }
+  }
+
+  void prefetch_context(const compiled_level& l, const uint32_t* key, unsigned width) const {
+    const uint32_t* index = section<uint32_t>(l.index_offset);
+    __builtin_prefetch(index + (compiled_key_hash(key, width) & (l.num_slots - 1)));
+  }
+
+  // p(w | context c) at level l given the lower-order estimate p
+  double level_prob(const compiled_level& l, const compiled_context* c, unsigned w, double p) const {
+    const compiled_dish* d = find_dish(l, c, w);
+    const double r = c->tables * l.discount + l.strength;
+    if (d)
+      return (d->customers - l.discount * d->tables + r * p) / (c->customers + l.strength);
+    return r * p / (c->customers + l.strength);
+  }
+
+  const compiled_dish* find_dish(const compiled_level& l, const compiled_context* c, unsigned w) const {
+    const compiled_dish* dishes = section<compiled_dish>(l.dishes_offset);
+    const compiled_context* contexts = section<compiled_context>(l.contexts_offset);
+    const uint64_t ci = c - contexts;
+    const compiled_dish* begin = dishes + c->dish_begin;
+    const compiled_dish* end = dishes + (ci + 1 < l.num_contexts ? contexts[ci + 1].dish_begin : l.num_dishes);
+    const compiled_dish* it = std::lower_bound(begin, end, w,
+        [](const compiled_dish& d, unsigned x) { return d.word < x; });
+    return (it != end && it->word == w) ? it : nullptr;
+  }
+
+  const char* data_;
+  size_t size_;
+  const compiled_header* header_;
+  const compiled_level* levels_;
+  const uint64_t* word_offsets_;
+  const char* words_;
+};
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef HPYPLM_CONTEXT_MAP_H_
+#define HPYPLM_CONTEXT_MAP_H_
+
+#include <array>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <cassert>
+#include <cstdint>
+
+namespace cpyp {
+
+// map from fixed-width n-gram contexts (K words) to values (usually CRPs)
+//
+// the index is a flat open-addressing (linear probing) table of 8-byte slots
+// holding a hash tag and the position of the entry, so a probe sequence
+// almost always stays in a single cache line. the (key, value) pairs
+// themselves live contiguously in a deque, which means that pointers to
+// values (e.g., the ones handed to a tied_parameter_resampler) remain valid
+// when the index is rehashed. entries are never erased.
+template <unsigned K, typename V>
+class context_map {
+ public:
+  typedef std::array<unsigned, K> key_type;
+  typedef std::pair<key_type, V> value_type;
+  typedef typename std::deque<value_type>::iterator iterator;
+  typedef typename std::deque<value_type>::const_iterator const_iterator;
+
+  context_map() : mask_(), slots_() {}
+
+  static inline uint64_t hash(const key_type& key) {
+    uint64_t h = K;
+    for (unsigned i = 0; i < K; ++i) {
+      h ^= key[i];
+      h *= 0x9e3779b97f4a7c15ULL;
+      h ^= h >> 29;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  V* find(const key_type& key) {
+    const unsigned i = find_index(key);
+    return (i == kEMPTY ? nullptr : &values_[i].second);
+  }
+
+  const V* find(const key_type& key) const {
+    const unsigned i = find_index(key);
+    return (i == kEMPTY ? nullptr : &values_[i].second);
+  }
+
+  // starts loading the index slot where the lookup of key will begin, so
+  // that a later find(key) does not stall on it
+  void prefetch(const key_type& key) const {
+    if (!slots_.empty()) __builtin_prefetch(&slots_[hash(key) & mask_]);
+  }
+
+  // key must not already be present
+  V* insert(const key_type& key, const V& value) {
+    assert(find(key) == nullptr);
+    if ((values_.size() + 1) * 10 > slots_.size() * 7)
+      rehash(slots_.empty() ? 16 : slots_.size() * 2);
+    const uint64_t h = hash(key);
+    insert_slot(h, values_.size());
+    values_.push_back(value_type(key, value));
+    return &values_.back().second;
+  }
+
+  void reserve(size_t n) {
+    size_t cap = 16;
+    while (n * 10 > cap * 7) cap *= 2;
+    if (cap > slots_.size()) rehash(cap);
+  }
+
+  void clear() {
+    values_.clear();
+    slots_.clear();
+    mask_ = 0;
+  }
+
+  size_t size() const { return values_.size(); }
+  bool empty() const { return values_.empty(); }
+
+  iterator begin() { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator begin() const { return values_.begin(); }
+  const_iterator end() const { return values_.end(); }
+
+  template<class Archive> void serialize(Archive& ar, const unsigned int version) {
+    uint64_t sz = values_.size();
+    ar & sz;
+    if (Archive::is_loading::value) {
+      clear();
+      reserve(sz);
+      key_type key;
+      for (uint64_t i = 0; i < sz; ++i) {
+        for (unsigned j = 0; j < K; ++j) ar & key[j];
+        ar & *insert(key, V());
+      }
+    } else {
+      for (auto& kv : values_) {
+        for (unsigned j = 0; j < K; ++j) ar & kv.first[j];
+        ar & kv.second;
+      }
+    }
+  }
+
+ private:
+  static const unsigned kEMPTY = 0xffffffffu;
+
+  struct slot {
+    uint32_t tag;
+    uint32_t index;  // kEMPTY if unused
+  };
+
+  unsigned find_index(const key_type& key) const {
+    if (slots_.empty()) return kEMPTY;
+    const uint64_t h = hash(key);
+    const uint32_t tag = h >> 32;
+    for (size_t i = h & mask_; ; i = (i + 1) & mask_) {
+      const slot& s = slots_[i];
+      if (s.index == kEMPTY) return kEMPTY;
+      if (s.tag == tag && values_[s.index].first == key) return s.index;
+    }
+  }
+
+  void insert_slot(uint64_t h, size_t index) {
+    size_t i = h & mask_;
+    while (slots_[i].index != kEMPTY) i = (i + 1) & mask_;
+    slots_[i].tag = h >> 32;
+    slots_[i].index = index;
+  }
+
+  void rehash(size_t cap) {
+    assert((cap & (cap - 1)) == 0);
+    slots_.assign(cap, slot{0, kEMPTY});
+    mask_ = cap - 1;
+    for (size_t i = 0; i < values_.size(); ++i)
+      insert_slot(hash(values_[i].first), i);
+  }
+
+  size_t mask_;
+  std::vector<slot> slots_;
+  std::deque<value_type> values_;
+};
+
+}
+
+#endif
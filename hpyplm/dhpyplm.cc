@@ -50,7 +50,8 @@ int main(int argc, char** argv) {
   vector<vector<unsigned>> corpus = corpora[0];
   cerr << "E-corpus size: " << corpus.size() << " sentences\t (" << vocab.size() << " word types)\n";
   PYPLM<kORDER> latent_lm(vocab.size(), 1, 1, 1, 1);
-  vector<DAPYPLM<kORDER>> dlm(corpora.size(), DAPYPLM<kORDER>(latent_lm)); // domain LMs
+  vector<DAPYPLM<kORDER>> dlm;  // domain LMs
+  for (unsigned i = 0; i < corpora.size(); ++i) dlm.emplace_back(latent_lm);
   vector<unsigned> ctx(kORDER - 1, kSOS);
   for (int sample=0; sample < samples; ++sample) {
     int ci = 0;
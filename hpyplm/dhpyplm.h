@@ -1,6 +1,7 @@
 #ifndef _DHPYPLM_H_
 #define _DHPYPLM_H_
 
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -30,7 +31,8 @@ template<> struct DAPYPLM<0> : PYPLM<0> {
 };
 
 template <unsigned N> struct DAPYPLM {
-  DAPYPLM(PYPLM<N>& rllm) : path(1,1,1,1,0.1,1.0), tr(1,1,1,1), in_domain_backoff(rllm.backoff), llm(rllm), lookup(N-1) {}
+  DAPYPLM(PYPLM<N>& rllm) : path(1,1,1,1,0.1,1.0), tr(1,1,1,1), in_domain_backoff(rllm.backoff), llm(rllm), lookup(N-1),
+      arena(new memory_arena) {}
   template<typename Engine>
   void increment(unsigned w, const std::vector<unsigned>& context, Engine& eng) {
     const double p0[2]{in_domain_backoff.prob(w, context), llm.prob(w, context)};
@@ -40,7 +42,7 @@ template <unsigned N> struct DAPYPLM {
       lookup[i] = context[context.size() - 1 - i];
     auto it = p.find(lookup);
     if (it == p.end()) {
-      it = p.insert(std::make_pair(lookup, mf_crp<2, unsigned>(0.8,1))).first;
+      it = p.insert(std::make_pair(lookup, new_crp())).first;
       tr.insert(&it->second);  // add to resampler
     }
     const std::pair<unsigned, int> floor_count = it->second.increment(w, p0, lam, eng);
@@ -104,7 +106,68 @@ template <unsigned N> struct DAPYPLM {
   template<class Archive> void serialize(Archive& ar, const unsigned int version) {
     ar & path;
     in_domain_backoff.serialize(ar, version);
+    serialize(ar, is_bulk_archive<Archive>());
+  }
+
+  // boost archives store the restaurants one by one
+  template<class Archive> void serialize(Archive& ar, std::false_type) {
     ar & p;
+    if (Archive::is_loading::value) {
+      tr.clear();
+      if (!p.empty()) tr.set_hyperparameters(p.begin()->second.discount(), p.begin()->second.strength());
+      for (auto& kv : p) tr.insert(&kv.second);
+    }
+  }
+
+  // bulk archives store the tied hyperparameters once, all contexts as one
+  // array, and the seating arrangements as dish_columns (see PYPLM)
+  void serialize(binary_oarchive& ar, std::true_type) {
+    std::vector<unsigned> keys;
+    keys.reserve(p.size() * (N-1));
+    dish_columns<unsigned> cols;
+    cols.num_dishes.reserve(p.size());
+    for (auto& kv : p) {
+      keys.insert(keys.end(), kv.first.begin(), kv.first.end());
+      kv.second.save_seating(&cols);
+    }
+    ar & tr.get_discount();
+    ar & tr.get_strength();
+    ar & keys;
+    ar & cols;
+  }
+  void serialize(binary_iarchive& ar, std::true_type) {
+    double d = 0, s = 0;
+    std::vector<unsigned> keys;
+    dish_columns<unsigned> cols;
+    ar & d;
+    ar & s;
+    ar & keys;
+    ar & cols;
+    p.clear();
+    tr.clear();
+    const size_t n = cols.num_dishes.size();
+    if (!ar.good() || keys.size() != n * (N-1) || !(d >= 0.0 && d < 1.0 && s > -d)) {
+      ar.fail();
+      return;
+    }
+    tr.set_hyperparameters(d, s);
+    p.reserve(n);
+    std::vector<unsigned> key(N-1);
+    for (size_t i = 0; i < n; ++i) {
+      std::copy(keys.data() + i * (N-1), keys.data() + (i + 1) * (N-1), key.begin());
+      auto it = p.insert(std::make_pair(key, new_crp()));
+      if (!it.second) break;
+      tr.insert(&it.first->second);
+      if (!it.first->second.load_seating(&cols)) break;
+    }
+    if (!cols.done()) ar.fail();
+  }
+
+  // an empty restaurant whose dishes are allocated from arena
+  mf_crp<2, unsigned> new_crp() const {
+    mf_crp<2, unsigned> r(0.8, 1);
+    r.set_arena(arena.get());
+    return r;
   }
 
   crp<unsigned> path;
@@ -112,6 +175,7 @@ template <unsigned N> struct DAPYPLM {
   DAPYPLM<N-1> in_domain_backoff;
   PYPLM<N>& llm;
   mutable std::vector<unsigned> lookup;  // thread-local
+  std::unique_ptr<memory_arena> arena;  // the dishes of p, which it outlives
   std::unordered_map<std::vector<unsigned>, mf_crp<2, unsigned>, uvector_hash> p;  // .first = context .second = 2-floor CRP
 };
 
@@ -4,10 +4,7 @@
 
 #include "dhpyplm.h"
 #include "corpus/corpus.h"
-
-#include "cpyp/boost_serializers.h"
-#include <boost/serialization/vector.hpp>
-#include <boost/archive/binary_iarchive.hpp>
+#include "cpyp/model_file.h"
 
 #define kORDER 3
 
@@ -27,20 +24,24 @@ int main(int argc, char** argv) {
   //vector<unsigned> ctx(kORDER - 1, kSOS);
 
   cerr << "Reading LM from " << lm_file << " ...\n";
-  ifstream ifile(lm_file.c_str(), ios::in | ios::binary);
-  if (!ifile.good()) {
-    cerr << "Failed to open " << lm_file << " for reading\n";
+  model_reader in;
+  if (!in.open(lm_file, "DAPYPLM")) return 1;
+  if (in.info().order != kORDER) {
+    cerr << lm_file << " holds a " << in.info().order << "-gram LM, not a " << kORDER << "-gram LM\n";
     return 1;
   }
-  boost::archive::binary_iarchive ia(ifile);
+  binary_iarchive& ia = in.archive();
   Dict dict;
   ia & dict;
+  dict.freeze();
   ia & latent_lm;
   unsigned num_domains = 0;
   ia & num_domains;
-  vector<DAPYPLM<kORDER>> dlm(num_domains, DAPYPLM<kORDER>(latent_lm));
+  vector<DAPYPLM<kORDER>> dlm;
+  for (unsigned i = 0; i < num_domains; ++i) dlm.emplace_back(latent_lm);
   for (unsigned i = 0; i < num_domains; ++i)
     ia & dlm[i];
+  if (!in.done()) return 1;
   const unsigned max_iv = dict.max();
   const unsigned kSOS = dict.Convert("<s>");
   const unsigned kEOS = dict.Convert("</s>");
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <unordered_map>
 #include <cstdlib>
+#include <cstring>
 
 #include "corpus/corpus.h"
 #include "cpyp/m.h"
@@ -8,12 +9,11 @@
 #include "cpyp/crp.h"
 #include "cpyp/mf_crp.h"
 #include "cpyp/tied_parameter_resampler.h"
+#include "cpyp/checkpoint.h"
 #include "uvector.h"
 #include "dhpyplm.h"
 
-#include "cpyp/boost_serializers.h"
-#include <boost/serialization/vector.hpp>
-#include <boost/archive/binary_oarchive.hpp>
+#include "cpyp/model_file.h"
 
 // A not very memory-efficient implementation of a domain adapting
 // HPYP language model, as described by Wood & Teh (AISTATS, 2009)
@@ -27,11 +27,40 @@ using namespace cpyp;
 
 Dict dict;
 
+// the state of the sampler after sample samples, following the shape of the
+// training data and its ids, which must not change when sampling is resumed
+template <class Archive>
+bool sampler_state(Archive& ar, const vector<FlatCorpus>& corpora, unsigned vocab_size, unsigned sos,
+                   int& sample, PYPLM<kORDER>& latent_lm, vector<DAPYPLM<kORDER>>& dlm, MT19937& eng) {
+  if (!checkpoint::same_value(ar, corpora.size()) || !checkpoint::same_value(ar, vocab_size) ||
+      !checkpoint::same_value(ar, sos))
+    return false;
+  for (auto& corpus : corpora)
+    if (!checkpoint::same_value(ar, corpus.size()) || !checkpoint::same_value(ar, corpus.num_tokens())) return false;
+  ar & sample;
+  ar & eng;
+  ar & latent_lm;
+  for (auto& lm : dlm) ar & lm;
+  return true;
+}
+
 int main(int argc, char** argv) {
-  if (argc < 4) {
-    cerr << argv[0] << " <training1.txt> <training2.txt> [...] <output.dlm> <nsamples>\n\nInfer a " << kORDER << "-gram HPYP LM and write the trained model\n100 is usually sufficient for <nsamples>\n";
+  const char* prog = argv[0];
+  checkpoint_options ckpt_opts;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+    if (const int n = ckpt_opts.parse(argc, argv)) {
+      argv += n; argc -= n;
+    } else {
+      cerr << "Unknown option: " << argv[1] << endl;
+      argc = 0;
+    }
+  }
+  if (argc < 4 || !ckpt_opts.valid()) {
+    cerr << prog << " [-c checkpoint [-i interval] [-r]] <training1.txt> <training2.txt> [...] <output.dlm> <nsamples>\n\nInfer a " << kORDER << "-gram HPYP LM and write the trained model\n100 is usually sufficient for <nsamples>\n"
+         << checkpoint_options::usage();
     return 1;
   }
+  if (!ckpt_opts.check_fresh()) return 1;
   MT19937 eng;
   vector<string> train_files;
   for (int i = 1; i < argc - 2; ++i)
@@ -51,23 +80,39 @@ int main(int argc, char** argv) {
   for (auto& tf : train_files)
     cerr << (d++==1 ? "  [primary] " : "[secondary] ")
          << "training corpus "<< ": " << tf << endl;
-  set<unsigned> vocab;
-  const unsigned kSOS = dict.Convert("<s>");
-  const unsigned kEOS = dict.Convert("</s>");
-  vector<vector<vector<unsigned> > > corpora(train_files.size());
+  vector<bool> vocabe;
+  vector<FlatCorpus> corpora(train_files.size());
   d = 0;
   for (const auto& train_file : train_files)
-    ReadFromFile(train_file, &dict, &corpora[d++], &vocab);
+    ReadFromFile(train_file, &dict, &corpora[d++], &vocabe, 0);  // one thread per core
+  const unsigned vocab_size = VocabularySize(vocabe);
+  // after the words, so that the first corpus, if binary, is used in place
+  const unsigned kSOS = dict.Convert("<s>");
+  const unsigned kEOS = dict.Convert("</s>");
 
-  PYPLM<kORDER> latent_lm(vocab.size(), 1, 1, 1, 1);
-  vector<DAPYPLM<kORDER>> dlm(corpora.size(), DAPYPLM<kORDER>(latent_lm)); // domain LMs
+  PYPLM<kORDER> latent_lm(vocab_size, 1, 1, 1, 1);
+  vector<DAPYPLM<kORDER>> dlm;  // domain LMs
+  for (unsigned i = 0; i < corpora.size(); ++i) dlm.emplace_back(latent_lm);
+  checkpoint ckpt(ckpt_opts.filename, "dhpyplm_train");
+  int start = 0;
+  if (ckpt_opts.resume && ckpt.exists()) {
+    cerr << "Resuming from " << ckpt.filename() << " ...\n";
+    if (!ckpt.load([&](binary_iarchive& ia) {
+          if (sampler_state(ia, corpora, vocab_size, kSOS, start, latent_lm, dlm, eng)) return true;
+          cerr << ckpt.filename() << " was not written for these training corpora\n";
+          return false;
+        }))
+      return 1;
+    cerr << "Resuming after sample " << start << endl;
+  }
   vector<unsigned> ctx(kORDER - 1, kSOS);
-  for (int sample=0; sample < samples; ++sample) {
+  for (int sample = start; sample < samples; ++sample) {
     int ci = 0;
     for (const auto& corpus : corpora) {
       DAPYPLM<kORDER>& lm = dlm[ci];
       ++ci;
-      for (const auto& s : corpus) {
+      for (size_t k = 0; k < corpus.size(); ++k) {
+        const FlatCorpus::Sentence s = corpus[k];
         ctx.resize(kORDER - 1);
         for (unsigned i = 0; i <= s.size(); ++i) {
           unsigned w = (i < s.size() ? s[i] : kEOS);
@@ -86,20 +131,26 @@ int main(int argc, char** argv) {
         latent_lm.resample_hyperparameters(eng);
       }
     } else { cerr << '.' << flush; }
+    if (ckpt_opts.due(sample + 1, samples)) {
+      int done = sample + 1;
+      ckpt.save([&](binary_oarchive& oa) { sampler_state(oa, corpora, vocab_size, kSOS, done, latent_lm, dlm, eng); });
+    }
   }
   cerr << "Writing LM to " << output_file << " ...\n";
-  ofstream ofile(output_file.c_str(), ios::out | ios::binary);
-  if (!ofile.good()) {
-    cerr << "Failed to open " << output_file << " for writing\n";
-    return 1;
-  }
-  boost::archive::binary_oarchive oa(ofile);
-  oa & dict;
-  oa & latent_lm;
-  unsigned num_domains = dlm.size();
-  oa & num_domains;
-  for (unsigned i = 0; i < num_domains; ++i)
-    oa & dlm[i];
+  model_info info;
+  info.kind = "DAPYPLM";
+  info.order = kORDER;
+  info.vocab_size = vocab_size;
+  latent_lm.get_hyperparameters(&info.hyperparameters);
+  const bool ok = write_model_file(output_file, info, [&](binary_oarchive& oa) {
+    oa & dict;
+    oa & latent_lm;
+    unsigned num_domains = dlm.size();
+    oa & num_domains;
+    for (unsigned i = 0; i < num_domains; ++i)
+      oa & dlm[i];
+  });
+  if (!ok) return 1;
   return 0;
 }
 
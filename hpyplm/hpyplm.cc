@@ -52,6 +52,7 @@ int main(int argc, char** argv) {
       if (sample % 30u == 29) lm.resample_hyperparameters(eng);
     } else { cerr << '.' << flush; }
   }
+  lm.freeze();
   double llh = 0;
   unsigned cnt = 0;
   unsigned oovs = 0;
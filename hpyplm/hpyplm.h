@@ -1,16 +1,25 @@
 #ifndef HPYPLM_H_
 #define HPYPLM_H_
 
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 #include <unordered_map>
 
 #include "cpyp/m.h"
 #include "cpyp/random.h"
 #include "cpyp/crp.h"
+#include "cpyp/compact_crp.h"
 #include "cpyp/tied_parameter_resampler.h"
 
-#include "hpyplm/uvector.h"
+#include "hpyplm/context_map.h"
 #include "hpyplm/uniform_vocab.h"
+#include "hpyplm/uvector.h"
 
 // A not very memory-efficient implementation of an N-gram LM based on PYPs
 // as described in Y.-W. Teh. (2006) A Hierarchical Bayesian Language Model
@@ -20,50 +29,442 @@ namespace cpyp {
 
 template <unsigned N> struct PYPLM;
 
+// the restaurant of a context of a PYPLM
+typedef compact_crp<unsigned> pyplm_crp;
+
+// the state of one PYPLM::resample_block move: the proposal's base
+// probabilities, the seating events of the old and the new seating of the
+// sentence, and what is needed to put the old seating back. reused from
+// block to block to keep its buffers
+struct sentence_block {
+  // a customer seated in (or removed from) restaurant r when it held
+  // a = n_w - d*t_w and b = s + d*T with c = n + s, and whether it sat alone
+  struct seating {
+    unsigned level, pos;
+    double a, b, c;
+    bool new_table;
+  };
+  struct saved_tables {
+    pyplm_crp* r;
+    unsigned dish;
+    crp_table_manager<1> tables;
+  };
+
+  void clear(unsigned n_positions) {
+    n = n_positions;
+    removed.clear();
+    added.clear();
+    saved.clear();
+    draws = nullptr;
+    base_removed = base_added = 0;
+  }
+
+  static seating make_seating(unsigned level, unsigned pos, const pyplm_crp& r, unsigned w) {
+    seating e;
+    e.level = level;
+    e.pos = pos;
+    e.a = r.num_customers(w) - r.discount() * r.num_tables(w);
+    e.b = r.strength() + r.discount() * r.num_tables();
+    e.c = r.num_customers() + r.strength();
+    // the first customer of a restaurant sits alone with probability 1
+    // under both, also when the strength is 0
+    if (!r.num_customers()) e.b = e.c = 1;
+    e.new_table = false;
+    return e;
+  }
+
+  // the proposal's base probability of the word at pos in restaurants of
+  // the given order
+  double base(unsigned level, unsigned pos) const { return probs[(level - 1) * n + pos]; }
+
+  // log of p/q of the events, where p is the probability of the event under
+  // the model and q under the proposal; the choice among the occupied
+  // tables is the same for both and cancels
+  double log_ratio(const std::vector<seating>& events) const {
+    double lr = 0;
+    for (auto& e : events) {
+      const double p0 = base(e.level, e.pos);
+      lr += log(e.a + e.b * p0) - log(e.c);
+      if (e.new_table) lr -= log(p0);
+    }
+    return lr;
+  }
+
+  // remembers the tables of dish in r before the move first changes them
+  void save(pyplm_crp* r, unsigned dish) {
+    for (auto& st : saved)
+      if (st.r == r && st.dish == dish) return;
+    saved.push_back(saved_tables{r, dish, r->tables(dish)});
+  }
+
+  // puts the old seating back
+  void restore() {
+    for (auto& st : saved) st.r->set_tables(st.dish, st.tables);
+    if (draws) *draws += base_removed - base_added;
+  }
+
+  unsigned n;                  // number of positions of the sentence
+  std::vector<double> probs;   // probs[k * n + i] = p_k(word at i) before reseating
+  std::vector<seating> removed, added;
+  std::vector<saved_tables> saved;
+  int* draws;                  // of the uniform base distribution
+  int base_removed, base_added;
+};
+
 template<> struct PYPLM<0> : public UniformVocabulary {
   PYPLM(unsigned vs, double a, double b, double c, double d) :
     UniformVocabulary(vs, a, b, c, d) {}
+  void prob_span(const unsigned*, unsigned n, double* probs) const {
+    std::fill(probs, probs + n, p0);
+  }
+  void frozen_prob_span(const unsigned*, const unsigned* pending, unsigned n, double* probs) const {
+    for (unsigned k = 0; k < n; ++k) probs[pending[k]] *= p0;
+  }
+  void add_context(const std::vector<unsigned>&) {}
+  void enable_concurrency(unsigned) {}
+  void set_resampling_threads(unsigned) {}
+  void freeze() {}
+  void snapshot(unsigned) {}
+  void thaw() {}
+  void get_hyperparameters(std::vector<double>*) const {}
+  void level_probs(const unsigned*, unsigned n, double* probs) const {
+    std::fill(probs, probs + n, p0);
+  }
+  template<typename Engine>
+  void remove_block(const unsigned*, unsigned, sentence_block* b, Engine&) {
+    b->draws = &draws;
+    --draws;
+    ++b->base_removed;
+  }
+  template<typename Engine>
+  void add_block(const unsigned*, unsigned, sentence_block* b, Engine&) {
+    b->draws = &draws;
+    ++draws;
+    ++b->base_added;
+  }
 };
 
 // represents an N-gram LM
 template <unsigned N> struct PYPLM {
+  typedef typename context_map<N-1, pyplm_crp>::key_type context_key;
+
   PYPLM() :
       backoff(0,1,1,1,1),
       tr(1,1,1,1,0.8,0.0),
-      lookup(N-1) {}
+      arena(new memory_arena),
+      params(new shared_crp_parameters),
+      lock_mask(),
+      frozen(),
+      snapshotted() {
+    params->arena = arena.get();
+    tr.share_parameters(params.get());
+  }
   explicit PYPLM(unsigned vs, double da = 1.0, double db = 1.0, double ss = 1.0, double sr = 1.0) :
       backoff(vs, da, db, ss, sr),
       tr(da, db, ss, sr, 0.8, 0.0),
-      lookup(N-1) {}
+      arena(new memory_arena),
+      params(new shared_crp_parameters),
+      lock_mask(),
+      frozen(),
+      snapshotted() {
+    params->arena = arena.get();
+    tr.share_parameters(params.get());
+  }
+
+  unsigned order() const { return N; }
+
   template<typename Engine>
   void increment(unsigned w, const std::vector<unsigned>& context, Engine& eng) {
+    if (frozen) thaw();
     const double bo = backoff.prob(w, context);
-    for (unsigned i = 0; i < N-1; ++i)
-      lookup[i] = context[context.size() - 1 - i];
-    auto it = p.find(lookup);
-    if (it == p.end()) {
-      it = p.insert(make_pair(lookup, crp<unsigned>(0.8,0))).first;
-      tr.insert(&it->second);  // add to resampler
+    const context_key lookup = make_key(context);
+    std::unique_lock<std::mutex> lock = lock_context(lookup);
+    pyplm_crp* r = p.find(lookup);
+    if (!r) {
+      if (locks) {
+        std::cerr << "PYPLM<" << N << ">: unknown context during concurrent sampling (call add_context first)\n";
+        abort();
+      }
+      r = p.insert(lookup, new_crp());
+      tr.insert(r);  // add to resampler
     }
-    if (it->second.increment(w, bo, eng))
+    if (r->increment(w, bo, eng)) {
+      // the uniform base distribution has no lock of its own
+      if (N > 1 && lock) lock.unlock();
       backoff.increment(w, context, eng);
+    }
   }
   template<typename Engine>
   void decrement(unsigned w, const std::vector<unsigned>& context, Engine& eng) {
-    for (unsigned i = 0; i < N-1; ++i)
-      lookup[i] = context[context.size() - 1 - i];
-    auto it = p.find(lookup);
-    assert(it != p.end());
-    if (it->second.decrement(w, eng))
+    if (frozen) thaw();
+    const context_key lookup = make_key(context);
+    std::unique_lock<std::mutex> lock = lock_context(lookup);
+    pyplm_crp* r = p.find(lookup);
+    assert(r);
+    if (r->decrement(w, eng)) {
+      if (N > 1 && lock) lock.unlock();
       backoff.decrement(w, context, eng);
+    }
   }
   double prob(unsigned w, const std::vector<unsigned>& context) const {
+    if (frozen || snapshotted) return frozen_prob(w, context);
     const double bo = backoff.prob(w, context);
+    const context_key lookup = make_key(context);
+    std::unique_lock<std::mutex> lock = lock_context(lookup);
+    const pyplm_crp* r = p.find(lookup);
+    if (!r) return bo;
+    return r->prob(w, bo);
+  }
+
+  // batched prob(): probs[i] = p(words[N-1+i] | words[i] ... words[N-2+i])
+  // for 0 <= i < n, that is, words holds the N-1 words of context of the
+  // first prediction followed by the n predicted words. each order makes one
+  // pass over all positions, looks up a context only once for a run of
+  // positions that share it, and prefetches the table slots of the contexts
+  // a few positions ahead. a live model is scored bottom-up, every pass
+  // starting from the lower-order probabilities of the previous one; a frozen
+  // model is scored top-down, and only the positions whose word was not
+  // found in a higher-order context are passed on to the lower orders
+  void prob_span(const unsigned* words, unsigned n, double* probs) const {
+    if (frozen || snapshotted) {
+      std::vector<unsigned> pending(n);
+      for (unsigned i = 0; i < n; ++i) pending[i] = i;
+      std::fill(probs, probs + n, 1.0);
+      frozen_prob_span(words, &pending[0], n, probs);
+      return;
+    }
+    backoff.prob_span(words + 1, n, probs);
+    context_key lookup, last;
+    const pyplm_crp* r = nullptr;
+    for (unsigned i = 0; i < n; ++i) {
+      if (i + kPREFETCH_DISTANCE < n) p.prefetch(span_key(words + i + kPREFETCH_DISTANCE));
+      lookup = span_key(words + i);
+      std::unique_lock<std::mutex> lock = lock_context(lookup);
+      if (i == 0 || lookup != last) r = p.find(lookup);
+      if (r) probs[i] = r->prob(words[N - 1 + i], probs[i]);
+      last = lookup;
+    }
+  }
+
+  // reseats the customers of all orders for the n positions of words (laid
+  // out as for prob_span, e.g., a padded sentence) as one block, and returns
+  // whether the new seating was accepted. the customers are removed, the
+  // probabilities of every order are computed once for the whole block, and
+  // the customers are seated again (as by increment) with those fixed base
+  // probabilities, which saves the per-customer backoff evaluations but
+  // ignores how the block changes its own lower-order restaurants. a
+  // Metropolis-Hastings test corrects for this, and the old seating is put
+  // back if the proposal is rejected. b holds the state of the move (see
+  // sentence_block). not for concurrent sampling
+  template<typename Engine>
+  bool resample_block(const unsigned* words, unsigned n, sentence_block* b, Engine& eng) {
+    assert(!locks);
+    if (frozen) thaw();
+    b->clear(n);
+    // removed in reverse order, so that each removal leaves the state from
+    // which the reverse proposal would seat that customer again
+    for (unsigned i = n; i > 0; --i)
+      remove_block(words, i - 1, b, eng);
+    b->probs.resize((N + 1) * n);
+    level_probs(words, n, &b->probs[0]);
+    for (unsigned i = 0; i < n; ++i)
+      add_block(words, i, b, eng);
+    const double log_p0 = log(b->probs[0]);
+    const double log_a = b->log_ratio(b->added) - b->log_ratio(b->removed) +
+                         (b->base_added - b->base_removed) * log_p0;
+    if (log_a >= 0 || sample_uniform01<double>(eng) < exp(log_a)) return true;
+    b->restore();
+    return false;
+  }
+
+  // probs[k * n + i] = p_k(words[N-1+i] | context) for every order 0 <= k <= N
+  // and position i (see prob_span)
+  void level_probs(const unsigned* words, unsigned n, double* probs) const {
+    backoff.level_probs(words + 1, n, probs);
+    double* lp = probs + (N - 1) * n;
+    double* hp = probs + N * n;
+    for (unsigned i = 0; i < n; ++i) {
+      const pyplm_crp* r = p.find(span_key(words + i));
+      hp[i] = r ? r->prob(words[N - 1 + i], lp[i]) : lp[i];
+    }
+  }
+
+  template<typename Engine>
+  void remove_block(const unsigned* words, unsigned i, sentence_block* b, Engine& eng) {
+    const unsigned w = words[N - 1 + i];
+    pyplm_crp* r = p.find(span_key(words + i));
+    assert(r);
+    b->save(r, w);
+    const bool closed = r->decrement(w, eng) != 0;
+    b->removed.push_back(sentence_block::make_seating(N, i, *r, w));
+    b->removed.back().new_table = closed;
+    if (closed) backoff.remove_block(words + 1, i, b, eng);
+  }
+
+  template<typename Engine>
+  void add_block(const unsigned* words, unsigned i, sentence_block* b, Engine& eng) {
+    const unsigned w = words[N - 1 + i];
+    const context_key key = span_key(words + i);
+    pyplm_crp* r = p.find(key);
+    if (!r) {
+      r = p.insert(key, new_crp());
+      tr.insert(r);
+    }
+    b->save(r, w);
+    b->added.push_back(sentence_block::make_seating(N, i, *r, w));
+    const bool opened = r->increment(w, b->base(N, i), eng) != 0;
+    b->added.back().new_table = opened;
+    if (opened) backoff.add_block(words + 1, i, b, eng);
+  }
+
+  // multiplies probs[i] by the frozen probability of position i (see
+  // prob_span) for the n positions listed in pending, which is overwritten
+  void frozen_prob_span(const unsigned* words, unsigned* pending, unsigned n, double* probs) const {
+    context_key lookup, last;
+    const frozen_context* fc = nullptr;
+    unsigned m = 0;
+    for (unsigned k = 0; k < n; ++k) {
+      if (k + kPREFETCH_DISTANCE < n)
+        frozen_contexts.prefetch(span_key(words + pending[k + kPREFETCH_DISTANCE]));
+      const unsigned i = pending[k];
+      lookup = span_key(words + i);
+      if (k == 0 || lookup != last) fc = frozen_contexts.find(lookup);
+      last = lookup;
+      if (fc) {
+        const unsigned w = words[N - 1 + i];
+        const auto end = frozen_dishes.begin() + fc->end;
+        const auto it = std::lower_bound(frozen_dishes.begin() + fc->begin, end, std::make_pair(w, 0.0));
+        if (it != end && it->first == w) {
+          probs[i] *= it->second;
+          continue;
+        }
+        probs[i] *= fc->backoff_weight;
+      }
+      pending[m++] = i;
+    }
+    backoff.frozen_prob_span(words + 1, pending, m, probs);
+  }
+
+  // precomputes the backoff weight (T*d + s)/(C + s) of every context and
+  // p(w | context) for every dish w served in it, so that prob() needs one
+  // lookup and one multiplication per order and stops at the longest
+  // observed n-gram. increment and decrement discard the cache (see thaw)
+  void freeze() {
+    backoff.freeze();
+    cache_probs();
+    frozen = true;
+  }
+
+  // for concurrent sampling, as in AD-LDA: prob() at this and the lower
+  // orders, down to the uniform base, returns the probabilities as of this
+  // call from the cache of freeze(), without taking any locks, while
+  // increment and decrement keep updating the restaurants (and leave the
+  // cache alone). this takes the hot unigram and bigram restaurants off the
+  // path of every customer of the higher orders, at the price of backoff
+  // probabilities that are up to one sweep stale. call it again to refresh
+  // the probabilities (e.g., before every sample), and thaw() to discard
+  // them. orders above max_order are not affected
+  void snapshot(unsigned max_order) {
+    backoff.snapshot(max_order);
+    if (N > max_order) return;
+    cache_probs();
+    snapshotted = true;
+  }
+
+  void thaw() {
+    frozen = snapshotted = false;
+    frozen_contexts.clear();
+    std::vector<std::pair<unsigned, double>>().swap(frozen_dishes);
+    backoff.thaw();
+  }
+
+  bool is_frozen() const { return frozen; }
+
+  // builds the cache of freeze() and snapshot() (the lower orders must
+  // already be cached)
+  void cache_probs() {
+    frozen_contexts.clear();
+    frozen_dishes.clear();
+    frozen_contexts.reserve(p.size());
+    std::vector<unsigned> context(N-1);
+    for (auto& kv : p) {
+      const pyplm_crp& r = kv.second;
+      if (r.num_tables() == 0) continue;
+      for (unsigned i = 0; i < N-1; ++i)
+        context[N - 2 - i] = kv.first[i];
+      frozen_context fc;
+      fc.backoff_weight = (r.num_tables() * r.discount() + r.strength()) /
+                          (r.num_customers() + r.strength());
+      fc.begin = frozen_dishes.size();
+      for (auto& dish : r)
+        frozen_dishes.push_back(std::make_pair(dish.first, r.prob(dish.first, backoff.prob(dish.first, context))));
+      fc.end = frozen_dishes.size();
+      std::sort(frozen_dishes.begin() + fc.begin, frozen_dishes.end());
+      frozen_contexts.insert(kv.first, fc);
+    }
+  }
+
+  double frozen_prob(unsigned w, const std::vector<unsigned>& context) const {
+    const frozen_context* fc = frozen_contexts.find(make_key(context));
+    if (!fc) return backoff.prob(w, context);
+    const auto end = frozen_dishes.begin() + fc->end;
+    const auto it = std::lower_bound(frozen_dishes.begin() + fc->begin, end, std::make_pair(w, 0.0));
+    if (it != end && it->first == w) return it->second;
+    return fc->backoff_weight * backoff.prob(w, context);
+  }
+
+  // creates (empty) restaurants for context at this and all lower orders
+  void add_context(const std::vector<unsigned>& context) {
+    const context_key lookup = make_key(context);
+    if (!p.find(lookup)) tr.insert(p.insert(lookup, new_crp()));
+    backoff.add_context(context);
+  }
+
+  // allows increment, decrement and prob to be called from several threads
+  // at once. every context that will be seen must already have been added
+  // (with add_context or increment), since the context tables are not
+  // modified while sampling concurrently. each restaurant is guarded by one
+  // of nstripes (a power of 2) mutexes selected by the hash of its context
+  void enable_concurrency(unsigned nstripes = 4096) {
+    assert((nstripes & (nstripes - 1)) == 0);
+    locks.reset(new std::mutex[nstripes]);
+    lock_mask = nstripes - 1;
+    arena->set_concurrent(true);
+    backoff.enable_concurrency(nstripes);
+  }
+
+  // number of threads with which resample_hyperparameters evaluates the
+  // likelihood of each order (the samples do not depend on it)
+  void set_resampling_threads(unsigned n) {
+    tr.set_threads(n);
+    backoff.set_resampling_threads(n);
+  }
+
+  // an empty restaurant, with the hyperparameters of tr
+  pyplm_crp new_crp() const {
+    return pyplm_crp(params.get());
+  }
+
+  std::unique_lock<std::mutex> lock_context(const context_key& key) const {
+    if (!locks) return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(locks[context_map<N-1, pyplm_crp>::hash(key) & lock_mask]);
+  }
+
+  // the N-1 most recent words of context, most recent first
+  static context_key make_key(const std::vector<unsigned>& context) {
+    context_key key;
     for (unsigned i = 0; i < N-1; ++i)
-      lookup[i] = context[context.size() - 1 - i];
-    auto it = p.find(lookup);
-    if (it == p.end()) return bo;
-    return it->second.prob(w, bo);
+      key[i] = context[context.size() - 1 - i];
+    return key;
+  }
+
+  // the N-1 words starting at context (in the order they occur in the text)
+  // as a key, most recent first
+  static context_key span_key(const unsigned* context) {
+    context_key key;
+    for (unsigned i = 0; i < N-1; ++i)
+      key[i] = context[N - 2 - i];
+    return key;
   }
 
   double log_likelihood() const {
@@ -76,17 +477,166 @@ template <unsigned N> struct PYPLM {
     backoff.resample_hyperparameters(eng);
   }
 
+  // appends the (tied) discount and strength of every order, highest first
+  void get_hyperparameters(std::vector<double>* dh) const {
+    dh->push_back(tr.get_discount());
+    dh->push_back(tr.get_strength());
+    backoff.get_hyperparameters(dh);
+  }
+
   template<class Archive> void serialize(Archive& ar, const unsigned int version) {
+    if (Archive::is_loading::value && frozen) thaw();
     backoff.serialize(ar, version);
+    serialize(ar, version, is_bulk_archive<Archive>());
+  }
+
+  // boost archives store the tied hyperparameters and then the restaurants
+  // one by one. the class version (see boost_hpyplm.h) is 1; archives of
+  // version 0 hold a crp per context instead (see load_untied)
+  template<class Archive> void serialize(Archive& ar, const unsigned int version, std::false_type) {
+    if (Archive::is_loading::value && version == 0) {
+      load_untied(ar);
+      return;
+    }
+    assert(version > 0);  // saved without boost_hpyplm.h
+    double d = tr.get_discount(), s = tr.get_strength();
+    ar & d;
+    ar & s;
     ar & p;
+    if (Archive::is_loading::value) {
+      tr.clear();
+      tr.set_hyperparameters(d, s);
+      for (auto& kv : p) {
+        kv.second.set_parameters(params.get());
+        tr.insert(&kv.second);
+      }
+    }
+  }
+
+  // the restaurants of version 0 archives, each a crp<unsigned> keyed by its
+  // context (most recent word first) and all with the same hyperparameters
+  template<class Archive> void load_untied(Archive& ar) {
+    std::unordered_map<std::vector<unsigned>, crp<unsigned>, uvector_hash> untied;
+    ar & untied;
+    p.clear();
+    tr.clear();
+    if (!untied.empty())
+      tr.set_hyperparameters(untied.begin()->second.discount(), untied.begin()->second.strength());
+    p.reserve(untied.size());
+    context_key key;
+    for (auto& kv : untied) {
+      if (kv.first.size() != N-1) {
+        std::cerr << "Bad context in version 0 archive of a " << N << "-gram PYPLM\n";
+        abort();
+      }
+      for (unsigned i = 0; i < N-1; ++i) key[i] = kv.first[i];
+      pyplm_crp* r = p.insert(key, new_crp());
+      tr.insert(r);
+      for (auto& dish_loc : kv.second) r->set_tables(dish_loc.first, dish_loc.second);
+    }
+  }
+
+  // bulk archives store the tied hyperparameters once, all contexts as one
+  // array, and the seating arrangements as dish_columns
+  void serialize(binary_oarchive& ar, const unsigned int, std::true_type) {
+    std::vector<unsigned> keys;
+    keys.reserve(p.size() * (N-1));
+    dish_columns<unsigned> cols;
+    cols.num_dishes.reserve(p.size());
+    for (auto& kv : p) {
+      keys.insert(keys.end(), kv.first.begin(), kv.first.end());
+      kv.second.save_seating(&cols);
+    }
+    ar & tr.get_discount();
+    ar & tr.get_strength();
+    ar & keys;
+    ar & cols;
   }
+  void serialize(binary_iarchive& ar, const unsigned int, std::true_type) {
+    double d = 0, s = 0;
+    std::vector<unsigned> keys;
+    dish_columns<unsigned> cols;
+    ar & d;
+    ar & s;
+    ar & keys;
+    ar & cols;
+    p.clear();
+    tr.clear();
+    const size_t n = cols.num_dishes.size();
+    if (!ar.good() || keys.size() != n * (N-1) || !(d >= 0.0 && d < 1.0 && s > -d)) {
+      ar.fail();
+      return;
+    }
+    tr.set_hyperparameters(d, s);
+    p.reserve(n);
+    context_key key;
+    for (size_t i = 0; i < n; ++i) {
+      std::copy(keys.data() + i * (N-1), keys.data() + (i + 1) * (N-1), key.begin());
+      if (p.find(key)) break;
+      pyplm_crp* r = p.insert(key, new_crp());
+      tr.insert(r);
+      if (!r->load_seating(&cols)) break;
+    }
+    if (!cols.done()) ar.fail();
+  }
+
+  // how many positions ahead prob_span prefetches context table slots
+  static const unsigned kPREFETCH_DISTANCE = 4;
 
   PYPLM<N-1> backoff;
-  tied_parameter_resampler<crp<unsigned>> tr;
-  mutable std::vector<unsigned> lookup;  // thread-local
-  std::unordered_map<std::vector<unsigned>, crp<unsigned>, uvector_hash> p;  // .first = context .second = CRP
+  tied_parameter_resampler<pyplm_crp> tr;
+  std::unique_ptr<memory_arena> arena;  // the dishes of p, which it outlives
+  std::unique_ptr<shared_crp_parameters> params;  // of the restaurants of p, set by tr
+  context_map<N-1, pyplm_crp> p;  // .first = context .second = CRP
+  std::unique_ptr<std::mutex[]> locks;  // null unless enable_concurrency has been called
+  unsigned lock_mask;
+
+  // probability cache built by freeze() and snapshot()
+  struct frozen_context {
+    double backoff_weight;
+    size_t begin, end;  // range of frozen_dishes, sorted by word
+  };
+  bool frozen;
+  bool snapshotted;
+  context_map<N-1, frozen_context> frozen_contexts;
+  std::vector<std::pair<unsigned, double>> frozen_dishes;  // (w, p(w | context))
 };
 
+// (*probs)[i] = p(s[i] | s[0] ... s[i-1]) for every word of the sentence s
+// followed by kEOS, with the context padded by kSOS. lm is a PYPLM<N> or a
+// CompiledPYPLM; the whole sentence is scored with a single prob_span call
+template <class LM>
+void prob_sentence(const LM& lm, const std::vector<unsigned>& s, unsigned kSOS, unsigned kEOS,
+                   std::vector<double>* probs) {
+  std::vector<unsigned> words(lm.order() - 1, kSOS);
+  words.insert(words.end(), s.begin(), s.end());
+  words.push_back(kEOS);
+  probs->resize(s.size() + 1);
+  lm.prob_span(&words[0], s.size() + 1, &(*probs)[0]);
+}
+
+// highest order that can be chosen at runtime (see DispatchOrder)
+static const unsigned kMAX_ORDER = 7;
+
+// calls f(std::integral_constant<unsigned, order>()), so that tools can
+// choose the order of a PYPLM<N> at runtime (e.g., from the command line or
+// a model file) while sampling and querying with the compile-time
+// specialization for that order
+template <class F>
+auto DispatchOrder(unsigned order, F&& f) -> decltype(f(std::integral_constant<unsigned, 1>())) {
+  switch (order) {
+    case 1: return f(std::integral_constant<unsigned, 1>());
+    case 2: return f(std::integral_constant<unsigned, 2>());
+    case 3: return f(std::integral_constant<unsigned, 3>());
+    case 4: return f(std::integral_constant<unsigned, 4>());
+    case 5: return f(std::integral_constant<unsigned, 5>());
+    case 6: return f(std::integral_constant<unsigned, 6>());
+    case 7: return f(std::integral_constant<unsigned, 7>());
+  }
+  std::cerr << "Unsupported n-gram order " << order << " (must be between 1 and " << kMAX_ORDER << ")\n";
+  abort();
+}
+
 }
 
 #endif
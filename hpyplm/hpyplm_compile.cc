@@ -0,0 +1,43 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "hpyplm.h"
+#include "compiled_hpyplm.h"
+#include "corpus/corpus.h"
+#include "cpyp/model_file.h"
+
+using namespace std;
+using namespace cpyp;
+
+// loads the rest of a trained model once its order is known and compiles it
+struct Compiler {
+  model_reader& in;
+  const Dict& dict;
+  const string& output_file;
+
+  template <unsigned N>
+  int operator()(std::integral_constant<unsigned, N>) const {
+    PYPLM<N> lm;
+    in.archive() & lm;
+    if (!in.done()) return 1;
+    cerr << "Writing compiled " << N << "-gram LM to " << output_file << " ...\n";
+    return WriteCompiledPYPLM(lm, dict, output_file) ? 0 : 1;
+  }
+};
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    cerr << argv[0] << " <input.lm> <output.clm>\n\nConvert a trained HPYP LM (of any order) into the read-only memory-mapped\nformat that hpyplm_query and the cdec feature load without deserialization\n";
+    return 1;
+  }
+  string lm_file = argv[1];
+  string output_file = argv[2];
+
+  cerr << "Reading LM from " << lm_file << " ...\n";
+  model_reader in;
+  if (!in.open(lm_file, "PYPLM")) return 1;
+  Dict dict;
+  in.archive() & dict;
+  Compiler compiler{in, dict, output_file};
+  return DispatchOrder(in.info().order, compiler);
+}
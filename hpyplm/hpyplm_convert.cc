@@ -0,0 +1,83 @@
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <cstdlib>
+#include <cstring>
+
+#include "hpyplm.h"
+#include "dhpyplm.h"
+#include "boost_hpyplm.h"
+#include "corpus/corpus.h"
+#include "cpyp/model_file.h"
+
+#include <boost/archive/binary_iarchive.hpp>
+
+// hpyplm_train and dhpyplm_train used to write their models as boost binary
+// archives of a 3-gram model; this rewrites such a model as a model file
+#define kORDER 3
+
+using namespace std;
+using namespace cpyp;
+
+int main(int argc, char** argv) {
+  bool domains = false;
+  if (argc == 4 && !strcmp(argv[1], "-d")) {
+    domains = true;
+    --argc;
+    ++argv;
+  }
+  if (argc != 3) {
+    cerr << argv[0] << " [-d] <old.lm> <output.lm>\n\nConvert a " << kORDER << "-gram LM written by an old hpyplm_train (or, with -d,\n"
+            "dhpyplm_train) as a boost archive into the model file that the current tools read\n";
+    return 1;
+  }
+  string lm_file = argv[1];
+  string output_file = argv[2];
+  if (model_reader::is_model_file(lm_file)) {
+    cerr << lm_file << " is already a model file\n";
+    return 1;
+  }
+
+  cerr << "Reading LM from " << lm_file << " ...\n";
+  ifstream ifile(lm_file.c_str(), ios::in | ios::binary);
+  if (!ifile.good()) {
+    cerr << "Failed to open " << lm_file << " for reading\n";
+    return 1;
+  }
+  Dict dict;
+  PYPLM<kORDER> lm;
+  vector<DAPYPLM<kORDER>> dlm;  // domain LMs, with -d
+  try {
+    boost::archive::binary_iarchive ia(ifile);
+    ia & dict;
+    ia & lm;
+    if (domains) {
+      unsigned num_domains = 0;
+      ia & num_domains;
+      for (unsigned i = 0; i < num_domains; ++i) dlm.emplace_back(lm);
+      for (unsigned i = 0; i < num_domains; ++i)
+        ia & dlm[i];
+    }
+  } catch (const std::exception& e) {
+    cerr << "Failed to read " << lm_file << ": " << e.what() << endl;
+    return 1;
+  }
+
+  cerr << "Writing LM to " << output_file << " ...\n";
+  model_info info;
+  info.kind = domains ? "DAPYPLM" : "PYPLM";
+  info.order = kORDER;
+  info.vocab_size = static_cast<unsigned>(1.0 / lm.backoff.backoff.backoff.p0 + 0.5);
+  lm.get_hyperparameters(&info.hyperparameters);
+  const bool ok = write_model_file(output_file, info, [&](binary_oarchive& oa) {
+    oa & dict;
+    oa & lm;
+    if (domains) {
+      unsigned num_domains = dlm.size();
+      oa & num_domains;
+      for (unsigned i = 0; i < num_domains; ++i)
+        oa & dlm[i];
+    }
+  });
+  return ok ? 0 : 1;
+}
@@ -3,39 +3,18 @@
 #include <cstdlib>
 
 #include "hpyplm.h"
+#include "compiled_hpyplm.h"
 #include "corpus/corpus.h"
-
-#include "cpyp/boost_serializers.h"
-#include <boost/serialization/vector.hpp>
-#include <boost/archive/binary_iarchive.hpp>
-
-#define kORDER 3
+#include "cpyp/model_file.h"
 
 using namespace std;
 using namespace cpyp;
 
-int main(int argc, char** argv) {
-  if (argc != 3) {
-    cerr << argv[0] << " <input.lm> <test.txt>\n\nCompute perplexity of a " << kORDER << "-gram HPYP LM\n";
-    return 1;
-  }
-  MT19937 eng;
-  string lm_file = argv[1];
-  string test_file = argv[2];
-
-  PYPLM<kORDER> lm;
-  //vector<unsigned> ctx(kORDER - 1, kSOS);
-
-  cerr << "Reading LM from " << lm_file << " ...\n";
-  ifstream ifile(lm_file.c_str(), ios::in | ios::binary);
-  if (!ifile.good()) {
-    cerr << "Failed to open " << lm_file << " for reading\n";
-    return 1;
-  }
-  boost::archive::binary_iarchive ia(ifile);
-  Dict dict;
-  ia & dict;
-  ia & lm;
+// report the perplexity of lm (PYPLM<N> or CompiledPYPLM) on test_file
+template <class LM>
+void Evaluate(const LM& lm, Dict& dict, const string& test_file) {
+  const unsigned order = lm.order();
+  dict.freeze();  // the test words are mostly looked up, not added
   const unsigned max_iv = dict.max();
   const unsigned kSOS = dict.Convert("<s>");
   const unsigned kEOS = dict.Convert("</s>");
@@ -45,19 +24,21 @@ int main(int argc, char** argv) {
   double llh = 0;
   unsigned cnt = 0;
   unsigned oovs = 0;
-  vector<unsigned> ctx(kORDER - 1, kSOS);
+  vector<unsigned> ctx(order - 1, kSOS);
+  vector<double> probs;
   for (auto& s : test) {
-    ctx.resize(kORDER - 1);
+    ctx.resize(order - 1);
+    prob_sentence(lm, s, kSOS, kEOS, &probs);
     for (unsigned i = 0; i <= s.size(); ++i) {
       unsigned w = (i < s.size() ? s[i] : kEOS);
-      double lp = log(lm.prob(w, ctx)) / log(2);
+      double lp = log(probs[i]) / log(2);
       if (w >= max_iv) {
         cerr << "**OOV ";
         ++oovs;
         lp = 0;
       }
       cerr << "p(" << dict.Convert(w) << " |";
-      for (unsigned j = ctx.size() + 1 - kORDER; j < ctx.size(); ++j)
+      for (unsigned j = ctx.size() + 1 - order; j < ctx.size(); ++j)
         cerr << ' ' << dict.Convert(ctx[j]);
       cerr << ") = " << lp << endl;
       ctx.push_back(w);
@@ -71,6 +52,49 @@ int main(int argc, char** argv) {
   cerr << "         OOVs: " << oovs << endl;
   cerr << "Cross-entropy: " << (llh / cnt) << endl;
   cerr << "   Perplexity: " << pow(2, llh / cnt) << endl;
-  return 0;
+}
+
+// loads the rest of a trained model once its order is known
+struct TrainedEvaluator {
+  model_reader& in;
+  Dict& dict;
+  const string& test_file;
+
+  template <unsigned N>
+  int operator()(std::integral_constant<unsigned, N>) const {
+    PYPLM<N> lm;
+    in.archive() & lm;
+    if (!in.done()) return 1;
+    lm.freeze();
+    Evaluate(lm, dict, test_file);
+    return 0;
+  }
+};
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    cerr << argv[0] << " <input.lm> <test.txt>\n\nCompute perplexity of an HPYP LM of any order\n"
+         << "<input.lm> may be a trained model or the output of hpyplm_compile\n";
+    return 1;
+  }
+  string lm_file = argv[1];
+  string test_file = argv[2];
+
+  cerr << "Reading LM from " << lm_file << " ...\n";
+  Dict dict;
+  if (CompiledPYPLM::IsCompiled(lm_file)) {
+    CompiledPYPLM lm;
+    if (!lm.Open(lm_file)) return 1;
+    lm.PopulateDict(&dict);
+    Evaluate(lm, dict, test_file);
+    return 0;
+  }
+
+  model_reader in;
+  if (!in.open(lm_file, "PYPLM")) return 1;
+  in.archive() & dict;
+  cerr << "LM order: " << in.info().order << endl;
+  TrainedEvaluator evaluator{in, dict, test_file};
+  return DispatchOrder(in.info().order, evaluator);
 }
 
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <unordered_map>
 #include <cstdlib>
+#include <cstring>
+#include <thread>
 
 #include "hpyplm.h"
 #include "corpus/corpus.h"
@@ -8,24 +10,214 @@
 #include "cpyp/random.h"
 #include "cpyp/crp.h"
 #include "cpyp/tied_parameter_resampler.h"
-
-#include "cpyp/boost_serializers.h"
-#include <boost/serialization/vector.hpp>
-#include <boost/archive/binary_oarchive.hpp>
-
-#define kORDER 3
+#include "cpyp/checkpoint.h"
+#include "cpyp/model_file.h"
 
 using namespace std;
 using namespace cpyp;
 
 Dict dict;
 
+// resample the seating of every token in sentences [begin, end)
+template <unsigned N, typename Engine>
+void sweep(PYPLM<N>& lm, const FlatCorpus& corpus, size_t begin, size_t end,
+           bool first, unsigned kSOS, unsigned kEOS, Engine& engine) {
+  uniform_buffer<Engine> eng(engine);
+  vector<unsigned> ctx(N - 1, kSOS);
+  for (size_t k = begin; k < end; ++k) {
+    const FlatCorpus::Sentence s = corpus[k];
+    ctx.resize(N - 1);
+    for (unsigned i = 0; i <= s.size(); ++i) {
+      unsigned w = (i < s.size() ? s[i] : kEOS);
+      if (!first) lm.decrement(w, ctx, eng);
+      lm.increment(w, ctx, eng);
+      ctx.push_back(w);
+    }
+  }
+}
+
+// resample sentences [begin, end) as blocks (see PYPLM::resample_block);
+// returns the number of accepted proposals
+template <unsigned N, typename Engine>
+size_t block_sweep(PYPLM<N>& lm, const FlatCorpus& corpus, size_t begin, size_t end,
+                   unsigned kSOS, unsigned kEOS, Engine& engine) {
+  uniform_buffer<Engine> eng(engine);
+  sentence_block b;
+  vector<unsigned> words;
+  size_t accepted = 0;
+  for (size_t k = begin; k < end; ++k) {
+    const FlatCorpus::Sentence s = corpus[k];
+    words.assign(N - 1, kSOS);
+    for (unsigned i = 0; i < s.size(); ++i) words.push_back(s[i]);
+    words.push_back(kEOS);
+    accepted += lm.resample_block(&words[0], s.size() + 1, &b, eng);
+  }
+  return accepted;
+}
+
+// the state of the sampler after sample samples: the model and the random
+// streams, following the shape and the ids of the training data, which must
+// not change when sampling is resumed. streams of threads that did not exist in the run
+// that saved the state keep their seeds
+template <class Archive, class LM>
+bool sampler_state(Archive& ar, const FlatCorpus& corpus, unsigned vocab_size, unsigned sos,
+                   int& sample, LM& lm, Xoshiro256& eng, vector<Xoshiro256>& engs) {
+  if (!checkpoint::same_value(ar, lm.order()) || !checkpoint::same_value(ar, corpus.size()) ||
+      !checkpoint::same_value(ar, corpus.num_tokens()) || !checkpoint::same_value(ar, vocab_size) ||
+      !checkpoint::same_value(ar, sos))
+    return false;
+  ar & sample;
+  ar & eng;
+  uint64_t nengs = engs.size();
+  ar & nengs;
+  for (uint64_t t = 0; t < nengs; ++t) {
+    Xoshiro256 unused(0);
+    ar & (t < engs.size() ? engs[t] : unused);
+  }
+  ar & lm;
+  return true;
+}
+
+// with -j, the orders up to this one are read from a snapshot taken before
+// every sample (see PYPLM::snapshot)
+static const unsigned kSNAPSHOT_ORDER = 2;
+
+// samples an N-gram LM for the chosen order (see DispatchOrder)
+struct Trainer {
+  const FlatCorpus& corpus;
+  unsigned vocab_size;
+  unsigned kSOS, kEOS;
+  int samples;
+  unsigned threads;
+  string output_file;
+  const checkpoint_options& ckpt_opts;
+  bool blocked;
+  Xoshiro256& eng;
+
+  template <unsigned N>
+  int operator()(std::integral_constant<unsigned, N>) const {
+    PYPLM<N> lm(vocab_size, 1, 1, 1, 1);
+
+    // each thread gets a contiguous shard of the corpus and its own random stream
+    vector<Xoshiro256> engs;
+    for (unsigned t = 0; threads > 1 && t < threads; ++t)
+      engs.push_back(eng.split());
+
+    checkpoint ckpt(ckpt_opts.filename, "hpyplm_train");
+    int start = 0;
+    if (ckpt_opts.resume && ckpt.exists()) {
+      cerr << "Resuming from " << ckpt.filename() << " ...\n";
+      if (!ckpt.load([&](binary_iarchive& ia) {
+            if (sampler_state(ia, corpus, vocab_size, kSOS, start, lm, eng, engs)) return true;
+            cerr << ckpt.filename() << " was not written for this order and training corpus\n";
+            return false;
+          }))
+        return 1;
+      cerr << "Resuming after sample " << start << endl;
+    }
+
+    if (threads > 1) {
+      cerr << "Sampling with " << threads << " threads\n";
+      vector<unsigned> ctx;
+      for (size_t k = 0; k < corpus.size(); ++k) {
+        const FlatCorpus::Sentence s = corpus[k];
+        ctx.assign(N - 1, kSOS);
+        for (unsigned i = 0; i <= s.size(); ++i) {
+          lm.add_context(ctx);
+          ctx.push_back(i < s.size() ? s[i] : kEOS);
+        }
+      }
+      lm.enable_concurrency();
+      lm.set_resampling_threads(threads);
+    }
+
+    const unsigned sos = kSOS, eos = kEOS;
+    size_t accepted = 0, proposed = 0;
+    for (int sample = start; sample < samples; ++sample) {
+      if (blocked && sample > 0) {
+        accepted += block_sweep(lm, corpus, 0, corpus.size(), sos, eos, eng);
+        proposed += corpus.size();
+      } else if (threads > 1) {
+        lm.snapshot(std::min(N - 1, kSNAPSHOT_ORDER));
+        vector<thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+          const size_t begin = corpus.size() * t / threads;
+          const size_t end = corpus.size() * (t + 1) / threads;
+          Xoshiro256& teng = engs[t];
+          const FlatCorpus& c = corpus;
+          workers.push_back(thread([&lm, &c, begin, end, sample, sos, eos, &teng]() {
+            sweep(lm, c, begin, end, sample == 0, sos, eos, teng);
+          }));
+        }
+        for (auto& w : workers) w.join();
+      } else {
+        sweep(lm, corpus, 0, corpus.size(), sample == 0, sos, eos, eng);
+      }
+      if (sample % 10 == 9) {
+        cerr << " [LLH=" << lm.log_likelihood();
+        if (proposed) cerr << " accepted=" << 100.0 * accepted / proposed << '%';
+        cerr << "]" << endl;
+        accepted = proposed = 0;
+        if (sample % 30u == 29) lm.resample_hyperparameters(eng);
+      } else { cerr << '.' << flush; }
+      if (ckpt_opts.due(sample + 1, samples)) {
+        int done = sample + 1;
+        ckpt.save([&](binary_oarchive& oa) { sampler_state(oa, corpus, vocab_size, kSOS, done, lm, eng, engs); });
+      }
+    }
+    if (threads > 1) lm.thaw();
+    cerr << "Writing LM to " << output_file << " ...\n";
+    model_info info;
+    info.kind = "PYPLM";
+    info.order = N;
+    info.vocab_size = vocab_size;
+    lm.get_hyperparameters(&info.hyperparameters);
+    if (!write_model_file(output_file, info, [&](binary_oarchive& oa) { oa & dict; oa & lm; }))
+      return 1;
+    return 0;
+  }
+};
+
 int main(int argc, char** argv) {
-  if (argc != 4) {
-    cerr << argv[0] << " <training.txt> <output.lm> <nsamples>\n\nEstimate a " << kORDER << "-gram HPYP LM and write it to a file\n100 is usually sufficient for <nsamples>\n";
+  const char* prog = argv[0];
+  unsigned threads = 1;
+  unsigned order = 3;
+  checkpoint_options ckpt_opts;
+  bool seed_given = false;
+  uint64_t seed = 0;
+  bool blocked = false;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+    if (const int n = ckpt_opts.parse(argc, argv)) {
+      argv += n; argc -= n;
+    } else if (!strcmp(argv[1], "-j") && argc > 2) {
+      threads = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else if (!strcmp(argv[1], "-n") && argc > 2) {
+      order = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else if (!strcmp(argv[1], "-b")) {
+      blocked = true;
+      argv += 1; argc -= 1;
+    } else if (!strcmp(argv[1], "-s") && argc > 2) {
+      seed = strtoull(argv[2], nullptr, 10);
+      seed_given = true;
+      argv += 2; argc -= 2;
+    } else {
+      cerr << "Unknown option: " << argv[1] << endl;
+      argc = 0;
+    }
+  }
+  if (argc != 4 || threads == 0 || order == 0 || order > kMAX_ORDER || !ckpt_opts.valid() ||
+      (blocked && threads > 1)) {
+    cerr << prog << " [-n order] [-j nthreads | -b] [-s seed] [-c checkpoint [-i interval] [-r]] <training.txt> <output.lm> <nsamples>\n\nEstimate an n-gram HPYP LM (default: 3-gram, at most " << kMAX_ORDER << ") and write it to a file\n100 is usually sufficient for <nsamples>\n"
+         << "With -j, the corpus is split into nthreads shards that are resampled concurrently,\nwith the unigram and bigram probabilities fixed for the duration of each sample\n"
+         << "With -s, the random streams of the sampler (one per thread) are derived from <seed>,\nso that single-threaded runs are reproducible\n"
+         << "With -b, every sentence is resampled as a block with a Metropolis-Hastings test\n"
+         << checkpoint_options::usage() << "(<nsamples> counts the samples taken before the checkpoint)\n";
     return 1;
   }
-  MT19937 eng;
+  if (!ckpt_opts.check_fresh()) return 1;
+  Xoshiro256 eng = seed_given ? Xoshiro256(seed) : Xoshiro256();
   string train_file = argv[1];
   string output_file = argv[2];
   {
@@ -38,40 +230,18 @@ int main(int argc, char** argv) {
   int samples = atoi(argv[3]);
   assert(samples > 0);
 
-  vector<vector<unsigned> > corpus;
-  set<unsigned> vocabe, tv;
+  FlatCorpus corpus;
+  vector<bool> vocabe;
+  cerr << "Reading corpus...\n";
+  ReadFromFile(train_file, &dict, &corpus, &vocabe, threads);
+  // the boundary markers come after the words of the corpus, so that a
+  // binary corpus keeps its ids and is used in place
   const unsigned kSOS = dict.Convert("<s>");
   const unsigned kEOS = dict.Convert("</s>");
-  cerr << "Reading corpus...\n";
-  ReadFromFile(train_file, &dict, &corpus, &vocabe);
-  cerr << "E-corpus size: " << corpus.size() << " sentences\t (" << vocabe.size() << " word types)\n";
-  PYPLM<kORDER> lm(vocabe.size(), 1, 1, 1, 1);
-  vector<unsigned> ctx(kORDER - 1, kSOS);
-  for (int sample=0; sample < samples; ++sample) {
-    for (const auto& s : corpus) {
-      ctx.resize(kORDER - 1);
-      for (unsigned i = 0; i <= s.size(); ++i) {
-        unsigned w = (i < s.size() ? s[i] : kEOS);
-        if (sample > 0) lm.decrement(w, ctx, eng);
-        lm.increment(w, ctx, eng);
-        ctx.push_back(w);
-      }
-    }
-    if (sample % 10 == 9) {
-      cerr << " [LLH=" << lm.log_likelihood() << "]" << endl;
-      if (sample % 30u == 29) lm.resample_hyperparameters(eng);
-    } else { cerr << '.' << flush; }
-  }
-  cerr << "Writing LM to " << output_file << " ...\n";
-  ofstream ofile(output_file.c_str(), ios::out | ios::binary);
-  if (!ofile.good()) {
-    cerr << "Failed to open " << output_file << " for writing\n";
-    return 1;
-  }
-  boost::archive::binary_oarchive oa(ofile);
-  oa & dict;
-  oa & lm;
-
-  return 0;
+  const unsigned vocab_size = VocabularySize(vocabe);
+  cerr << "E-corpus size: " << corpus.size() << " sentences\t (" << vocab_size << " word types)\n";
+  cerr << "Estimating a " << order << "-gram LM\n";
+  Trainer trainer{corpus, vocab_size, kSOS, kEOS, samples, threads, output_file,
+                  ckpt_opts, blocked, eng};
+  return DispatchOrder(order, trainer);
 }
-
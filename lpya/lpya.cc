@@ -1,12 +1,17 @@
 #include <iostream>
 #include <unordered_map>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "corpus/corpus.h"
 #include "cpyp/m.h"
 #include "cpyp/random.h"
 #include "cpyp/crp.h"
 #include "cpyp/tied_parameter_resampler.h"
+#include "cpyp/checkpoint.h"
 
 using namespace std;
 using namespace cpyp;
@@ -39,50 +44,368 @@ void topic_summary(const unsigned vocab_size, const vector<crp<unsigned>>& topic
   }
 }
 
+// the topic-term restaurants, which are shared by all documents. after
+// enable_concurrency(), documents may be sampled by several threads at once,
+// and each topic is guarded by its own mutex. the topics each word has been
+// seated in (the support of the sparse part of a word_proposal) are recorded
+// too, guarded by one of nstripes mutexes selected by the word
+struct topic_model {
+  topic_model(unsigned topics, unsigned vocab_size) :
+      topic_term(topics, crp<unsigned>(1,1,1,1)), seated(vocab_size), word_mask() {}
+
+  void enable_concurrency(unsigned nstripes = 4096) {
+    assert((nstripes & (nstripes - 1)) == 0);
+    topic_locks.reset(new std::mutex[topic_term.size()]);
+    word_locks.reset(new std::mutex[nstripes]);
+    word_mask = nstripes - 1;
+  }
+
+  std::unique_lock<std::mutex> lock_topic(short k) const {
+    if (!topic_locks) return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(topic_locks[k]);
+  }
+
+  double prob(short k, unsigned w, double p0) const {
+    std::unique_lock<std::mutex> lock = lock_topic(k);
+    return topic_term[k].prob(w, p0);
+  }
+
+  template <class Engine>
+  void increment(short k, unsigned w, double p0, Engine& eng) {
+    bool first;
+    {
+      std::unique_lock<std::mutex> lock = lock_topic(k);
+      first = (topic_term[k].num_customers(w) == 0);
+      topic_term[k].increment(w, p0, eng);
+    }
+    if (first) {
+      std::unique_lock<std::mutex> lock = lock_word(w);
+      seated[w].push_back(k);
+    }
+  }
+
+  template <class Engine>
+  void decrement(short k, unsigned w, Engine& eng) {
+    std::unique_lock<std::mutex> lock = lock_topic(k);
+    topic_term[k].decrement(w, eng);
+  }
+
+  // calls f(k, topic_term[k]) for every topic k that w is seated in, in
+  // order, and forgets the topics w has left
+  template <class F>
+  void for_each_seated_topic(unsigned w, F f) {
+    std::unique_lock<std::mutex> lock = lock_word(w);
+    vector<short>& s = seated[w];
+    sort(s.begin(), s.end());
+    s.erase(unique(s.begin(), s.end()), s.end());
+    unsigned j = 0;
+    for (short k : s) {
+      std::unique_lock<std::mutex> tlock = lock_topic(k);
+      if (!topic_term[k].num_customers(w)) continue;
+      s[j++] = k;
+      f(k, topic_term[k]);
+    }
+    s.resize(j);
+  }
+
+  // the topics of each word are recovered from the restaurants
+  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+    ar & topic_term;
+    if (Archive::is_loading::value) {
+      for (auto& s : seated) s.clear();
+      for (unsigned k = 0; k < topic_term.size(); ++k)
+        for (auto& dish : topic_term[k]) seated[dish.first].push_back(k);
+    }
+  }
+
+  vector<crp<unsigned>> topic_term;
+
+ private:
+  std::unique_lock<std::mutex> lock_word(unsigned w) const {
+    if (!word_locks) return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(word_locks[w & word_mask]);
+  }
+
+  vector<vector<short>> seated;
+  std::unique_ptr<std::mutex[]> topic_locks;
+  std::unique_ptr<std::mutex[]> word_locks;
+  unsigned word_mask;
+};
+
+// Metropolis-Hastings proposals for the topic of an occurrence of a word, as in
+// LightLDA (Yuan et al., 2015). the proposal is proportional to
+// p(w | topic k) as it was when the proposal was last built, and is the
+// mixture of a sparse part (c_kw - d_k t_kw) / (C_k + s_k), over the topics
+// the word is seated in, and a dense part (d_k T_k + s_k) / (C_k + s_k) p0(w)
+// that is shared by all words. both are drawn from alias tables in O(1) and
+// rebuilt once they have been drawn from as many times as they have
+// entries, so rebuilding costs O(1) per draw. the probabilities the tables
+// were built from are kept, so prob() is the exact proposal probability.
+// each sampling thread has its own word_proposal
+struct word_proposal {
+  word_proposal(unsigned vocab_size, unsigned topics, double uniform_word) :
+      p0(uniform_word), dense(topics), dense_draws(topics), sparse(vocab_size) {}
+
+  template <class Engine>
+  short sample(unsigned w, topic_model& model, Engine& eng) {
+    if (dense_draws >= dense.size()) build_dense(model);
+    sparse_part& sp = sparse[w];
+    if (sp.draws >= std::max<size_t>(1, sp.topics.size())) build_sparse(w, model);
+    ++dense_draws;
+    ++sp.draws;
+    if (sample_uniform01<double>(eng) * (sp.alias.sum + p0 * dense_alias.sum) < sp.alias.sum)
+      return sp.topics[sp.alias(eng)];
+    return dense_alias(eng);
+  }
+
+  // probability (up to normalization) with which the last sample(w) call
+  // proposed topic k
+  double prob(unsigned w, short k) const {
+    const sparse_part& sp = sparse[w];
+    double p = p0 * dense[k];
+    const auto it = lower_bound(sp.topics.begin(), sp.topics.end(), k);
+    if (it != sp.topics.end() && *it == k) p += sp.weights[it - sp.topics.begin()];
+    return p;
+  }
+
+ private:
+  struct sparse_part {
+    sparse_part() : draws(~0u) {}
+    vector<short> topics;  // sorted
+    vector<double> weights;
+    alias_distribution<double> alias;
+    unsigned draws;
+  };
+
+  void build_dense(const topic_model& model) {
+    for (unsigned k = 0; k < dense.size(); ++k) {
+      std::unique_lock<std::mutex> lock = model.lock_topic(k);
+      const crp<unsigned>& t = model.topic_term[k];
+      dense[k] = (t.num_tables() * t.discount() + t.strength()) / (t.num_customers() + t.strength());
+    }
+    dense_alias.build(dense);
+    dense_draws = 0;
+  }
+
+  void build_sparse(unsigned w, topic_model& model) {
+    sparse_part& sp = sparse[w];
+    sp.topics.clear();
+    sp.weights.clear();
+    model.for_each_seated_topic(w, [&](short k, const crp<unsigned>& t) {
+      sp.topics.push_back(k);
+      sp.weights.push_back((t.num_customers(w) - t.discount() * t.num_tables(w)) / (t.num_customers() + t.strength()));
+    });
+    if (sp.topics.size()) sp.alias.build(sp.weights); else sp.alias = alias_distribution<double>();
+    sp.draws = 0;
+  }
+
+  double p0;
+  vector<double> dense;
+  alias_distribution<double> dense_alias;
+  unsigned dense_draws;
+  vector<sparse_part> sparse;
+};
+
+// resample the topic of every token in documents [begin, end) with mh_steps
+// Metropolis-Hastings steps (or, if mh_steps is 0, from the exact conditional)
+template <class Engine>
+void sample_documents(const FlatCorpus& corpus, unsigned begin, unsigned end,
+                      bool first, unsigned mh_steps, double uniform_topic, double uniform_word,
+                      vector<vector<short> >& z, vector<crp<short>>& doc_topic,
+                      topic_model& model, word_proposal& wprop, Engine& engine) {
+  uniform_buffer<Engine> eng(engine);
+  const unsigned topics = model.topic_term.size();
+  vector<double> probs(topics);
+  for (unsigned i = begin; i < end; ++i) {
+    const FlatCorpus::Sentence doc = corpus[i];
+    crp<short>& dt = doc_topic[i];
+    for (unsigned j = 0; j < doc.size(); ++j) {
+      const unsigned w = doc[j];
+      short& z_ij = z[i][j];
+      if (!first) {
+        dt.decrement(z_ij, eng);
+        model.decrement(z_ij, w, eng);
+      }
+      if (first) {
+        // random sample during the first iteration
+        z_ij = static_cast<unsigned>(sample_uniform01<float>(eng) * topics);
+      } else if (mh_steps == 0) {
+        for (unsigned k = 0; k < topics; ++k)
+          probs[k] = dt.prob(k, uniform_topic) * model.prob(k, w, uniform_word);
+        multinomial_distribution<double> mult(probs);
+        z_ij = mult(eng);
+      } else {
+        // the doc proposal is proportional to c_k + (d T + s) / K: either
+        // the topic of one of the other tokens of the document or a
+        // uniformly chosen topic
+        const double doc_mass = dt.num_tables() * dt.discount() + dt.strength();
+        auto doc_prop = [&](short k) { return dt.num_customers(k) + doc_mass * uniform_topic; };
+        auto target = [&](short k) { return dt.prob(k, uniform_topic) * model.prob(k, w, uniform_word); };
+        short cur = z_ij;
+        double p_cur = target(cur);
+        for (unsigned step = 0; step < mh_steps; ++step) {
+          short k = wprop.sample(w, model, eng);
+          if (k != cur) {
+            const double p = target(k);
+            if (sample_uniform01<double>(eng) * p_cur * wprop.prob(w, k) < p * wprop.prob(w, cur)) {
+              cur = k;
+              p_cur = p;
+            }
+          }
+          const unsigned others = dt.num_customers();
+          const double u = sample_uniform01<double>(eng) * (others + doc_mass);
+          if (u < others) {
+            const unsigned r = static_cast<unsigned>(u);
+            k = z[i][r < j ? r : r + 1];
+          } else {
+            k = static_cast<unsigned>(sample_uniform01<double>(eng) * topics);
+          }
+          if (k != cur) {
+            const double p = target(k);
+            if (sample_uniform01<double>(eng) * p_cur * doc_prop(k) < p * doc_prop(cur)) {
+              cur = k;
+              p_cur = p;
+            }
+          }
+        }
+        z_ij = cur;
+      }
+      dt.increment(z_ij, uniform_topic, eng);
+      model.increment(z_ij, w, uniform_word, eng);
+    }
+  }
+}
+
+// the state of the sampler after sample samples, following the shape of the
+// training data, which must not change when sampling is resumed. the word
+// proposals are not saved, since they are rebuilt as they are used. streams
+// of threads that did not exist in the run that saved the state keep their
+// seeds
+template <class Archive>
+bool sampler_state(Archive& ar, const FlatCorpus& corpus, unsigned vocab_size,
+                   unsigned& sample, vector<vector<short> >& z, vector<crp<short>>& doc_topic,
+                   topic_model& model, Xoshiro256& eng, vector<Xoshiro256>& engs) {
+  if (!checkpoint::same_value(ar, corpus.size()) || !checkpoint::same_value(ar, corpus.num_tokens()) ||
+      !checkpoint::same_value(ar, vocab_size) || !checkpoint::same_value(ar, model.topic_term.size()))
+    return false;
+  ar & sample;
+  ar & eng;
+  uint64_t nengs = engs.size();
+  ar & nengs;
+  for (uint64_t t = 0; t < nengs; ++t) {
+    Xoshiro256 unused(0);
+    ar & (t < engs.size() ? engs[t] : unused);
+  }
+  ar & z;
+  ar & doc_topic;
+  ar & model;
+  return true;
+}
+
 int main(int argc, char** argv) {
-  if (argc != 4) {
-    cerr << argv[0] << " <training.txt> <ntopics> <nsamples>\n\nEstimate a 'Latent Pitman-Yor Allocation' model\nInput format: each line in <training.txt> is a document\n";
+  const char* prog = argv[0];
+  unsigned threads = 1;
+  checkpoint_options ckpt_opts;
+  bool seed_given = false;
+  uint64_t seed = 0;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+    if (const int n = ckpt_opts.parse(argc, argv)) {
+      argv += n; argc -= n;
+    } else if (!strcmp(argv[1], "-j") && argc > 2) {
+      threads = atoi(argv[2]);
+      argv += 2; argc -= 2;
+    } else if (!strcmp(argv[1], "-s") && argc > 2) {
+      seed = strtoull(argv[2], nullptr, 10);
+      seed_given = true;
+      argv += 2; argc -= 2;
+    } else {
+      cerr << "Unknown option: " << argv[1] << endl;
+      argc = 0;
+    }
+  }
+  if ((argc != 4 && argc != 5) || threads == 0 || !ckpt_opts.valid()) {
+    cerr << prog << " [-j nthreads] [-s seed] [-c checkpoint [-i interval] [-r]] <training.txt> <ntopics> <nsamples> [mh_steps]\n\nEstimate a 'Latent Pitman-Yor Allocation' model\nInput format: each line in <training.txt> is a document\n"
+         << "Each topic assignment is resampled with mh_steps (default: 2) Metropolis-Hastings\nsteps, each costing O(1) time; with mh_steps=0, the O(ntopics) Gibbs sampler is used\n"
+         << "With -j, the documents are split into nthreads shards that are resampled concurrently\n"
+         << "With -s, the random streams of the sampler (one per thread) are derived from <seed>,\nso that single-threaded runs are reproducible\n"
+         << checkpoint_options::usage();
     return 1;
   }
-  MT19937 eng;
+  if (!ckpt_opts.check_fresh()) return 1;
+  Xoshiro256 eng = seed_given ? Xoshiro256(seed) : Xoshiro256();
   string train_file = argv[1];
   const unsigned topics = atoi(argv[2]);
   const unsigned samples = atoi(argv[3]);
+  const unsigned mh_steps = (argc == 5 ? atoi(argv[4]) : 2);
   
-  vector<vector<unsigned> > corpus;
-  set<unsigned> vocab;
-  ReadFromFile(train_file, &dict, &corpus, &vocab);
-  cerr << "Corpus size: " << corpus.size() << " documents\t (" << vocab.size() << " word types)\n";
+  FlatCorpus corpus;
+  vector<bool> vocabe;
+  ReadFromFile(train_file, &dict, &corpus, &vocabe, threads);
+  const unsigned vocab_size = VocabularySize(vocabe);
+  cerr << "Corpus size: " << corpus.size() << " documents\t (" << vocab_size << " word types)\n";
   const double uniform_topic = 1.0 / topics;
-  const double uniform_word = 1.0 / vocab.size();
+  const double uniform_word = 1.0 / vocab_size;
   vector<vector<short> > z;  // topic indicators
   z.resize(corpus.size());
-  vector<crp<unsigned>> topic_term(topics, crp<unsigned>(1,1,1,1));
+  topic_model model(topics, dict.max() + 1);
+  vector<crp<unsigned>>& topic_term = model.topic_term;
   vector<crp<short>> doc_topic(corpus.size(), crp<short>(0.1,1));
   tied_parameter_resampler<crp<short>> doc_params(1,1,1,1,0.1,1);
   for (unsigned i = 0; i < corpus.size(); ++i) {
     doc_params.insert(&doc_topic[i]);
     z[i].resize(corpus[i].size());
   }
-  vector<double> probs(topics);
-  for (unsigned sample=0; sample < samples; ++sample) {
+
+  // each thread gets a contiguous shard of the documents with about the same
+  // number of tokens, its own word proposals and its own random stream
+  vector<unsigned> shards(1, 0);
+  vector<Xoshiro256> engs;
+  if (threads > 1) {
+    cerr << "Sampling with " << threads << " threads\n";
+    const size_t tokens = corpus.num_tokens();
+    size_t seen = 0;
     for (unsigned i = 0; i < corpus.size(); ++i) {
-      const auto& doc = corpus[i];
-      for (unsigned j = 0; j < doc.size(); ++j) {
-        const unsigned w = doc[j];
-        short& z_ij = z[i][j];
-        if (sample > 0) {
-          doc_topic[i].decrement(z_ij, eng);
-          topic_term[z_ij].decrement(w, eng);
-        }
-        for (unsigned k = 0; k < topics; ++k)
-          probs[k] = doc_topic[i].prob(k, uniform_topic) * topic_term[k].prob(w, uniform_word);
-        multinomial_distribution<double> mult(probs);
-        // random sample during the first iteration
-        z_ij = sample ? mult(eng) : static_cast<unsigned>(sample_uniform01<float>(eng) * topics);
-        doc_topic[i].increment(z_ij, uniform_topic, eng);
-        topic_term[z_ij].increment(w, uniform_word, eng);
+      seen += corpus[i].size();
+      if (seen * threads >= tokens * shards.size() && shards.size() < threads)
+        shards.push_back(i + 1);
+    }
+    model.enable_concurrency();
+    doc_params.set_threads(threads);
+    for (unsigned t = 0; t < threads; ++t)
+      engs.push_back(eng.split());
+  }
+  shards.resize(threads, corpus.size());
+  shards.push_back(corpus.size());
+  vector<word_proposal> wprops(threads, word_proposal(dict.max() + 1, topics, uniform_word));
+
+  checkpoint ckpt(ckpt_opts.filename, "lpya");
+  unsigned start = 0;
+  if (ckpt_opts.resume && ckpt.exists()) {
+    cerr << "Resuming from " << ckpt.filename() << " ...\n";
+    if (!ckpt.load([&](binary_iarchive& ia) {
+          if (sampler_state(ia, corpus, vocab_size, start, z, doc_topic, model, eng, engs)) return true;
+          cerr << ckpt.filename() << " was not written for this number of topics and training data\n";
+          return false;
+        }))
+      return 1;
+    // the document restaurants share their hyperparameters
+    if (!doc_topic.empty()) doc_params.set_hyperparameters(doc_topic[0].discount(), doc_topic[0].strength());
+    cerr << "Resuming after sample " << start << endl;
+  }
+
+  for (unsigned sample = start; sample < samples; ++sample) {
+    if (threads > 1) {
+      vector<thread> workers;
+      for (unsigned t = 0; t < threads; ++t) {
+        workers.push_back(thread([&, t]() {
+          sample_documents(corpus, shards[t], shards[t + 1], sample == 0, mh_steps, uniform_topic, uniform_word,
+                           z, doc_topic, model, wprops[t], engs[t]);
+        }));
       }
+      for (auto& w : workers) w.join();
+    } else {
+      sample_documents(corpus, 0, corpus.size(), sample == 0, mh_steps, uniform_topic, uniform_word,
+                       z, doc_topic, model, wprops[0], eng);
     }
     if (sample % 10 == 9) {
       cerr << " [LLH=" << log_likelihood(doc_params, doc_topic, uniform_topic, topic_term, uniform_word) << "]" << endl;
@@ -91,12 +414,15 @@ int main(int argc, char** argv) {
         for (auto& crp : topic_term)
           crp.resample_hyperparameters(eng);
       }
-      topic_summary(vocab.size(), topic_term, uniform_word);
+      topic_summary(vocab_size, topic_term, uniform_word);
     } else { cerr << '.' << flush; }
+    if (ckpt_opts.due(sample + 1, samples)) {
+      unsigned done = sample + 1;
+      ckpt.save([&](binary_oarchive& oa) { sampler_state(oa, corpus, vocab_size, done, z, doc_topic, model, eng, engs); });
+    }
   }
 
   // print out highest probability words in each topic
-  topic_summary(vocab.size(), topic_term, uniform_word);
+  topic_summary(vocab_size, topic_term, uniform_word);
   return 0;
 }
-
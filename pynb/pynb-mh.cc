@@ -1,6 +1,7 @@
 #include <iostream>
 #include <unordered_map>
 #include <cstdlib>
+#include <cstring>
 
 #include "cpyp/logval.h"
 #include "corpus/corpus.h"
@@ -8,6 +9,7 @@
 #include "cpyp/random.h"
 #include "cpyp/crp.h"
 #include "cpyp/tied_parameter_resampler.h"
+#include "cpyp/checkpoint.h"
 
 typedef LogVal<double> prob_t;
 
@@ -25,22 +27,52 @@ double log_likelihood(const crp<short>& dt,
   return llh;
 }
 
+// the state of the sampler after sample samples, following the shape of the
+// training data, which must not change when sampling is resumed
+template <class Archive>
+bool sampler_state(Archive& ar, const FlatCorpus& corpus, unsigned vocab_size,
+                   unsigned& sample, vector<short>& z, crp<short>& label,
+                   vector<crp<unsigned>>& label_term, Xoshiro256& eng) {
+  if (!checkpoint::same_value(ar, corpus.size()) || !checkpoint::same_value(ar, corpus.num_tokens()) ||
+      !checkpoint::same_value(ar, vocab_size) || !checkpoint::same_value(ar, label_term.size()))
+    return false;
+  ar & sample;
+  ar & eng;
+  ar & z;
+  ar & label;
+  ar & label_term;
+  return true;
+}
+
 int main(int argc, char** argv) {
-  if (argc != 4) {
-    cerr << argv[0] << " <training.txt> <nclasses> <nsamples>\n\nEstimate a naive Bayes model with PY priors.\nInput format: each line in <training.txt> is a document\n";
+  const char* prog = argv[0];
+  checkpoint_options ckpt_opts;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+    if (const int n = ckpt_opts.parse(argc, argv)) {
+      argv += n; argc -= n;
+    } else {
+      cerr << "Unknown option: " << argv[1] << endl;
+      argc = 0;
+    }
+  }
+  if (argc != 4 || !ckpt_opts.valid()) {
+    cerr << prog << " [-c checkpoint [-i interval] [-r]] <training.txt> <nclasses> <nsamples>\n\nEstimate a naive Bayes model with PY priors.\nInput format: each line in <training.txt> is a document\n"
+         << checkpoint_options::usage();
     return 1;
   }
-  MT19937 eng;
+  if (!ckpt_opts.check_fresh()) return 1;
+  Xoshiro256 eng;
   string train_file = argv[1];
   const unsigned labels = atoi(argv[2]);
   const unsigned samples = atoi(argv[3]);
   
-  vector<vector<unsigned> > corpus;
-  set<unsigned> vocab;
-  ReadFromFile(train_file, &dict, &corpus, &vocab);
-  cerr << "Corpus size: " << corpus.size() << " documents\t (" << vocab.size() << " word types)\n";
+  FlatCorpus corpus;
+  vector<bool> vocabe;
+  ReadFromFile(train_file, &dict, &corpus, &vocabe, 0);  // one thread per core
+  const unsigned vocab_size = VocabularySize(vocabe);
+  cerr << "Corpus size: " << corpus.size() << " documents\t (" << vocab_size << " word types)\n";
   const double uniform_label = 1.0 / labels;
-  const double uniform_word = 1.0 / vocab.size();
+  const double uniform_word = 1.0 / vocab_size;
   vector<short> z(corpus.size());  // label indicators
   vector<crp<unsigned>> label_term(labels, crp<unsigned>(1,1,1,1));
   crp<short> label(1,1,1,1); // label.prob(k, ...) = conditional prior probability of label
@@ -51,19 +83,33 @@ int main(int argc, char** argv) {
   crp<short> old_label(1,1,1,1);
   crp<unsigned> pre_proposed_label_term(1,1,1,1);
 
-  for (unsigned sample=0; sample < samples; ++sample) {
+  checkpoint ckpt(ckpt_opts.filename, "pynb-mh");
+  unsigned start = 0;
+  if (ckpt_opts.resume && ckpt.exists()) {
+    cerr << "Resuming from " << ckpt.filename() << " ...\n";
+    if (!ckpt.load([&](binary_iarchive& ia) {
+          if (sampler_state(ia, corpus, vocab_size, start, z, label, label_term, eng)) return true;
+          cerr << ckpt.filename() << " was not written for this number of classes and training data\n";
+          return false;
+        }))
+      return 1;
+    cerr << "Resuming after sample " << start << endl;
+  }
+
+  for (unsigned sample = start; sample < samples; ++sample) {
     double mh_acc = 0, mh_rej = 0;
     double p_old = log_likelihood(label, uniform_label, label_term, uniform_word);
+    uniform_buffer<Xoshiro256> buf(eng);
     for (unsigned i = 0; i < corpus.size(); ++i) {
-      const auto& doc = corpus[i];
+      const FlatCorpus::Sentence doc = corpus[i];
 
       // store p(x) and x
       old_label = label;
       old_label_term = label_term[z[i]];
 
       if (sample > 0) {
-        label.decrement(z[i], eng);
-        for (auto& w : doc) label_term[z[i]].decrement(w, eng);
+        label.decrement(z[i], buf);
+        for (auto& w : doc) label_term[z[i]].decrement(w, buf);
       }
 
       // compute posteriors z_i = k
@@ -76,18 +122,18 @@ int main(int argc, char** argv) {
       const double q_old = log(probs[z[i]]);
 
       multinomial_distribution<prob_t> mult(probs);
-      unsigned k = mult(eng);  // sample proposal z_i
-      if (sample == 0) { k = labels * sample_uniform01<double>(eng); }
+      unsigned k = mult(buf);  // sample proposal z_i
+      if (sample == 0) { k = labels * sample_uniform01<double>(buf); }
       pre_proposed_label_term = label_term[k];
       const double q_new = log(probs[k]);
 
-      label.increment(k, uniform_label, eng);
+      label.increment(k, uniform_label, buf);
       for (auto& w : doc)
-        label_term[k].increment(w, uniform_word, eng);
+        label_term[k].increment(w, uniform_word, buf);
       double p_new = log_likelihood(label, uniform_label, label_term, uniform_word);
       if (sample > 0) {
         double acc = exp(p_new - p_old + q_old - q_new);
-        if (acc > 1.0 || sample_uniform01<double>(eng) > acc) {
+        if (acc > 1.0 || sample_uniform01<double>(buf) > acc) {
           p_old = p_new;
           mh_acc++;
         } else { // reject
@@ -110,15 +156,19 @@ int main(int argc, char** argv) {
           crp.resample_hyperparameters(eng);
       }
     } else { cerr << '.' << flush; }
+    if (ckpt_opts.due(sample + 1, samples)) {
+      unsigned done = sample + 1;
+      ckpt.save([&](binary_oarchive& oa) { sampler_state(oa, corpus, vocab_size, done, z, label, label_term, eng); });
+    }
   }
 
   // print out highest probability words in each label
-  vector<double> p(vocab.size());
-  vector<unsigned> ind(vocab.size());
+  vector<double> p(vocab_size);
+  vector<unsigned> ind(vocab_size);
   int k = 0;
   for (auto& lt : label_term) {
     if (lt.num_customers() < 5) { k++; cerr << "LABEL NOT USED\n"; continue; }
-    for (unsigned j = 0; j < vocab.size(); ++j) {
+    for (unsigned j = 0; j < vocab_size; ++j) {
       p[j] = lt.prob(j, uniform_word);
       ind[j] = j;
     }